@@ -0,0 +1,559 @@
+/**
+ * @file bench.cpp
+ * @brief Throughput and latency benchmark of the reconstruction engine on a deterministic synthetic
+ *        MBO workload (or on an MBO CSV file), reporting each stage and the whole per-message path.
+ */
+#include "reconstruction.hpp"
+
+/**
+ * @brief Shape of the synthetic workload.
+ */
+struct SynthSpec {
+    /**
+     * @brief Number of orders added over the run; the other actions are drawn around them.
+     */
+    uint64_t orders {200000};
+    /**
+     * @brief Share of the non-add messages that are cancels; the rest are modifies and T/F/C trades.
+     */
+    double cancelRatio {0.6};
+    /**
+     * @brief Price levels per side that orders are placed on, counted from the touch.
+     */
+    uint32_t levels {20};
+    uint32_t publishers {3};
+    uint32_t instruments {8};
+    uint64_t seed {1};
+};
+
+/**
+ * @brief SplitMix64 random numbers: tiny, fast and the same sequence on every platform.
+ */
+struct SplitMix64 {
+    uint64_t state;
+
+    uint64_t Next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint64_t Below(uint64_t n) { return Next() % n; }
+    double Unit() { return static_cast<double>(Next() >> 11) * 0x1.0p-53; }
+};
+
+/**
+ * @brief Deterministic generator of MBO CSV in the input format of mbo.csv.
+ *
+ * Each book (instrument, publisher) mirrors the engine's queues: orders rest in FIFO order per price,
+ * a modify that moves the price or raises the size goes to the back, and a T/F/C trade fills its
+ * level from the front. Cancels, modifies and trades therefore always refer to resting orders and
+ * the engine logs no warnings. Randomness comes from SplitMix64 rather than the standard
+ * distributions, so a seed yields the same bytes on every platform.
+ */
+class SynthMboGen {
+public:
+    explicit SynthMboGen(const SynthSpec& spec)
+        : spec_(spec), rng_{spec.seed},
+          books_(static_cast<size_t>(std::max<uint32_t>(spec.instruments, 1)) * std::max<uint32_t>(spec.publishers, 1)) {}
+
+    /**
+     * @brief Writes the header and all messages of the workload.
+     * @return The number of messages written.
+     */
+    uint64_t Write(OutBuf& ob) {
+        ob.Append("ts_recv,ts_event,rtype,publisher_id,instrument_id,action,side,price,size,channel_id,order_id,flags,ts_in_delta,sequence,symbol\n");
+        const uint64_t maxLive = 8ULL * std::max<uint32_t>(spec_.levels, 1);
+        for (uint64_t added = 0; added < spec_.orders;) {
+            const size_t bookIdx = static_cast<size_t>(Below(books_.size()));
+            GenBook& b = books_[bookIdx];
+            if (b.ids.empty() || (b.ids.size() < maxLive && Unit() < 0.5)) {
+                const Sd::Type side = Unit() < 0.5 ? Sd::Bid : Sd::Ask;
+                const Ord o{side, Px(bookIdx, side), static_cast<uint32_t>(1 + Below(20) * 10), 0};
+                const uint64_t orderId = nextId_++;
+                b.Insert(orderId, o);
+                Msg(ob, bookIdx, Act::Add, side, o.price, o.size, orderId);
+                ++added;
+                continue;
+            }
+            const uint64_t orderId = b.ids[static_cast<size_t>(Below(b.ids.size()))];
+            Ord& o = b.ords.at(orderId);
+            if (Unit() < spec_.cancelRatio) {
+                const uint32_t sz = Unit() < 0.8 ? o.size : static_cast<uint32_t>(1 + Below(o.size));
+                Msg(ob, bookIdx, Act::Cancel, o.side, o.price, sz, orderId);
+                if ((o.size -= sz) == 0) b.Erase(orderId);
+            } else if (Unit() < 0.6) {
+                Ord mod = o;
+                if (Unit() < 0.3) mod.price = Px(bookIdx, o.side);
+                mod.size = static_cast<uint32_t>(1 + Below(20) * 10);
+                Msg(ob, bookIdx, Act::Modify, mod.side, mod.price, mod.size, orderId);
+                if (mod.price != o.price || mod.size > o.size) {
+                    b.Erase(orderId);
+                    b.Insert(orderId, mod);
+                } else {
+                    o.size = mod.size;
+                }
+            } else {
+                // T and F on the aggressor side, then the cancel that turns them into one trade against
+                // the resting side; the engine takes the size from the front of the level.
+                const Sd::Type aggr = o.side == Sd::Bid ? Sd::Ask : Sd::Bid;
+                const Sd::Type rest = o.side;
+                const int64_t px = o.price;
+                const uint32_t sz = static_cast<uint32_t>(1 + Below(o.size));
+                Msg(ob, bookIdx, Act::Trade, aggr, px, sz, orderId);
+                Msg(ob, bookIdx, Act::Fill, aggr, px, sz, orderId);
+                Msg(ob, bookIdx, Act::Cancel, rest, px, sz, orderId);
+                b.Fill(rest, px, sz);
+            }
+        }
+        return msgs_;
+    }
+
+private:
+    struct Ord {
+        Sd::Type side;
+        int64_t price;
+        uint32_t size;
+        /**
+         * @brief Position in GenBook::ids.
+         */
+        size_t idx;
+    };
+
+    /**
+     * @brief Live orders of one book: by id, in an array for uniform picks, and queued per price.
+     */
+    struct GenBook {
+        std::unordered_map<uint64_t, Ord> ords;
+        std::vector<uint64_t> ids;
+        std::map<std::pair<char, int64_t>, std::deque<uint64_t>> queues;
+
+        void Insert(uint64_t orderId, Ord o) {
+            o.idx = ids.size();
+            ids.push_back(orderId);
+            ords[orderId] = o;
+            queues[{static_cast<char>(o.side), o.price}].push_back(orderId);
+        }
+
+        void Erase(uint64_t orderId) {
+            auto it = ords.find(orderId);
+            const Ord o = it->second;
+            ords.erase(it);
+            ids[o.idx] = ids.back();
+            ids.pop_back();
+            if (o.idx < ids.size()) ords.at(ids[o.idx]).idx = o.idx;
+            auto qIt = queues.find({static_cast<char>(o.side), o.price});
+            std::deque<uint64_t>& q = qIt->second;
+            q.erase(std::find(q.begin(), q.end(), orderId));
+            if (q.empty()) queues.erase(qIt);
+        }
+
+        /**
+         * @brief Takes `sz` from the front of a level, as Book::ProcSynthTrade does.
+         */
+        void Fill(Sd::Type side, int64_t px, uint32_t sz) {
+            while (sz) {
+                const uint64_t front = queues.at({static_cast<char>(side), px}).front();
+                Ord& o = ords.at(front);
+                const uint32_t take = std::min(sz, o.size);
+                sz -= take;
+                if ((o.size -= take) == 0) Erase(front);
+            }
+        }
+    };
+
+    static constexpr int64_t TICK = 10000000;
+
+    uint64_t Below(uint64_t n) { return rng_.Below(n); }
+    double Unit() { return rng_.Unit(); }
+
+    uint32_t InstrId(size_t bookIdx) const { return 1000 + static_cast<uint32_t>(bookIdx / std::max<uint32_t>(spec_.publishers, 1)); }
+    uint16_t PubId(size_t bookIdx) const { return static_cast<uint16_t>(1 + bookIdx % std::max<uint32_t>(spec_.publishers, 1)); }
+
+    /**
+     * @brief Draws a price level, skewed towards the touch, around a fixed mid per instrument.
+     */
+    int64_t Px(size_t bookIdx, Sd::Type side) {
+        const uint32_t levels = std::max<uint32_t>(spec_.levels, 1);
+        const int64_t lvl = static_cast<int64_t>(std::min(Below(levels), Below(levels)));
+        const int64_t mid = (100 + InstrId(bookIdx) % 900) * static_cast<int64_t>(PRICE_SCALE);
+        return side == Sd::Bid ? mid - (1 + lvl) * TICK : mid + (1 + lvl) * TICK;
+    }
+
+    void Msg(OutBuf& ob, size_t bookIdx, Act::Type act, Sd::Type side, int64_t px, uint32_t sz, uint64_t orderId) {
+        ts_ += 1 + static_cast<int64_t>(Below(2000));
+        const int64_t delta = 100000 + static_cast<int64_t>(Below(100000));
+        const uint32_t instrId = InstrId(bookIdx);
+        char* p = ob.Reserve(256);
+        p = PutIsoNanos(p, ts_); *p++ = ',';
+        p = PutIsoNanos(p, ts_ - delta); *p++ = ',';
+        p = PutUInt(p, 160); *p++ = ',';
+        p = PutUInt(p, PubId(bookIdx)); *p++ = ',';
+        p = PutUInt(p, instrId); *p++ = ',';
+        *p++ = static_cast<char>(act); *p++ = ',';
+        *p++ = static_cast<char>(side); *p++ = ',';
+        p = PutNanoPrice(p, px); *p++ = ',';
+        p = PutUInt(p, sz); *p++ = ',';
+        *p++ = '0'; *p++ = ',';
+        p = PutUInt(p, orderId); *p++ = ',';
+        p = PutUInt(p, 130); *p++ = ',';
+        p = PutInt(p, delta); *p++ = ',';
+        p = PutUInt(p, ++msgs_); *p++ = ',';
+        *p++ = 'S';
+        p = PutUInt(p, instrId);
+        *p++ = '\n';
+        ob.Commit(p);
+    }
+
+    SynthSpec spec_;
+    SplitMix64 rng_;
+    std::vector<GenBook> books_;
+    uint64_t nextId_ {1};
+    uint64_t msgs_ {0};
+    int64_t ts_ {1752735909000000000LL};
+};
+
+/**
+ * @brief Per-message latency samples of one stage, in nanoseconds.
+ */
+struct LatSamples {
+    const char* name;
+    std::vector<uint32_t> ns;
+
+    /**
+     * @brief Writes throughput (messages per second of time spent in the stage) and p50/p99/p99.9,
+     *        labelled with the book layout measured.
+     */
+    void Print(std::ostream& os, const char* layout) {
+        if (ns.empty()) return;
+        uint64_t sum = 0;
+        for (uint32_t v : ns) sum += v;
+        std::sort(ns.begin(), ns.end());
+        auto pct = [&](double q) { return ns[std::min(ns.size() - 1, static_cast<size_t>(q * ns.size()))]; };
+        char line[160];
+        std::snprintf(line, sizeof(line), "  %-10s %-3s %10.2f M msg/s  p50 %6u ns  p99 %7u ns  p99.9 %8u ns  max %9u ns\n",
+                      name, layout, sum ? ns.size() * 1e3 / sum : 0.0, pct(0.50), pct(0.99), pct(0.999), ns.back());
+        os << line;
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+inline uint32_t NsSince(Clock::time_point& t) {
+    const Clock::time_point now = Clock::now();
+    const auto d = std::chrono::duration_cast<std::chrono::nanoseconds>(now - t).count();
+    t = now;
+    return static_cast<uint32_t>(std::min<int64_t>(d, UINT32_MAX));
+}
+
+/**
+ * @brief Options of the benchmark run itself.
+ */
+struct BenchOpts {
+    /**
+     * @brief Untimed throughput runs; the best one is reported.
+     */
+    unsigned reps {3};
+    /**
+     * @brief Expected peak number of live orders per book.
+     */
+    size_t expMaxOrds {0};
+};
+
+/**
+ * @brief Figures of one book layout over the workload.
+ */
+struct LayoutResult {
+    const char* layout;
+    /**
+     * @brief Best untimed run in seconds: per message, then in read-ahead batches.
+     */
+    double bestS[2];
+    /**
+     * @brief Latency samples of parse, apply, aggregate, serialize and end to end.
+     */
+    std::vector<LatSamples> stages;
+};
+
+/**
+ * @brief Runs the engine over `csv` untimed `opts.reps` times and keeps the best throughput, then
+ *        once more with a clock reading between the stages of every message.
+ */
+template <class Side, size_t Depth>
+LayoutResult RunBench(const char* layout, std::string_view csv, uint64_t nMsgs, const BenchOpts& opts) {
+    LayoutResult res {layout, {0, 0}, {}};
+    const unsigned reps = opts.reps;
+    constexpr size_t OUT_KEEP = 1 << 20;
+    // Rows are formatted into memory and discarded, so the figures do not include the disk.
+    OutBuf ob(nullptr, 2 * OUT_KEEP);
+
+    // Per message through MboApplier::Apply, and in read-ahead batches through ApplyBatch (as Reconstruct does).
+    for (const bool batched : {false, true}) {
+        double bestS = 0;
+        for (unsigned r = 0; r < reps; ++r) {
+            SymbolTable symbols;
+            SpanLines lines(csv);
+            CsvMboSource<SpanLines> src(lines, symbols);
+            MboApplier<Side, Depth> ap(opts.expMaxOrds);
+            CsvMbpWriterN<Depth> w(ob);
+            const size_t batch = batched ? 32 : 1;
+            std::array<MboSingle, 32> msgs;
+            int rowIdx = 0;
+            auto onApplied = [&](size_t i, uint32_t depth) {
+                const MboSingle& m = msgs[i];
+                w.OnMbp(MbpViewN<Depth>{m, ap.BidLvls(m.instrId), ap.AskLvls(m.instrId), rowIdx++, depth});
+            };
+            const auto t0 = Clock::now();
+            for (;;) {
+                size_t n = 0;
+                while (n < batch && src.Next(msgs[n])) ++n;
+                if (batched) ap.ApplyBatch(msgs.data(), n, onApplied);
+                else if (n) onApplied(0, ap.Apply(msgs[0]));
+                if (ob.View().size() > OUT_KEEP) ob.Clear();
+                if (n < batch) break;
+            }
+            const double s = std::chrono::duration<double>(Clock::now() - t0).count();
+            if (r == 0 || s < bestS) bestS = s;
+            ob.Clear();
+        }
+        res.bestS[batched] = bestS;
+    }
+
+    LatSamples parse{"parse", {}}, apply{"apply", {}}, agg{"aggregate", {}}, ser{"serialize", {}}, total{"end-to-end", {}};
+    for (LatSamples* s : {&parse, &apply, &agg, &ser, &total}) s->ns.reserve(nMsgs);
+    {
+        SymbolTable symbols;
+        SpanLines lines(csv);
+        CsvMboSource<SpanLines> src(lines, symbols);
+        MboApplier<Side, Depth> ap(opts.expMaxOrds);
+        CsvMbpWriterN<Depth> w(ob);
+        MboSingle m;
+        for (int rowIdx = 0;; ++rowIdx) {
+            if (ob.View().size() > OUT_KEEP) ob.Clear();
+            const Clock::time_point start = Clock::now();
+            Clock::time_point t = start;
+            if (!src.Next(m)) break;
+            parse.ns.push_back(NsSince(t));
+            const uint32_t depth = ap.Apply(m);
+            apply.ns.push_back(NsSince(t));
+            const TopLvlsN<Depth>& bids = ap.BidLvls(m.instrId);
+            const TopLvlsN<Depth>& asks = ap.AskLvls(m.instrId);
+            agg.ns.push_back(NsSince(t));
+            w.OnMbp(MbpViewN<Depth>{m, bids, asks, rowIdx, depth});
+            ser.ns.push_back(NsSince(t));
+            total.ns.push_back(static_cast<uint32_t>(std::min<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t - start).count(), UINT32_MAX)));
+        }
+    }
+    for (LatSamples* s : {&parse, &apply, &agg, &ser, &total}) res.stages.push_back(std::move(*s));
+    return res;
+}
+
+/**
+ * @brief Writes the figures of the layouts measured side by side: one throughput column per layout,
+ *        and each stage's latency line once per layout.
+ */
+void PrintResults(std::vector<LayoutResult>& results, uint64_t nMsgs, unsigned reps) {
+    char line[160];
+    std::snprintf(line, sizeof(line), "Throughput (untimed, best of %u):", reps);
+    std::string out = line;
+    out.resize(34, ' ');
+    for (const LayoutResult& r : results) {
+        std::snprintf(line, sizeof(line), "  %-28s", r.layout);
+        out += line;
+    }
+    out.erase(out.find_last_not_of(' ') + 1);
+    out += '\n';
+    for (const int batched : {0, 1}) {
+        std::snprintf(line, sizeof(line), "  %-32s", batched ? "batched" : "per message");
+        out += line;
+        for (const LayoutResult& r : results) {
+            const double s = r.bestS[batched];
+            std::snprintf(line, sizeof(line), "  %6.2f M msg/s %7.1f ns/msg", s > 0 ? nMsgs / s / 1e6 : 0.0, s * 1e9 / std::max<uint64_t>(nMsgs, 1));
+            out += line;
+        }
+        out += '\n';
+    }
+    std::cout << out;
+
+    Clock::time_point t = Clock::now();
+    uint64_t clkSum = 0;
+    constexpr int CLK_READS = 100000;
+    for (int i = 0; i < CLK_READS; ++i) clkSum += NsSince(t);
+
+    std::cout << "Per-message latency (one clock reading per stage, ~" + std::to_string(clkSum / CLK_READS) + " ns each, included):\n";
+    for (size_t s = 0; s < results[0].stages.size(); ++s) {
+        for (LayoutResult& r : results) r.stages[s].Print(std::cout, r.layout);
+    }
+}
+
+/**
+ * @brief Times the scalar and vector level kernels on random ladders: MergeLadders over `pubs`
+ *        publishers and ChangedLvls on snapshot pairs differing in a few levels.
+ * @return false if the two kernels disagree on any input.
+ */
+template <size_t Depth>
+bool RunKernelBench(uint32_t pubs, uint64_t seed) {
+    constexpr size_t SETS = 1024;
+    constexpr int ROUNDS = 200;
+    pubs = std::clamp<uint32_t>(pubs, 2, MERGE_LANES);
+    SplitMix64 rng{seed};
+    // Publisher ladders on a shared tick grid, so merged levels often combine several publishers.
+    std::vector<TopLvlsN<Depth>> lads(SETS * pubs);
+    for (TopLvlsN<Depth>& l : lads) {
+        const size_t n = Depth - static_cast<size_t>(rng.Below(std::min<size_t>(Depth, 3)));
+        int64_t px = 100 * static_cast<int64_t>(PRICE_SCALE);
+        for (size_t i = 0; i < Depth; ++i) {
+            px += static_cast<int64_t>(1 + rng.Below(2)) * 10000000;
+            l[i] = i < n ? PriceLvl{px, static_cast<uint32_t>(1 + rng.Below(500)), static_cast<uint32_t>(1 + rng.Below(5))} : PriceLvl{};
+        }
+    }
+    std::vector<TopLvlsN<Depth>> changed(lads);
+    for (TopLvlsN<Depth>& l : changed) {
+        for (int c = static_cast<int>(rng.Below(3)); c > 0; --c) l[rng.Below(Depth)].size += 1;
+    }
+    std::vector<const TopLvlsN<Depth>*> ptrs(lads.size());
+    for (size_t i = 0; i < lads.size(); ++i) ptrs[i] = &lads[i];
+
+    bool same = true;
+    TopLvlsN<Depth> a, b;
+    for (size_t s = 0; s < SETS; ++s) {
+        MergeLadders<false>(&ptrs[s * pubs], pubs, false, a);
+        MergeLadders<true>(&ptrs[s * pubs], pubs, false, b);
+        same &= ChangedLvlsScalar<Depth>(a, b) == 0;
+        same &= ChangedLvlsScalar<Depth>(lads[s], changed[s]) == ChangedLvlsSimd<Depth>(lads[s], changed[s]);
+    }
+
+    auto time = [&](auto&& kernel) {
+        uint64_t sink = 0;
+        const auto t0 = Clock::now();
+        for (int r = 0; r < ROUNDS; ++r) {
+            for (size_t s = 0; s < SETS; ++s) sink += kernel(s);
+        }
+        const double ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / (ROUNDS * SETS);
+        // Keeps the results observable so the loops are not optimized away.
+        if (sink == 42) std::cout << "";
+        return ns;
+    };
+    TopLvlsN<Depth> out;
+    const double mergeS = time([&](size_t s) { MergeLadders<false>(&ptrs[s * pubs], pubs, false, out); return out[0].size; });
+    const double mergeV = time([&](size_t s) { MergeLadders<true>(&ptrs[s * pubs], pubs, false, out); return out[0].size; });
+    const double diffS = time([&](size_t s) { return ChangedLvlsScalar<Depth>(lads[s], changed[s]); });
+    const double diffV = time([&](size_t s) { return ChangedLvlsSimd<Depth>(lads[s], changed[s]); });
+
+    char line[200];
+    std::snprintf(line, sizeof(line), "Level kernels (%s), MBP-%zu, %u publishers%s:\n", SIMD_ISA, Depth, pubs, same ? "" : " MISMATCH");
+    std::cout << line;
+    std::snprintf(line, sizeof(line), "  merge ladders    scalar %7.1f ns  vector %7.1f ns  (%.2fx)\n", mergeS, mergeV, mergeV > 0 ? mergeS / mergeV : 0.0);
+    std::cout << line;
+    std::snprintf(line, sizeof(line), "  diff snapshots   scalar %7.1f ns  vector %7.1f ns  (%.2fx)\n", diffS, diffV, diffV > 0 ? diffS / diffV : 0.0);
+    std::cout << line;
+    return same;
+}
+
+/**
+ * @brief Benchmarks the selected layouts (vec, map or both) on the same workload and prints them side by side.
+ */
+template <size_t Depth>
+void RunBench(const std::string& layout, std::string_view csv, uint64_t nMsgs, const BenchOpts& opts) {
+    std::vector<LayoutResult> results;
+    if (layout != "map") results.push_back(RunBench<VecSide, Depth>("vec", csv, nMsgs, opts));
+    if (layout != "vec") results.push_back(RunBench<MapSide, Depth>("map", csv, nMsgs, opts));
+    PrintResults(results, nMsgs, opts.reps);
+}
+
+/**
+ * @brief Benchmark driver: generates (or loads) the workload, optionally saves it, and runs RunBench.
+ */
+int main(int argc, char* argv[]) {
+    SynthSpec spec;
+    BenchOpts opts;
+    std::string layout = "both";
+    std::string inPath, genPath;
+    size_t depth = MBP_DEPTH;
+    bool ok = true;
+    try {
+        for (int i = 1; i < argc && ok; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--orders" && i + 1 < argc) spec.orders = FlagNum<unsigned long long>(arg, argv[++i]);
+            else if (arg == "--cancel-ratio" && i + 1 < argc) spec.cancelRatio = std::clamp(FlagNum<double>(arg, argv[++i]), 0.0, 1.0);
+            else if (arg == "--levels" && i + 1 < argc) spec.levels = static_cast<uint32_t>(std::clamp(FlagNum<unsigned long>(arg, argv[++i]), 1UL, 100000UL));
+            else if (arg == "--publishers" && i + 1 < argc) spec.publishers = static_cast<uint32_t>(std::clamp(FlagNum<unsigned long>(arg, argv[++i]), 1UL, 65535UL));
+            else if (arg == "--instruments" && i + 1 < argc) spec.instruments = static_cast<uint32_t>(std::clamp(FlagNum<unsigned long>(arg, argv[++i]), 1UL, 1000000UL));
+            else if (arg == "--seed" && i + 1 < argc) spec.seed = FlagNum<unsigned long long>(arg, argv[++i]);
+            else if (arg == "--reps" && i + 1 < argc) opts.reps = static_cast<unsigned>(std::clamp(FlagNum<unsigned long>(arg, argv[++i]), 1UL, 1000UL));
+            else if (arg == "--expect-orders" && i + 1 < argc) opts.expMaxOrds = FlagNum<unsigned long long>(arg, argv[++i]);
+            else if (arg == "--book-layout" && i + 1 < argc && (std::string(argv[i + 1]) == "map" || std::string(argv[i + 1]) == "vec" || std::string(argv[i + 1]) == "both")) layout = argv[++i];
+            else if (arg == "--depth" && i + 1 < argc && (std::string(argv[i + 1]) == "1" || std::string(argv[i + 1]) == "10" || std::string(argv[i + 1]) == "50")) depth = FlagNum<unsigned long>(arg, argv[++i]);
+            else if (arg == "--input" && i + 1 < argc) inPath = argv[++i];
+            else if (arg == "--gen" && i + 1 < argc) genPath = argv[++i];
+            else ok = false;
+        }
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        ok = false;
+    }
+    if (!ok) {
+        std::cerr << "Usage: " << argv[0] << " [--orders N] [--cancel-ratio R] [--levels L] [--publishers P] [--instruments I]\n"
+                  << "           [--seed S] [--reps N] [--expect-orders N] [--book-layout vec|map|both] [--depth 1|10|50]\n"
+                  << "           [--input FILE | --gen FILE]\n"
+                  << "  --orders N          Orders added by the synthetic workload (default 200000).\n"
+                  << "  --cancel-ratio R    Share of non-add messages that are cancels (default 0.6); the rest are\n"
+                  << "                      modifies and T/F/C trades.\n"
+                  << "  --levels L          Price levels per side that orders are placed on (default 20).\n"
+                  << "  --publishers P      Publishers per instrument (default 3).\n"
+                  << "  --instruments I     Instruments (default 8).\n"
+                  << "  --seed S            Generator seed (default 1); a seed always produces the same workload.\n"
+                  << "  --reps N            Untimed throughput runs; the best is reported (default 3).\n"
+                  << "  --expect-orders N   Preallocate book storage for N live orders per book.\n"
+                  << "  --book-layout L     Price-level storage to measure: vec, map or (default) both, side by side.\n"
+                  << "  --depth 1|10|50     As for the reconstruction driver.\n"
+                  << "  --input FILE        Benchmark an MBO CSV file instead of the synthetic workload.\n"
+                  << "  --gen FILE          Write the synthetic workload to FILE as MBO CSV and exit.\n";
+        return 1;
+    }
+
+    std::string csvBuf;
+    MappedFile inMap;
+    std::string_view csv;
+    if (!inPath.empty()) {
+        if (!LoadInput(inPath, inMap, csvBuf, csv)) {
+            std::cerr << "Error: Open MBO file: " + inPath + "\n";
+            return 1;
+        }
+    } else {
+        OutBuf gen(nullptr, 64 << 20);
+        SynthMboGen(spec).Write(gen);
+        csvBuf.assign(gen.View());
+        csv = csvBuf;
+    }
+    if (!genPath.empty()) {
+        std::ofstream os(genPath, std::ios::binary);
+        if (!os.write(csv.data(), static_cast<std::streamsize>(csv.size()))) {
+            std::cerr << "Error: Write MBO file: " + genPath + "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    const uint64_t nMsgs = static_cast<uint64_t>(std::count(csv.begin(), csv.end(), '\n')) - 1 + (!csv.empty() && csv.back() != '\n');
+    char line[256];
+    if (inPath.empty()) {
+        std::snprintf(line, sizeof(line), "Workload: synthetic, seed %llu, %llu orders, %u instruments x %u publishers, %u levels, cancel ratio %.2f\n",
+                      static_cast<unsigned long long>(spec.seed), static_cast<unsigned long long>(spec.orders),
+                      spec.instruments, spec.publishers, spec.levels, spec.cancelRatio);
+    } else {
+        std::snprintf(line, sizeof(line), "Workload: %s\n", inPath.c_str());
+    }
+    std::cout << line;
+    std::snprintf(line, sizeof(line), "Messages: %llu (%.1f MB of CSV), MBP-%zu, %s layout%s\n",
+                  static_cast<unsigned long long>(nMsgs), csv.size() / 1e6, depth, layout.c_str(), layout == "both" ? "s" : "");
+    std::cout << line;
+
+    if (depth == 1) RunBench<1>(layout, csv, nMsgs, opts);
+    else if (depth == 50) RunBench<50>(layout, csv, nMsgs, opts);
+    else RunBench<10>(layout, csv, nMsgs, opts);
+    const bool kernelsOk = depth == 1 ? RunKernelBench<1>(spec.publishers, spec.seed)
+                         : depth == 50 ? RunKernelBench<50>(spec.publishers, spec.seed)
+                                       : RunKernelBench<10>(spec.publishers, spec.seed);
+    return kernelsOk ? 0 : 1;
+}
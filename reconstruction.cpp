@@ -1,635 +1,248 @@
-#include <algorithm>
-#include <cstdint>
-#include <cmath>
-#include <cstdio>
-#include <cstdlib>
-#include <fstream>
-#include <iostream>
-#include <iterator>
-#include <map>
-#include <sstream>
-#include <stdexcept>
-#include <string>
-#include <unordered_map>
-#include <utility>
-#include <vector>
-#include <iomanip>
-#include <list>
-
-/**
- * @brief A value for prices that are undefined or not applicable.
- */
-const int64_t UNDEFINED_PRICE = -9223372036854775807LL;
-
-/** 
-* @brief Namespace for action types in the market data. 
-*/
-namespace Act {
-enum Type : char { Add = 'A', Cancel = 'C', Modify = 'M', Clear = 'R', Trade = 'T', Fill = 'F', None = 'N' };
-inline std::string ToStr(Type a) {
-    switch (a) {
-        case Add: return "Add"; case Cancel: return "Cancel"; case Modify: return "Modify"; case Clear: return "Clear";
-        case Trade: return "Trade"; case Fill: return "Fill"; case None: return "None";
-    }
-    return "Unknown";
-}}
-
-/**
- * @brief Namespace for side types in the market data.
- */
-namespace Sd {
-enum Type : char { Ask = 'A', Bid = 'B', None = 'N' };
-inline std::string ToStr(Type s) {
-    switch (s) {
-        case Ask: return "Ask"; case Bid: return "Bid"; case None: return "None";
-    }
-    return "Unknown";
-}}
-
-/**
- * @brief Structure representing a single Market By Order (MBO) message.
- */
-struct MboSingle {
-    std::string tsRecv;
-    std::string tsEvent;
-    uint8_t rtype;
-    uint16_t pubId;
-    uint32_t instrId;
-    Act::Type action;
-    Sd::Type side;
-    int64_t price;
-    uint32_t size;
-    uint8_t chanId;
-    uint64_t orderId;
-    uint8_t flags;
-    int32_t tsInDelta;
-    uint32_t sequence;
-    std::string symbol;
-};
-
-/**
- * @brief Scale factor for converting prices to/from nanoseconds.
- */
-const double PRICE_SCALE = 1e9;
-
-
-/**
- * @brief Converts a price in nanoseconds to a double representation.
- */
-inline double ToDblPrice(int64_t priceNano) {
-    if (priceNano == UNDEFINED_PRICE) return NAN;
-    return static_cast<double>(priceNano) / PRICE_SCALE;
-}
-
-/**
- * @brief Converts a double price to its nanosecond representation.
- */
-inline int64_t ToNanoPrice(double priceDbl) {
-    if (std::isnan(priceDbl)) return UNDEFINED_PRICE;
-    return static_cast<int64_t>(std::round(priceDbl * PRICE_SCALE));
-}
+#include "reconstruction.hpp"
 
+#include <csignal>
 
 /**
- * @brief Structure representing a price level in the order book.
- * 
- * combined information for all orders at a specific price point,
- * including the total quantity available and the number of individual orders.
+ * @brief Run-time options of a reconstruction run.
  */
-struct PriceLvl {
-    int64_t price {UNDEFINED_PRICE};
-    uint32_t size {0};
-    uint32_t count {0};
-    bool IsEmpty() const { return price == UNDEFINED_PRICE; }
-    operator bool() const { return !IsEmpty(); }
-};
-
-
-/**
- * @brief For easy printing of priceLvl object to an outputstream.
- * @param stream The output stream (e.g., std::cout, std::ofstream).
- * @param level The PriceLvl object to print.
- * @return A reference to the output stream, enabling chaining of operations.
- */
-std::ostream& operator<<(std::ostream& stream, const PriceLvl& level) {
-    stream << level.size << " @ " << std::fixed << std::setprecision(9) << ToDblPrice(level.price) << " | "
-           << level.count << " order(s)";
-    return stream;
-}
-
-
-/**
- * @brief For easy printing of MboSingle object to an outputstream.
- * @param os The output stream (e.g., std::cout, std::ofstream).
- * @param m The MboSingle object to print.
- * @return A reference to the output stream, enabling chaining of operations.
- */
-std::ostream& operator<<(std::ostream& os, const MboSingle& m) {
-    os << "MboSingle { tsRecv: " << m.tsRecv
-       << ", tsEvent: " << m.tsEvent
-       << ", rtype: " << static_cast<int>(m.rtype)
-       << ", pubId: " << m.pubId
-       << ", instrId: " << m.instrId
-       << ", action: '" << Act::ToStr(m.action) << "'"
-       << ", side: '" << Sd::ToStr(m.side) << "'"
-       << ", price: " << std::fixed << std::setprecision(9) << ToDblPrice(m.price)
-       << ", size: " << m.size
-       << ", chanId: " << static_cast<int>(m.chanId)
-       << ", orderId: " << m.orderId
-       << ", flags: " << static_cast<int>(m.flags)
-       << ", tsInDelta: " << m.tsInDelta
-       << ", sequence: " << m.sequence
-       << ", symbol: " << m.symbol << " }";
-    return os;
-}
-
-
-/**
- * @brief Class representing a market order book.Which is being deferentiated on instrumentId and publisherId which is managed by market class.
- * 
- */
-class Book {
-public:
-
+struct RunOpts {
     /**
-     * @brief Returns the best bid and ask price levels.
+     * @brief Expected peak number of live orders per book.
      */
-    std::pair<PriceLvl, PriceLvl> Bbo() const { 
-        return {GetBidLvl(0), GetAskLvl(0)}; 
-    }
-
+    size_t expMaxOrds {0};
     /**
-     * @brief Returns the bid price level at a given index.
-     * @param idx The index of the bid level to retrieve.
+     * @brief Worker threads for ReconstructSharded; 0 runs single-threaded.
      */
-    PriceLvl GetBidLvl(size_t idx) const {
-        if (bids_.size() > idx) { auto it = bids_.rbegin(); std::advance(it, idx); return CalcPriceLvl(it->first, it->second); }
-        return PriceLvl{};
-    }
-
+    unsigned nThreads {0};
     /**
-     * @brief Returns the ask price level at a given index.
-     * @param idx The index of the ask level to retrieve.
+     * @brief Parser threads for PreparsedCsvSource; 0 parses on the reading thread.
      */
-    PriceLvl GetAskLvl(size_t idx) const {
-        if (offers_.size() > idx) { auto it = offers_.begin(); std::advance(it, idx); return CalcPriceLvl(it->first, it->second); }
-        return PriceLvl{};
-    }
-
+    unsigned nPreparse {0};
     /**
-     * @brief Returns a vector of aggregated bid price levels.
-     * @param numLvls The number of bid levels to retrieve.
+     * @brief Run the parse/apply/serialize pipeline (ReconstructPipelined).
      */
-    std::vector<PriceLvl> GetBidLvls(size_t numLvls) const {
-        std::vector<PriceLvl> lvls; lvls.reserve(numLvls); auto it = bids_.rbegin();
-        for (size_t i = 0; i < numLvls && it != bids_.rend(); ++i, ++it) lvls.emplace_back(CalcPriceLvl(it->first, it->second));
-        return lvls;
-    }
-
+    bool pipeline {false};
     /**
-     * @brief Returns a vector of aggregated ask price levels.
-     * @param numLvls The number of ask levels to retrieve.
+     * @brief Messages per pipeline batch.
      */
-    std::vector<PriceLvl> GetAskLvls(size_t numLvls) const {
-        std::vector<PriceLvl> lvls; lvls.reserve(numLvls); auto it = offers_.begin();
-        for (size_t i = 0; i < numLvls && it != offers_.end(); ++i, ++it) lvls.emplace_back(CalcPriceLvl(it->first, it->second));
-        return lvls;
-    }
-
-    /**
-     * @brief Calculates the depth of a bid level at a specific price.
-     * @param price The price of the bid level.
-     */
-    uint32_t GetBidLevelDepth(int64_t price) const {
-        uint32_t depth = 0;
-        for (auto r_it = bids_.rbegin(); r_it != bids_.rend(); ++r_it) {
-            if (r_it->first == price) {
-                return depth;
-            }
-            if (r_it->first < price) {
-                return 0;
-            }
-            ++depth;
-        }
-        return 0;
-    }
-
-    /**
-     * @brief Calculates the depth of an ask level at a specific price.
-     * @param price The price of the ask level.
-     */
-    uint32_t GetAskLevelDepth(int64_t price) const {
-        auto it = offers_.lower_bound(price);
-        if (it == offers_.end() || it->first != price) {
-            return 0;
-        }
-        return std::distance(offers_.begin(), it);
-    }
-
-    /**
-     * @brief Applies a market by order message to the book.
-     */
-    void Apply(const MboSingle& m) {
-        switch (m.action) {
-            case Act::Clear: Clear(); break;
-            case Act::Add: Add(m); break;
-            case Act::Cancel: Cancel(m); break;
-            case Act::Modify: Modify(m); break;
-            case Act::Trade: case Act::Fill: case Act::None: break;
-            default: std::cerr << "Unknown action: " << Act::ToStr(m.action) << ". Ignoring.\n";
-        }
-    }
-
-    /**
-     * @brief Processes a synthetic trade by adjusting the book.
-     * @param px The price of the synthetic trade.
-     * @param sz The size of the synthetic trade.
-     * @param sideAff The side affected by the synthetic trade (Bid or Ask).
-     */
-    void ProcSynthTrade(int64_t px, uint32_t sz, Sd::Type sideAff) {
-        LvlOrds& affLvls = GetSdOrds(sideAff);
-        auto lvlIt = affLvls.find(px);
-        if (lvlIt == affLvls.end()) {
-            std::cerr << "Warn: Synth trade at non-existent lvl " << Sd::ToStr(sideAff) << " @ "
-                      << std::fixed << std::setprecision(9) << ToDblPrice(px) << " sz " << sz << ". Ign.\n";
-            return;
-        }
-        LvlOrdsInQ& ordsAtLvl = lvlIt->second;
-        uint32_t remSz = sz;
-        auto curOrd = ordsAtLvl.begin();
-        while (curOrd != ordsAtLvl.end() && remSz > 0) {
-            if (curOrd->size <= remSz) {
-                remSz -= curOrd->size;
-                ordsById_.erase(curOrd->orderId);
-                curOrd = ordsAtLvl.erase(curOrd);
-            } else {
-                curOrd->size -= remSz;
-                remSz = 0;
-            }
-        }
-        if (ordsAtLvl.empty()) RemLvl(sideAff, px);
-    }
-
-private:
-    /**
-     * @brief Type for storing orders at a specific price level.
-     */
-    using LvlOrdsInQ = std::list<MboSingle>;
-    /**
-     * @brief Type for mapping order IDs to their price and side.
-     */
-    struct PxAndSd { int64_t price; Sd::Type side; };
+    size_t batchSz {4096};
     /**
-     * @brief Type for mapping order IDs to their price and side.
+     * @brief CPUs to pin the pipeline stages to.
      */
-    using OrdsById = std::unordered_map<uint64_t, PxAndSd>;
+    std::vector<int> pinCpus;
     /**
-     * @brief Type for storing orders by price level.
+     * @brief Levels per side in each row: 1, 10 or 50.
      */
-    using LvlOrds = std::map<int64_t, LvlOrdsInQ>;
-
-
+    size_t depth {MBP_DEPTH};
     /**
-     * @brief Calculates the aggregated price level from a list of orders at a specific price.
-     * @param px The price level.
-     * @param lvl The list of orders at that price level.
-     * @return A PriceLvl object containing the aggregated size and count of orders at that price.
+     * @brief Write a row only when the instrument's top levels changed (ConflatedWriter).
      */
-    static PriceLvl CalcPriceLvl(int64_t px, const LvlOrdsInQ& lvl) {
-        PriceLvl res{px};
-        for (const auto& ord : lvl) {
-            ++res.count;
-            res.size += ord.size;
-        }
-        return res;
-    }
-
+    bool changesOnly {false};
     /**
-     * @brief Finds an order in a specific price level.
-     * @param lvl The list of orders at that price level.
-     * @param ordId The order ID to find.
-     * @return An iterator to the order if found, otherwise an iterator to the end of the list.
+     * @brief Conflation window per instrument in microseconds; 0 disables conflation.
      */
-    LvlOrdsInQ::iterator GetLvlOrd(LvlOrdsInQ& lvl, uint64_t ordId) {
-        return std::find_if(lvl.begin(), lvl.end(), [ordId](const MboSingle& o) { return o.orderId == ordId; });
-    }
-
+    int64_t conflateUs {0};
     /**
-     * @brief Clears the book, removing all orders.
+     * @brief Rows of an instrument between two snapshots in delta output.
      */
-    void Clear() { 
-        ordsById_.clear(); offers_.clear(); bids_.clear(); 
-    }
-
+    uint32_t snapEvery {DeltaMbpWriterN<MBP_DEPTH>::SNAP_EVERY};
     /**
-     * @brief Adds a new order to the book.
-     * @param m The MboSingle message containing the order details.
+     * @brief Bounds of the pending T/F table.
      */
-    void Add(MboSingle m) {
-        LvlOrdsInQ& lvl = GetOrInsLvl(m.side, m.price);
-        lvl.emplace_back(std::move(m));
-        auto r = ordsById_.emplace(m.orderId, PxAndSd{m.price, m.side});
-        if (!r.second) throw std::invalid_argument{"Dupe ID " + std::to_string(m.orderId) + " for Add"};
-    }
-
+    PendingTfLimits pending;
     /**
-     * @brief Cancels an order in the book.
-     * @param m The MboSingle message containing the order ID and details.
+     * @brief Where the hot-path stats summary goes (empty: stderr), and seconds between periodic summaries.
      */
-    void Cancel(MboSingle m) {
-        auto psIt = ordsById_.find(m.orderId);
-        if (psIt == ordsById_.end()) { std::cerr << "Warn: Cancel unk ID " + std::to_string(m.orderId) + ". Ign.\n"; return; }
-        LvlOrdsInQ& lvl = GetLvl(psIt->second.side, psIt->second.price);
-        auto ordIt = GetLvlOrd(lvl, m.orderId);
-        if (ordIt == lvl.end()) { std::cerr << "IntErr: ID " + std::to_string(m.orderId) + " in map but not in list.\n"; return; }
-        if (ordIt->size < m.size) { std::cerr << "Warn: Partial cancel > existing sz. ID " + std::to_string(m.orderId) + ". Cap to 0.\n"; ordIt->size = 0; }
-        else ordIt->size -= m.size;
-        if (ordIt->size == 0) {
-            ordsById_.erase(m.orderId);
-            lvl.erase(ordIt);
-            if (lvl.empty()) RemLvl(psIt->second.side, psIt->second.price);
-        }
-    }
-
+    std::string statsPath;
+    double statsEveryS {0};
     /**
-     * @brief Modifies an existing order in the book.
-     * @param m The MboSingle message containing the updated order details.
+     * @brief Most warnings per category, thread and second written by WarnLog; 0 writes all.
      */
-    void Modify(MboSingle m) {
-        auto psIt = ordsById_.find(m.orderId);
-        if (psIt == ordsById_.end()) { Add(m); return; }
-        if (psIt->second.side != m.side) throw std::logic_error{"ID " + std::to_string(m.orderId) + " changed side."};
-        int64_t prevPx = psIt->second.price;
-        LvlOrdsInQ& prevLvl = GetLvl(m.side, prevPx);
-        auto ordIt = GetLvlOrd(prevLvl, m.orderId);
-        if (ordIt == prevLvl.end()) { std::cerr << "IntErr: ID " + std::to_string(m.orderId) + " in map but not in prev list.\n"; return; }
-        if (prevPx != m.price) {
-            psIt->second.price = m.price;
-            prevLvl.erase(ordIt);
-            if (prevLvl.empty()) RemLvl(m.side, prevPx);
-            LvlOrdsInQ& newLvl = GetOrInsLvl(m.side, m.price);
-            newLvl.emplace_back(std::move(m));
-        } else {
-            if (ordIt->size < m.size) {
-                prevLvl.erase(ordIt);
-                prevLvl.emplace_back(std::move(m));
-            } else {
-                ordIt->size = m.size;
-            }
-        }
-    }
+    uint64_t logRate {WarnLog::DEF_RATE};
     /**
-     * @brief Gets the orders for a specific side (Bid or Ask).
-     * @param s The side type (Bid or Ask).
-     * @return A reference to the map of orders for that side.
+     * @brief Checkpoint file and messages between checkpoints, and the checkpoint the run resumes from.
      */
-    LvlOrds& GetSdOrds(Sd::Type s) {
-        switch (s) { case Sd::Ask: return offers_; case Sd::Bid: return bids_; default: throw std::invalid_argument{"Invalid side."}; }
-    }
-
-    /**
-     * @brief Gets the orders for a specific side and price level.
-     * @param s The side type (Bid or Ask).
-     * @param px The price level.
-     * @return A reference to the list of orders at that price level.
-     */
-    LvlOrdsInQ& GetLvl(Sd::Type s, int64_t px) {
-        LvlOrds& lvls = GetSdOrds(s); auto lvlIt = lvls.find(px);
-        if (lvlIt == lvls.end()) {
-             std::ostringstream oss;
-             oss << "Access unk lvl " << Sd::ToStr(s) << " @ " << std::fixed << std::setprecision(9) << ToDblPrice(px);
-             throw std::invalid_argument{oss.str()};
-        }
-        return lvlIt->second;
-    }
-
-    /**
-     * @brief Gets or inserts a new level for a specific side and price.
-     * @param s The side type (Bid or Ask).
-     * @param px The price level.
-     * @return A reference to the list of orders at that price level, creating it if it doesn't exist.
-     */
-    LvlOrdsInQ& GetOrInsLvl(Sd::Type s, int64_t px) { 
-        return GetSdOrds(s)[px]; 
-    }
-
-    /**
-     * @brief Removes a level for a specific side and price.
-     * @param s The side type (Bid or Ask).
-     * @param px The price level to remove.
-     */
-    void RemLvl(Sd::Type s, int64_t px) { GetSdOrds(s).erase(px); }
-
-    /**
-     * @brief Maps order IDs to their price and side.
-     */
-    OrdsById ordsById_;
-    /**
-     * @brief Maps ask price levels to their orders.
-     */
-    LvlOrds offers_;
-    /**
-     * @brief Maps bid price levels to their orders.
-     */
-    LvlOrds bids_;
+    CkptPlan ckpt;
+    std::string restorePath;
 };
 
+/**
+ * @brief True for sources that report their input offset (CsvMboSource, BinMboSource), which checkpoints need.
+ */
+template <class Source, class = void>
+struct HasOffset : std::false_type {};
+template <class Source>
+struct HasOffset<Source, std::void_t<decltype(std::declval<Source&>().Offset())>> : std::true_type {};
 
 /**
- * @brief Class representing a market, which contains multiple books differentiated by instrument ID and publisher ID.
+ * @brief Warns about T/F messages whose cancel never arrived before they were evicted from the pending table.
  */
-class Market {
-public:
+void ReportPending(const PendingTfStats& st) {
+    if (st.evictedAge == 0 && st.evictedFull == 0) return;
+    std::cerr << "Warn: Pending T/F evicted without a cancel: " + std::to_string(st.evictedAge) + " aged out, " +
+                 std::to_string(st.evictedFull) + " table full (" + std::to_string(st.added) + " added, " +
+                 std::to_string(st.matched) + " matched, " + std::to_string(st.live) + " still pending).\n";
+}
 
-    /**
-    * @brief Retrieves aggregated bid price levels for a specific instrument across all publishers.
-    * @param instrId The unique identifier of the financial instrument.
-    * @param numLvls The maximum number of aggregated price levels to return 
-    * @return A `std::vector` of `PriceLvl` objects, sorted from the highest (best) bid price downwards.
-    */
-    std::vector<PriceLvl> GetAggBidLvls(uint32_t instrId, size_t numLvls) const {
-        std::map<int64_t, PriceLvl> aggBids;
-        auto itInstrBooks = books_.find(instrId);
-        if (itInstrBooks != books_.end()) {
-            for (const auto& pair : itInstrBooks->second) {
-                const auto& pb_book = pair.second;
-                const auto blvls = pb_book.GetBidLvls(numLvls);
-                for (const auto& lvl : blvls) {
-                    if (lvl.IsEmpty()) continue;
-                    aggBids[lvl.price].size += lvl.size;
-                    aggBids[lvl.price].count += lvl.count;
-                    aggBids[lvl.price].price = lvl.price;
-                }
+/**
+ * @brief Picks the book layout, output format, depth and threading chosen on the command line and runs Reconstruct
+ *        (or ReconstructSharded / ReconstructPipelined).
+ */
+template <class Side, class Writer, class Source, class... WriterArgs>
+void RunReconstruct(Source& src, OutBuf& ob, const RunOpts& opts, const WriterArgs&... writerArgs) {
+    if (opts.nThreads) {
+        ReportPending(ReconstructSharded<Side, Writer>(src, ob, opts.expMaxOrds, opts.nThreads, opts.pending));
+    } else if (opts.pipeline) {
+        ReportPending(ReconstructPipelined<Side, Writer>(src, ob, opts.expMaxOrds, opts.batchSz, opts.pinCpus, opts.pending));
+    } else if (opts.changesOnly || opts.conflateUs) {
+        ConflatedWriter<Writer> w(ob, opts.changesOnly, opts.conflateUs * 1000, writerArgs...);
+        ReportPending(Reconstruct<Side>(src, w, opts.expMaxOrds, opts.pending));
+        w.Finish();
+        std::cerr << "Rows dropped by the row filter: " + std::to_string(w.Dropped()) + "\n";
+    } else {
+        Writer w(ob, writerArgs...);
+        if constexpr (HasOffset<Source>::value) {
+            if (opts.ckpt.restore || !opts.ckpt.path.empty()) {
+                if (opts.ckpt.restore) src.Seek(opts.ckpt.hdr.inputOff);
+                ReportPending(Reconstruct<Side>(src, w, opts.expMaxOrds, opts.pending, opts.ckpt));
+                return;
             }
         }
-        std::vector<PriceLvl> res; res.reserve(numLvls); auto it = aggBids.rbegin();
-        for (size_t i = 0; i < numLvls && it != aggBids.rend(); ++i, ++it) res.emplace_back(it->second);
-        return res;
-    }
-
-    /**
-     * @brief Retrieves aggregated ask price levels for a specific instrument across all publishers.
-     * @param instrId The unique identifier of the financial instrument.
-     * @param numLvls The maximum number of aggregated price levels to return.
-     * @return A `std::vector` of `PriceLvl` objects, sorted from
-     */
-    std::vector<PriceLvl> GetAggAskLvls(uint32_t instrId, size_t numLvls) const {
-        std::map<int64_t, PriceLvl> aggAsks;
-        auto itInstrBooks = books_.find(instrId);
-        if (itInstrBooks != books_.end()) {
-            for (const auto& pair : itInstrBooks->second) {
-                const auto& pb_book = pair.second;
-                const auto alvls = pb_book.GetAskLvls(numLvls);
-                for (const auto& lvl : alvls) {
-                    if (lvl.IsEmpty()) continue;
-                    aggAsks[lvl.price].size += lvl.size;
-                    aggAsks[lvl.price].count += lvl.count;
-                    aggAsks[lvl.price].price = lvl.price;
-                }
-            }
+        ReportPending(Reconstruct<Side>(src, w, opts.expMaxOrds, opts.pending));
+        if constexpr (std::is_same_v<Writer, DeltaMbpWriterN<Writer::DEPTH>>) {
+            std::cerr << "Rows skipped with no level changed: " + std::to_string(w.Skipped()) + "\n";
         }
-        std::vector<PriceLvl> res; res.reserve(numLvls); auto it = aggAsks.begin();
-        for (size_t i = 0; i < numLvls && it != aggAsks.end(); ++i, ++it) res.emplace_back(it->second);
-        return res;
     }
+}
 
-    /**
-     * @brief Gets the depth of a specific level in the book for a given instrument and publisher.
-     * @param instrId The unique identifier of the financial instrument.
-     * @param pubId The unique identifier of the publisher.
-     * @param price The price level to check.
-     * @param side The side of the book (Bid or Ask).
-     * @return The depth of the level at the specified price, or 0 if the level does not exist.
-     */
-    uint32_t GetLevelDepth(uint32_t instrId, uint16_t pubId, int64_t price, Sd::Type side) const {
-        auto itInstrBooks = books_.find(instrId);
-        if (itInstrBooks == books_.end()) return 0;
-
-        auto itPubBook = itInstrBooks->second.find(pubId);
-        if (itPubBook != itInstrBooks->second.end()) {
-            if (side == Sd::Bid) return itPubBook->second.GetBidLevelDepth(price);
-            else if (side == Sd::Ask) return itPubBook->second.GetAskLevelDepth(price);
-        }
-        return 0;
+template <size_t Depth, class Source>
+void RunReconstruct(const std::string& layout, const std::string& format, Source& src, OutBuf& ob, const RunOpts& opts) {
+    if (format == "bin") {
+        if (layout == "map") RunReconstruct<MapSide, BinMbpWriterN<Depth>>(src, ob, opts);
+        else RunReconstruct<VecSide, BinMbpWriterN<Depth>>(src, ob, opts);
+    } else if (format == "delta") {
+        if (layout == "map") RunReconstruct<MapSide, DeltaMbpWriterN<Depth>>(src, ob, opts, opts.snapEvery);
+        else RunReconstruct<VecSide, DeltaMbpWriterN<Depth>>(src, ob, opts, opts.snapEvery);
+    } else {
+        if (layout == "map") RunReconstruct<MapSide, CsvMbpWriterN<Depth>>(src, ob, opts);
+        else RunReconstruct<VecSide, CsvMbpWriterN<Depth>>(src, ob, opts);
     }
+}
 
-    /**
-     * @brief Applies a market by order message to the appropriate book.
-     * @param m The MboSingle message containing the order details.
-     */
-    void Apply(const MboSingle& m) {
-        books_[m.instrId][m.pubId].Apply(m);
-    }
+template <class Source>
+void RunReconstruct(const std::string& layout, const std::string& format, Source& src, OutBuf& ob, const RunOpts& opts) {
+    if (opts.depth == 1) RunReconstruct<1>(layout, format, src, ob, opts);
+    else if (opts.depth == 50) RunReconstruct<50>(layout, format, src, ob, opts);
+    else RunReconstruct<10>(layout, format, src, ob, opts);
+}
 
-    /**
-     * @brief Processes a synthetic trade for a specific instrument and publisher.
-     * @param instrId The unique identifier of the financial instrument.
-     * @param pubId The unique identifier of the publisher.
-     * @param px The price of the synthetic trade.
-     * @param sz The size of the synthetic trade.
-     * @param sideAff The side affected by the synthetic trade (Bid or Ask).
-     */
-    void ProcSynthTrade(uint32_t instrId, uint16_t pubId, int64_t px, uint32_t sz, Sd::Type sideAff) {
-        auto itInstrBooks = books_.find(instrId);
-        if (itInstrBooks == books_.end()) {
-            std::cerr << "Err: Synth trade for non-existent instr " << instrId << ". Ign.\n";
-            return;
-        }
-        auto itPubBook = itInstrBooks->second.find(pubId);
-        if (itPubBook == itInstrBooks->second.end()) {
-            std::cerr << "Err: Synth trade for non-existent book (Instr: " + std::to_string(instrId) + ", Pub: " + std::to_string(pubId) + "). Ign.\n";
-            return;
+/**
+ * @brief Splits a live endpoint spec ("tcp:HOST:PORT", "udp:HOST:PORT", "shm:NAME") into its kind and address.
+ * @return false if `spec` is a plain path.
+ */
+bool SplitEndpoint(const std::string& spec, std::string& kind, std::string& addr) {
+    for (const char* k : {"tcp", "udp", "shm"}) {
+        if (spec.size() > 4 && spec.compare(0, 3, k) == 0 && spec[3] == ':') {
+            kind = k;
+            addr = spec.substr(4);
+            return true;
         }
-        itPubBook->second.ProcSynthTrade(px, sz, sideAff);
     }
-
-private:
-    /**
-     * @brief Type for mapping publisher IDs to their respective books.
-     */
-    std::unordered_map<uint32_t, std::unordered_map<uint16_t, Book>> books_;
-};
+    return false;
+}
 
 /**
- * @brief Parses a line from the MBO input file and returns a MboSingle object.
- * @param line The line to parse.
- * @return A MboSingle object containing the parsed data.
+ * @brief Opens the MBP output named by `--output`: "-" (stdout), "tcp:HOST:PORT", "shm:NAME" or a file path.
+ * @return The stream, or nullptr after reporting the error.
  */
-MboSingle ParseMboLine(const std::string& line) {
-    MboSingle m;
-    std::string t;
-    std::istringstream ss(line);
-
-    std::getline(ss, m.tsRecv, ',');
-    std::getline(ss, m.tsEvent, ',');
-    std::getline(ss, t, ','); m.rtype = static_cast<uint8_t>(std::stoul(t));
-    std::getline(ss, t, ','); m.pubId = static_cast<uint16_t>(std::stoul(t));
-    std::getline(ss, t, ','); m.instrId = static_cast<uint32_t>(std::stoul(t));
-    std::getline(ss, t, ','); m.action = static_cast<Act::Type>(t[0]);
-    std::getline(ss, t, ','); m.side = static_cast<Sd::Type>(t[0]);
-    std::getline(ss, t, ','); m.price = t.empty() ? UNDEFINED_PRICE : ToNanoPrice(std::stod(t));
-    std::getline(ss, t, ','); m.size = static_cast<uint32_t>(std::stoul(t));
-    std::getline(ss, t, ','); m.chanId = static_cast<uint8_t>(std::stoul(t));
-    std::getline(ss, t, ','); m.orderId = static_cast<uint64_t>(std::stoull(t));
-    std::getline(ss, t, ','); m.flags = static_cast<uint8_t>(std::stoul(t));
-    std::getline(ss, t, ','); m.tsInDelta = static_cast<int32_t>(std::stol(t));
-    std::getline(ss, t, ','); m.sequence = static_cast<uint32_t>(std::stoul(t));
-    std::getline(ss, m.symbol);
-    return m;
+std::FILE* OpenMbpOutput(const std::string& spec, bool binary, bool append, const PollOpts& poll) {
+    if (spec == "-") return stdout;
+    std::string kind, addr;
+    if (!SplitEndpoint(spec, kind, addr)) return std::fopen(spec.c_str(), append ? (binary ? "ab" : "a") : (binary ? "wb" : "w"));
+#ifdef RECON_HAVE_POSIX_IO
+    try {
+        if (kind == "tcp") {
+            // A vanished reader then fails the write instead of killing the process.
+            std::signal(SIGPIPE, SIG_IGN);
+            return ::fdopen(OpenTcp(addr), binary ? "wb" : "w");
+        }
+#ifdef __GLIBC__
+        if (kind == "shm") return OpenRingStream(ShmRing::Create(addr, 1 << 24, poll));
+#endif
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+    }
+#endif
+    (void)poll;
+    return nullptr;
 }
 
 /**
- * @brief Writes the header for the Market By Price (MBP) output file.
- * @param os The output stream to write the header to.
+ * @brief Converts a binary MBP file to CSV (the --bin2csv mode).
+ * @return The process exit code.
  */
-void WriteMbpHdr(std::ostream& os) {
-    os << ",ts_recv,ts_event,rtype,publisher_id,instrument_id,action,side,depth,price,size,flags,ts_in_delta,sequence,";
-    for (int i = 0; i < 10; ++i) {
-        os << "bid_px_" << std::setw(2) << std::setfill('0') << i << ",";
-        os << "bid_sz_" << std::setw(2) << std::setfill('0') << i << ",";
-        os << "bid_ct_" << std::setw(2) << std::setfill('0') << i << ",";
-        os << "ask_px_" << std::setw(2) << std::setfill('0') << i << ",";
-        os << "ask_sz_" << std::setw(2) << std::setfill('0') << i << ",";
-        os << "ask_ct_" << std::setw(2) << std::setfill('0') << i;
-        if (i < 9) os << ",";
+int RunBinToCsv(const std::string& binPath, const std::string& csvPath) {
+    MappedFile binMap;
+    std::string binBuf;
+    std::string_view bin;
+    if (!LoadInput(binPath, binMap, binBuf, bin)) {
+        std::cerr << "Error: Open binary MBP file: " + binPath + "\n";
+        return 1;
+    }
+    std::FILE* csvFile = std::fopen(csvPath.c_str(), "w");
+    if (!csvFile) {
+        std::cerr << "Error: Open MBP file: " + csvPath + "\n";
+        return 1;
     }
-    os << ",symbol,order_id\n";
+    int rc = 0;
+    try {
+        OutBuf ob(csvFile);
+        BinToCsv(bin, ob);
+        ob.Flush();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        rc = 1;
+    }
+    std::fclose(csvFile);
+    if (rc == 0) std::cout << "Converted " + binPath + " to " + csvPath + "\n";
+    return rc;
 }
 
 /**
- * @brief Writes a row to the Market By Price (MBP) output file.
- * @param os The output stream to write the row to.
- * @param mi The MboSingle object containing the data for the row.
- * @param bl The aggregated bid price levels.
- * @param al The aggregated ask price levels.
- * @param rIdx The index of the row being written.
- * @param depth_val The depth value for the row.
+ * @brief Converts an MBO CSV file to a binary MBO file and symbol file (the --csv2mbo mode).
+ * @return The process exit code.
  */
-void WriteMbpRow(std::ostream& os, const MboSingle& mi, const std::vector<PriceLvl>& bl, const std::vector<PriceLvl>& al, int rIdx, uint32_t depth_val) {
-    os << rIdx << ",";
-    os << mi.tsRecv << "," << mi.tsEvent << "," << static_cast<uint32_t>(10) << "," << static_cast<uint32_t>(mi.pubId) << ","
-       << static_cast<uint32_t>(mi.instrId) << "," << mi.action << "," << mi.side << "," << depth_val << ",";
-
-    if (mi.price == UNDEFINED_PRICE) os << ",";
-    else os << std::fixed << std::setprecision(9) << ToDblPrice(mi.price) << ",";
-
-    os << static_cast<uint32_t>(mi.size) << "," << static_cast<uint32_t>(mi.flags) << "," << static_cast<int32_t>(mi.tsInDelta) << ","
-       << static_cast<uint32_t>(mi.sequence) << ",";
-
-    for (size_t i = 0; i < 10; ++i) {
-        if (i < bl.size() && bl[i]) {
-            os << std::fixed << std::setprecision(9) << ToDblPrice(bl[i].price) << "," << static_cast<uint32_t>(bl[i].size) << "," << static_cast<uint32_t>(bl[i].count) << ",";
-        } else {
-            os << ",0,0,";
-        }
-        if (i < al.size() && al[i]) {
-            os << std::fixed << std::setprecision(9) << ToDblPrice(al[i].price) << "," << static_cast<uint32_t>(al[i].size) << "," << static_cast<uint32_t>(al[i].count);
-        } else {
-            os << ",0,0";
-        }
-        if (i < 9) os << ",";
+int RunCsvToBinMbo(const std::string& csvPath, const std::string& binPath, const std::string& symPath) {
+    MappedFile csvMap;
+    std::string csvBuf;
+    std::string_view csv;
+    if (!LoadInput(csvPath, csvMap, csvBuf, csv)) {
+        std::cerr << "Error: Open MBO file: " + csvPath + "\n";
+        return 1;
     }
-    os << "," << mi.symbol << "," << static_cast<uint64_t>(mi.orderId) << "\n";
+    std::FILE* binFile = std::fopen(binPath.c_str(), "wb");
+    if (!binFile) {
+        std::cerr << "Error: Open binary MBO file: " + binPath + "\n";
+        return 1;
+    }
+    SymbolTable symbols;
+    int rc = 0;
+    try {
+        OutBuf ob(binFile);
+        SpanLines lines(csv);
+        CsvToBinMbo(lines, ob, symbols);
+        ob.Flush();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        rc = 1;
+    }
+    std::fclose(binFile);
+    if (rc == 0 && !symbols.Save(symPath)) {
+        std::cerr << "Error: Write symbol file: " + symPath + "\n";
+        rc = 1;
+    }
+    if (rc == 0) std::cout << "Converted " + csvPath + " to " + binPath + " and " + symPath + "\n";
+    return rc;
 }
 
 /**
@@ -637,91 +250,239 @@ void WriteMbpRow(std::ostream& os, const MboSingle& mi, const std::vector<PriceL
  * @param argc The number of command line arguments.
  */
 int main(int argc, char* argv[]) {
-    std::ios_base::sync_with_stdio(false);
-    std::cin.tie(NULL);
-
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <mbo_input_file.csv>\n";
+    std::string mboFilePath;
+    RunOpts opts;
+    std::string layout = "vec";
+    std::string format = "csv";
+    std::string mboFormat = "csv";
+    std::string symPath;
+    std::string mbpOutPath;
+    std::string flushMode = "batch";
+    size_t flushBytes = 1 << 20;
+    PollOpts pollOpts;
+    bool useMmap = true;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--bin2csv" && argc == 4 && i == 1) return RunBinToCsv(argv[2], argv[3]);
+            if (arg == "--csv2mbo" && argc == 5 && i == 1) return RunCsvToBinMbo(argv[2], argv[3], argv[4]);
+            if (arg == "--expect-orders" && i + 1 < argc) opts.expMaxOrds = FlagNum<unsigned long long>(arg, argv[++i]);
+            else if (arg == "--format" && i + 1 < argc && (std::string(argv[i + 1]) == "csv" || std::string(argv[i + 1]) == "bin" || std::string(argv[i + 1]) == "delta")) format = argv[++i];
+            else if (arg == "--book-layout" && i + 1 < argc && (std::string(argv[i + 1]) == "map" || std::string(argv[i + 1]) == "vec")) layout = argv[++i];
+            else if (arg == "--mbo-format" && i + 1 < argc && (std::string(argv[i + 1]) == "csv" || std::string(argv[i + 1]) == "bin")) mboFormat = argv[++i];
+            else if (arg == "--symbols" && i + 1 < argc) symPath = argv[++i];
+            else if (arg == "--no-mmap") useMmap = false;
+            else if (arg == "--threads" && i + 1 < argc) opts.nThreads = static_cast<unsigned>(std::min(FlagNum<unsigned long>(arg, argv[++i]), 1024UL));
+            else if (arg == "--pipeline") opts.pipeline = true;
+            else if (arg == "--preparse" && i + 1 < argc) opts.nPreparse = static_cast<unsigned>(std::min(FlagNum<unsigned long>(arg, argv[++i]), 1024UL));
+            else if (arg == "--depth" && i + 1 < argc && (std::string(argv[i + 1]) == "1" || std::string(argv[i + 1]) == "10" || std::string(argv[i + 1]) == "50")) opts.depth = FlagNum<unsigned long>(arg, argv[++i]);
+            else if (arg == "--snapshot-every" && i + 1 < argc) opts.snapEvery = static_cast<uint32_t>(std::min(FlagNum<unsigned long>(arg, argv[++i]), 0xffffffffUL));
+            else if (arg == "--changes-only") opts.changesOnly = true;
+            else if (arg == "--conflate-us" && i + 1 < argc) opts.conflateUs = static_cast<int64_t>(std::min(FlagNum<unsigned long long>(arg, argv[++i]), 1ULL << 40));
+            else if (arg == "--pending-cap" && i + 1 < argc) opts.pending.cap = std::clamp<size_t>(FlagNum<unsigned long long>(arg, argv[++i]), 1, 1ULL << 30);
+            else if (arg == "--pending-max-age" && i + 1 < argc) opts.pending.maxAge = FlagNum<unsigned long long>(arg, argv[++i]);
+            else if (arg == "--log-rate" && i + 1 < argc) opts.logRate = FlagNum<unsigned long long>(arg, argv[++i]);
+            else if (arg == "--stats-file" && i + 1 < argc) opts.statsPath = argv[++i];
+            else if (arg == "--stats-every" && i + 1 < argc) opts.statsEveryS = std::max(FlagNum<double>(arg, argv[++i]), 0.0);
+            else if (arg == "--checkpoint" && i + 1 < argc) opts.ckpt.path = argv[++i];
+            else if (arg == "--checkpoint-every" && i + 1 < argc) opts.ckpt.every = std::max<uint64_t>(FlagNum<unsigned long long>(arg, argv[++i]), 1);
+            else if (arg == "--restore" && i + 1 < argc) opts.restorePath = argv[++i];
+            else if (arg == "--output" && i + 1 < argc) mbpOutPath = argv[++i];
+            else if (arg == "--flush" && i + 1 < argc && (std::string(argv[i + 1]) == "row" || std::string(argv[i + 1]) == "batch")) flushMode = argv[++i];
+            else if (arg == "--flush-bytes" && i + 1 < argc) flushBytes = std::clamp<size_t>(FlagNum<unsigned long long>(arg, argv[++i]), 64, 1ULL << 30);
+            else if (arg == "--busy-poll") pollOpts.busyPoll = true;
+            else if (arg == "--batch" && i + 1 < argc) opts.batchSz = std::max<size_t>(FlagNum<unsigned long long>(arg, argv[++i]), 1);
+            else if (arg == "--pin-cpus" && i + 1 < argc) {
+                CsvFields cpus(argv[++i]);
+                for (std::string_view c = cpus.Next(); !c.empty(); c = cpus.Next()) opts.pinCpus.push_back(FlagNum<int>(arg, c));
+            }
+            else if (mboFilePath.empty() && (arg == "-" || arg.rfind("--", 0) != 0)) mboFilePath = arg;
+            else { mboFilePath.clear(); break; }
+        }
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        mboFilePath.clear();
+    }
+    if ((opts.nThreads && opts.pipeline) || (opts.nPreparse && mboFormat == "bin")) mboFilePath.clear();
+    if ((opts.changesOnly || opts.conflateUs || format == "delta") && (opts.nThreads || opts.pipeline)) mboFilePath.clear();
+    const bool ckptRun = !opts.ckpt.path.empty() || !opts.restorePath.empty();
+    if (ckptRun && (opts.nThreads || opts.pipeline || opts.nPreparse || opts.changesOnly || opts.conflateUs || format == "delta")) mboFilePath.clear();
+    if (opts.ckpt.every == 0) opts.ckpt.every = 1000000;
+    std::string liveKind, liveAddr, outKind, outAddr;
+    const bool live = mboFilePath == "-" || SplitEndpoint(mboFilePath, liveKind, liveAddr);
+    const bool liveOut = mbpOutPath == "-" || SplitEndpoint(mbpOutPath, outKind, outAddr);
+    if ((live && (mboFormat == "bin" || opts.nPreparse)) || (liveOut && !opts.restorePath.empty())) mboFilePath.clear();
+    if (mboFilePath.empty()) {
+        std::cerr << "Usage: " << argv[0] << " <mbo_input_file.csv|-|tcp:HOST:PORT|udp:HOST:PORT|shm:NAME> [--expect-orders N] [--book-layout vec|map] [--no-mmap] [--format csv|bin|delta]\n"
+                  << "           [--mbo-format csv|bin] [--symbols FILE] [--threads N | --pipeline [--batch N]] [--pin-cpus A[,B,C]]\n"
+                  << "           [--preparse N] [--depth 1|10|50] [--changes-only] [--conflate-us X]\n"
+                  << "           [--snapshot-every K] [--pending-cap N] [--pending-max-age N]\n"
+                  << "           [--stats-file FILE] [--stats-every SEC] [--log-rate N]\n"
+                  << "           [--checkpoint FILE [--checkpoint-every N]] [--restore FILE]\n"
+                  << "           [--output FILE|-|tcp:HOST:PORT|shm:NAME] [--flush row|batch] [--flush-bytes N] [--busy-poll]\n"
+                  << "       " << argv[0] << " --bin2csv <mbp_input_file.bin> <mbp_output_file.csv>\n"
+                  << "       " << argv[0] << " --csv2mbo <mbo_input_file.csv> <mbo_output_file.bin> <symbol_output_file.csv>\n"
+                  << "  -                       Read the MBO input from stdin.\n"
+                  << "  tcp:HOST:PORT           Read MBO CSV from a TCP stream: connect to HOST, or with tcp::PORT accept one peer.\n"
+                  << "  udp:HOST:PORT           Read MBO CSV lines from datagrams received on HOST:PORT (udp::PORT: any address).\n"
+                  << "  shm:NAME                Read MBO CSV from the shared-memory ring NAME created by the feed handler.\n"
+                  << "  --expect-orders N       Preallocate book storage for N live orders per book.\n"
+                  << "  --book-layout vec|map   Price-level storage: flat sorted vector (default) or std::map.\n"
+                  << "  --no-mmap               Read the input file through a stream instead of mapping it.\n"
+                  << "  --format csv|bin|delta  Write output.csv (default), fixed-width binary records to output.bin or\n"
+                  << "                          changed levels only to output_delta.csv.\n"
+                  << "  --mbo-format csv|bin    Input is MBO CSV (default) or binary MBO records.\n"
+                  << "  --symbols FILE          instrument_id,symbol mapping for binary MBO input.\n"
+                  << "  --threads N             Shard instruments over N worker threads (0, the default, runs single-threaded).\n"
+                  << "  --pipeline              Run parse, book update and formatting as three threads handing over batches.\n"
+                  << "  --batch N               Messages per pipeline batch (default 4096); live input is handed on a full\n"
+                  << "                          batch at a time, so keep N small when latency matters.\n"
+                  << "  --pin-cpus A[,B,C]      Pin the pipeline's parse, apply and serialize stages to CPUs A, B and C;\n"
+                  << "                          a single-threaded run pins its one thread to A.\n"
+                  << "  --preparse N            Parse the CSV input on N threads, a bounded window of chunks ahead of the book logic.\n"
+                  << "  --depth 1|10|50         Levels per side in each row: MBP-1, MBP-10 (default) or MBP-50.\n"
+                  << "  --changes-only          Write a row only when the instrument's top levels changed.\n"
+                  << "  --conflate-us X         Write at most one row per instrument per X microseconds of ts_recv.\n"
+                  << "  --snapshot-every K      Delta output: full snapshot every K messages of an instrument (default 1000, 0: first only).\n"
+                  << "  --pending-cap N         Most T/F messages kept waiting for their cancel (default 4096); the oldest is dropped.\n"
+                  << "  --pending-max-age N     Drop a pending T/F once N newer T/F messages arrived (default 0: twice the cap).\n"
+                  << "  --stats-file FILE       Write the hot-path stats summary to FILE instead of stderr (make stats builds only).\n"
+                  << "  --stats-every SEC       Also write a summary every SEC seconds while running.\n"
+                  << "  --log-rate N            Write at most N warnings per category and second (default 1000, 0: all).\n"
+                  << "  --checkpoint FILE       Save the books, pending T/F messages and input/output positions to FILE\n"
+                  << "                          (single-threaded csv/bin output only).\n"
+                  << "  --checkpoint-every N    Messages between two checkpoints (default 1000000).\n"
+                  << "  --restore FILE          Resume from a checkpoint: the output is cut back to the checkpoint and appended to.\n"
+                  << "  --output SPEC           Write the MBP output to a file, stdout (-), a TCP stream (tcp:HOST:PORT connects,\n"
+                  << "                          tcp::PORT accepts one peer) or a new shared-memory ring (shm:NAME).\n"
+                  << "  --flush row|batch       Write each row out as soon as it is formatted, or (default) in batches; batches\n"
+                  << "                          are also written whenever live input runs dry.\n"
+                  << "  --flush-bytes N         Output batch size in bytes (default 1048576).\n"
+                  << "  --busy-poll             Spin on live input (and a full output ring) instead of sleeping in the kernel.\n"
+                  << "  --bin2csv IN OUT        Convert a binary MBP file back to CSV.\n"
+                  << "  --csv2mbo IN OUT SYMS   Convert MBO CSV to binary MBO records plus a symbol file.\n";
         return 1;
     }
 
-    std::string mboFilePath = argv[1];
-    std::string mbpOutPath = "output.csv";
-    std::ifstream mboIs(mboFilePath);
-    if (!mboIs.is_open()) {
+    // Standard streams are only used from one thread in single-threaded mode; workers log concurrently.
+    if (opts.nThreads == 0 && !opts.pipeline) {
+        std::ios_base::sync_with_stdio(false);
+        std::cin.tie(NULL);
+    }
+
+    if (mbpOutPath.empty()) mbpOutPath = format == "bin" ? "output.bin" : format == "delta" ? "output_delta.csv" : "output.csv";
+    SymbolTable symbols;
+    if (!symPath.empty() && !symbols.Load(symPath)) {
+        std::cerr << "Error: Open symbol file: " + symPath + "\n";
+        return 1;
+    }
+    MappedFile mboMap;
+    std::string mboBuf;
+    std::string_view mboData;
+    std::ifstream mboIs;
+    if ((mboFormat == "bin" || opts.nPreparse) && !LoadInput(mboFilePath, mboMap, mboBuf, mboData)) {
         std::cerr << "Error: Open MBO file: " + mboFilePath + "\n";
         return 1;
     }
-    std::ofstream mbpOs(mbpOutPath);
-    if (!mbpOs.is_open()) {
+    const bool mapped = mboFormat == "csv" && !opts.nPreparse && useMmap && !live && mboMap.Open(mboFilePath);
+    if (mboFormat == "csv" && !opts.nPreparse && !mapped && !live) {
+        mboIs.open(mboFilePath);
+        if (!mboIs.is_open()) {
+            std::cerr << "Error: Open MBO file: " + mboFilePath + "\n";
+            return 1;
+        }
+    }
+    std::string ckptBody;
+    if (!opts.restorePath.empty()) {
+        try {
+            opts.ckpt.hdr = ReadCheckpoint(opts.restorePath, ckptBody);
+            std::error_code ec;
+            if (std::filesystem::file_size(mbpOutPath, ec) < opts.ckpt.hdr.outputOff || ec) {
+                throw std::runtime_error{"MBP file " + mbpOutPath + " is shorter than at the checkpoint"};
+            }
+            std::filesystem::resize_file(mbpOutPath, opts.ckpt.hdr.outputOff);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        opts.ckpt.restore = &ckptBody;
+        std::cerr << "Resuming from " + opts.restorePath + " after " + std::to_string(opts.ckpt.hdr.msgs) + " messages (sequence " +
+                     std::to_string(opts.ckpt.hdr.lastSeq) + ", input byte " + std::to_string(opts.ckpt.hdr.inputOff) + ").\n";
+    }
+    std::FILE* mbpFile = OpenMbpOutput(mbpOutPath, format == "bin", opts.ckpt.restore, pollOpts);
+    if (!mbpFile) {
         std::cerr << "Error: Open MBP file: " + mbpOutPath + "\n";
         return 1;
     }
-  
-    WriteMbpHdr(mbpOs);
-    Market market;
-    std::string line;
-    int mbpRowIdx = 0;
-    std::unordered_map<uint64_t, MboSingle> pendingTFs;
-
-    std::getline(mboIs, line);
-
-    while (std::getline(mboIs, line)) {
-        MboSingle m = ParseMboLine(line);
-        uint32_t current_depth = 0;
-
-        if (m.action == Act::Trade && m.side == Sd::None) {
-            current_depth = 0;
-        } else if (m.action == Act::Trade || m.action == Act::Fill) {
-            pendingTFs[m.orderId] = m;
-            current_depth = 0;
-        } else if (m.action == Act::Cancel) {
-            auto itPend = pendingTFs.find(m.orderId);
-            if (itPend != pendingTFs.end()) {
-                MboSingle origTFM = std::move(itPend->second);
-                pendingTFs.erase(itPend);
-
-                Sd::Type sideAff;
-                if (origTFM.side == Sd::Ask) sideAff = Sd::Bid;
-                else if (origTFM.side == Sd::Bid) sideAff = Sd::Ask;
-                else {
-                    std::cerr << "Warn: T/F in TFC for ID " + std::to_string(m.orderId) + " Side::None. Skipping synth trade.\n";
-                    current_depth = 0;
-                    auto bl = market.GetAggBidLvls(m.instrId, 10);
-                    auto al = market.GetAggAskLvls(m.instrId, 10);
-                    WriteMbpRow(mbpOs, m, bl, al, mbpRowIdx++, current_depth);
-                    continue;
-                }
-                
-                try {
-                    market.ProcSynthTrade(m.instrId, m.pubId, origTFM.price, origTFM.size, sideAff);
-                } catch (const std::exception& e) {
-                    std::cerr << "Err synth trade ID " + std::to_string(m.orderId) + ": " + e.what() + "\n";
-                }
-                current_depth = market.GetLevelDepth(m.instrId, m.pubId, origTFM.price, sideAff);
-
-            } else {
-                market.Apply(m);
-                current_depth = market.GetLevelDepth(m.instrId, m.pubId, m.price, m.side);
-            }
+    OutBuf mbpOut(mbpFile, flushBytes);
+    if (flushMode == "row") mbpOut.FlushAt(1);
+    // Only the single-threaded run formats rows on the reading thread, which may then flush them while it waits.
+    if (opts.nThreads == 0 && !opts.pipeline) pollOpts.flushWhenIdle = &mbpOut;
+    if (opts.nThreads == 0 && !opts.pipeline && !opts.pinCpus.empty() && !PinThisThread(opts.pinCpus[0])) {
+        std::cerr << "Warn: Could not pin to CPU " + std::to_string(opts.pinCpus[0]) + ".\n";
+    }
+    if (opts.ckpt.restore) mbpOut.Resume(opts.ckpt.hdr.outputOff);
+    opts.ckpt.out = &mbpOut;
+    WarnLog::Get().SetRate(opts.logRate);
+#ifdef RECON_STATS
+    StatsReporter statsRep(opts.statsPath, opts.statsEveryS);
+#else
+    if (!opts.statsPath.empty() || opts.statsEveryS > 0) std::cerr << "Warn: Built without RECON_STATS (make stats); --stats-file and --stats-every are ignored.\n";
+#endif
+
+    try {
+        if (mboFormat == "bin") {
+            BinMboSource src(mboData, symbols);
+            RunReconstruct(layout, format, src, mbpOut, opts);
+        } else if (opts.nPreparse) {
+            PreparsedCsvSource src(mboData, symbols, opts.nPreparse);
+            RunReconstruct(layout, format, src, mbpOut, opts);
+        } else if (mapped) {
+            SpanLines lines(mboMap.View());
+            CsvMboSource<SpanLines> src(lines, symbols);
+            RunReconstruct(layout, format, src, mbpOut, opts);
+        } else if (!live) {
+            StreamLines lines(mboIs);
+            CsvMboSource<StreamLines> src(lines, symbols);
+            RunReconstruct(layout, format, src, mbpOut, opts);
+        }
+#ifdef RECON_HAVE_POSIX_IO
+        else if (liveKind == "shm") {
+            std::unique_ptr<ShmRing> ring = ShmRing::Open(liveAddr, pollOpts);
+            ChunkLines<ShmRing> lines(*ring);
+            CsvMboSource<ChunkLines<ShmRing>> src(lines, symbols);
+            RunReconstruct(layout, format, src, mbpOut, opts);
         } else {
-            market.Apply(m);
-            if (m.action == Act::Add || m.action == Act::Modify) {
-                current_depth = market.GetLevelDepth(m.instrId, m.pubId, m.price, m.side);
-            } else if (m.action == Act::Clear) {
-                current_depth = 0;
-            }
+            const int fd = liveKind == "tcp" ? OpenTcp(liveAddr) : liveKind == "udp" ? OpenUdp(liveAddr) : 0;
+            FdReader rd(fd, fd != 0, liveKind == "udp", pollOpts);
+            ChunkLines<FdReader> lines(rd);
+            CsvMboSource<ChunkLines<FdReader>> src(lines, symbols);
+            RunReconstruct(layout, format, src, mbpOut, opts);
         }
-
-        auto bl = market.GetAggBidLvls(m.instrId, 10);
-        auto al = market.GetAggAskLvls(m.instrId, 10);
-        WriteMbpRow(mbpOs, m, bl, al, mbpRowIdx++, current_depth);
+#else
+        else if (liveKind.empty()) {
+            StreamLines lines(std::cin);
+            CsvMboSource<StreamLines> src(lines, symbols);
+            RunReconstruct(layout, format, src, mbpOut, opts);
+        } else {
+            throw std::runtime_error{"Built without POSIX I/O; cannot read " + mboFilePath};
+        }
+#endif
+    } catch (const std::exception& e) {
+        // I/O and checkpoint failures, and malformed input lines (std::invalid_argument). Queued warnings
+        // are written first, so the error is the last line.
+        WarnLog::Get().Finish();
+        std::cerr << "Error: " + std::string(e.what()) + "\n";
+        return 1;
     }
+    WarnLog::Get().Finish();
 
+    mboMap.Close();
     mboIs.close();
-    mbpOs.close();
+    mbpOut.Flush();
+    std::fclose(mbpFile);
 
     
-    std::cout << "MBP-10 reconstruction complete. Output saved to " + mbpOutPath + "\n";
+    (mbpOutPath == "-" ? std::cerr : std::cout) << "MBP-" + std::to_string(opts.depth) + " reconstruction complete. Output saved to " + mbpOutPath + "\n";
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,5246 @@
+/**
+ * @file reconstruction.hpp
+ * @brief MBO -> MBP-10 reconstruction library: order books, the streaming Reconstructor, MBO input
+ *        sources and MBP output sinks. reconstruction.cpp is the command-line driver built on it.
+ */
+#ifndef RECONSTRUCTION_HPP
+#define RECONSTRUCTION_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <iomanip>
+#include <list>
+#include <memory>
+#include <new>
+#include <condition_variable>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RECON_HAVE_MMAP 1
+#endif
+
+// Live input and output (FdReader, ShmRing, OpenTcp, OpenUdp) need BSD sockets, poll and POSIX shared
+// memory on top of mmap; define RECON_NO_POSIX_IO to leave them out.
+#if defined(RECON_HAVE_MMAP) && !defined(RECON_NO_POSIX_IO) && defined(__has_include)
+#if __has_include(<netdb.h>) && __has_include(<netinet/tcp.h>) && __has_include(<poll.h>) && __has_include(<sys/socket.h>) && \
+    defined(_POSIX_SHARED_MEMORY_OBJECTS) && _POSIX_SHARED_MEMORY_OBJECTS >= 0
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#define RECON_HAVE_POSIX_IO 1
+#endif
+#endif
+
+/**
+ * @brief A value for prices that are undefined or not applicable.
+ */
+const int64_t UNDEFINED_PRICE = -9223372036854775807LL;
+
+/** 
+* @brief Namespace for action types in the market data. 
+*/
+namespace Act {
+enum Type : char { Add = 'A', Cancel = 'C', Modify = 'M', Clear = 'R', Trade = 'T', Fill = 'F', None = 'N' };
+inline std::string ToStr(Type a) {
+    switch (a) {
+        case Add: return "Add"; case Cancel: return "Cancel"; case Modify: return "Modify"; case Clear: return "Clear";
+        case Trade: return "Trade"; case Fill: return "Fill"; case None: return "None";
+    }
+    return "Unknown";
+}}
+
+/**
+ * @brief Namespace for side types in the market data.
+ */
+namespace Sd {
+enum Type : char { Ask = 'A', Bid = 'B', None = 'N' };
+inline std::string ToStr(Type s) {
+    switch (s) {
+        case Ask: return "Ask"; case Bid: return "Bid"; case None: return "None";
+    }
+    return "Unknown";
+}}
+
+/**
+ * @brief Reads the CPU timestamp counter (rdtsc), or a steady clock in nanoseconds on other CPUs.
+ *
+ * Not serializing: a reading may drift by a few dozen cycles around the code it brackets, which is
+ * noise at the resolution of a LatHist.
+ */
+inline uint64_t ReadTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+/**
+ * @brief Namespace for the instrumented hot-path stages (see HotStats).
+ */
+namespace Stg {
+enum Type : uint8_t { Parse, Apply, Synth, Agg, Write, Flush, Count };
+inline const char* Name(Type s) {
+    switch (s) {
+        case Parse: return "parse"; case Apply: return "apply"; case Synth: return "synth-trade"; case Agg: return "aggregate";
+        case Write: return "write-row"; case Flush: return "flush"; case Count: break;
+    }
+    return "unknown";
+}}
+
+/**
+ * @brief Namespace for the warning categories of WarnLog (also counted by HotStats).
+ */
+namespace Wrn {
+enum Type : uint8_t { CancelUnkId, CancelOverSz, SynthNoLvl, SynthNoInstr, SynthNoBook, SynthFailed, TfNoSide, UnkAction, Count };
+inline const char* Name(Type w) {
+    switch (w) {
+        case CancelUnkId: return "cancel-unknown-id"; case CancelOverSz: return "cancel-over-size";
+        case SynthNoLvl: return "synth-missing-level"; case SynthNoInstr: return "synth-missing-instr";
+        case SynthNoBook: return "synth-missing-book"; case SynthFailed: return "synth-failed";
+        case TfNoSide: return "tf-no-side";
+        case UnkAction: return "unknown-action"; case Count: break;
+    }
+    return "unknown";
+}}
+
+/**
+ * @brief Adds to a counter that only its owning thread writes; readers on other threads see a
+ *        slightly stale but untorn value, without the cost of an atomic read-modify-write.
+ */
+inline void Bump(std::atomic<uint64_t>& c, uint64_t n = 1) { c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+/**
+ * @brief Single-writer maximum, in the same way as Bump.
+ */
+inline void BumpMax(std::atomic<uint64_t>& c, uint64_t v) {
+    if (v > c.load(std::memory_order_relaxed)) c.store(v, std::memory_order_relaxed);
+}
+
+/**
+ * @brief HDR-style log-linear histogram of tick counts.
+ *
+ * Values below SUB are exact; above, each power of two is split into SUB buckets, so a recorded
+ * value is known to within 1/SUB (6.25%) over the whole 64-bit range. Written by one thread.
+ */
+class LatHist {
+public:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr size_t SUB = size_t{1} << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+    using Counts = std::array<uint64_t, BUCKETS>;
+
+    void Record(uint64_t v) { Bump(cnt_[Idx(v)]); }
+
+    /**
+     * @brief Adds this histogram's counts to `out`.
+     */
+    void AddTo(Counts& out) const {
+        for (size_t i = 0; i < BUCKETS; ++i) out[i] += cnt_[i].load(std::memory_order_relaxed);
+    }
+
+    static size_t Idx(uint64_t v) {
+        if (v < SUB) return static_cast<size_t>(v);
+        const unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(v));
+        return (msb - SUB_BITS + 1) * SUB + ((v >> (msb - SUB_BITS)) & (SUB - 1));
+    }
+
+    /**
+     * @brief Largest value that falls into bucket `idx`.
+     */
+    static uint64_t Upper(size_t idx) {
+        if (idx < SUB) return idx;
+        const size_t k = idx / SUB, m = idx % SUB;
+        const uint64_t lower = static_cast<uint64_t>(SUB + m) << (k - 1);
+        return lower + ((uint64_t{1} << (k - 1)) - 1);
+    }
+
+    /**
+     * @brief The upper bound of the bucket holding quantile `q` of `counts`.
+     */
+    static uint64_t Quantile(const Counts& counts, uint64_t total, double q) {
+        const uint64_t rank = std::min<uint64_t>(total, static_cast<uint64_t>(q * total) + 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            if ((seen += counts[i]) >= rank) return Upper(i);
+        }
+        return 0;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> cnt_ {};
+};
+
+/**
+ * @brief Hot-path counters and stage latencies of one thread, compiled in with -DRECON_STATS.
+ *
+ * Each thread records into its own instance (LocalStats), so recording needs no synchronization;
+ * HotStatsRegistry sums all instances when a summary is printed, and keeps those of finished threads.
+ */
+struct HotStats {
+    std::array<LatHist, Stg::Count> lat;
+    std::array<std::atomic<uint64_t>, Stg::Count> ticks {};
+    /**
+     * @brief Messages by action character.
+     */
+    std::array<std::atomic<uint64_t>, 128> acts {};
+    std::array<std::atomic<uint64_t>, Wrn::Count> warns {};
+    /**
+     * @brief Most live orders seen in a single book.
+     */
+    std::atomic<uint64_t> maxBookOrds {0};
+
+    void CountAct(Act::Type a) { Bump(acts[static_cast<unsigned char>(a) & 127]); }
+    void CountWarn(Wrn::Type w) { Bump(warns[w]); }
+};
+
+/**
+ * @brief Sum of all threads' HotStats at one point in time.
+ */
+struct HotStatsSnap {
+    std::array<LatHist::Counts, Stg::Count> lat {};
+    std::array<uint64_t, Stg::Count> ticks {};
+    std::array<uint64_t, 128> acts {};
+    std::array<uint64_t, Wrn::Count> warns {};
+    uint64_t maxBookOrds {0};
+    /**
+     * @brief Seconds since the registry was created, and timestamp-counter ticks per nanosecond over that time.
+     */
+    double elapsedS {0};
+    double ticksPerNs {1};
+
+    /**
+     * @brief Writes a multi-line summary: stage latencies in ns, action counts, warnings, peak book size.
+     */
+    void Print(std::ostream& os, const char* title) const {
+        char line[256];
+        uint64_t msgs = 0;
+        for (uint64_t n : acts) msgs += n;
+        std::snprintf(line, sizeof(line), "Hot-path stats (%s), %.3f s, %llu msgs, %.2f ticks/ns:\n", title, elapsedS,
+                      static_cast<unsigned long long>(msgs), ticksPerNs);
+        os << line;
+        std::snprintf(line, sizeof(line), "  %-12s %12s %9s %9s %9s %9s %11s\n", "stage", "calls", "mean ns", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+        os << line;
+        for (size_t s = 0; s < Stg::Count; ++s) {
+            uint64_t n = 0;
+            for (uint64_t c : lat[s]) n += c;
+            if (n == 0) continue;
+            auto ns = [&](double q) { return LatHist::Quantile(lat[s], n, q) / ticksPerNs; };
+            std::snprintf(line, sizeof(line), "  %-12s %12llu %9.1f %9.0f %9.0f %9.0f %11.0f\n", Stg::Name(static_cast<Stg::Type>(s)),
+                          static_cast<unsigned long long>(n), ticks[s] / ticksPerNs / n, ns(0.50), ns(0.99), ns(0.999), ns(1.0));
+            os << line;
+        }
+        os << "  actions:";
+        for (size_t a = 0; a < acts.size(); ++a) {
+            if (acts[a]) os << " " << static_cast<char>(a) << " " << acts[a];
+        }
+        os << "\n  warnings:";
+        for (size_t w = 0; w < Wrn::Count; ++w) os << " " << Wrn::Name(static_cast<Wrn::Type>(w)) << " " << warns[w];
+        os << "\n  max live orders in a book: " << maxBookOrds << "\n";
+    }
+};
+
+/**
+ * @brief Owner of every thread's HotStats.
+ */
+class HotStatsRegistry {
+public:
+    static HotStatsRegistry& Get() {
+        static HotStatsRegistry reg;
+        return reg;
+    }
+
+    /**
+     * @brief Creates the stats of a new thread; they live as long as the process.
+     */
+    HotStats& Add() {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return all_.emplace_back();
+    }
+
+    HotStatsSnap Collect() const {
+        HotStatsSnap snap;
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            for (const HotStats& st : all_) {
+                for (size_t s = 0; s < Stg::Count; ++s) {
+                    st.lat[s].AddTo(snap.lat[s]);
+                    snap.ticks[s] += st.ticks[s].load(std::memory_order_relaxed);
+                }
+                for (size_t a = 0; a < snap.acts.size(); ++a) snap.acts[a] += st.acts[a].load(std::memory_order_relaxed);
+                for (size_t w = 0; w < Wrn::Count; ++w) snap.warns[w] += st.warns[w].load(std::memory_order_relaxed);
+                snap.maxBookOrds = std::max(snap.maxBookOrds, st.maxBookOrds.load(std::memory_order_relaxed));
+            }
+        }
+        const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0_).count();
+        snap.elapsedS = ns / 1e9;
+        if (ns > 0) snap.ticksPerNs = static_cast<double>(ReadTsc() - tsc0_) / ns;
+        return snap;
+    }
+
+private:
+    HotStatsRegistry() : t0_(std::chrono::steady_clock::now()), tsc0_(ReadTsc()) {}
+
+    mutable std::mutex mtx_;
+    std::deque<HotStats> all_;
+    std::chrono::steady_clock::time_point t0_;
+    uint64_t tsc0_;
+};
+
+/**
+ * @brief The calling thread's HotStats.
+ */
+inline HotStats& LocalStats() {
+    thread_local HotStats& st = HotStatsRegistry::Get().Add();
+    return st;
+}
+
+/**
+ * @brief Scope timer recording the ticks between construction and destruction into a stage of LocalStats.
+ */
+class StageTimer {
+public:
+    explicit StageTimer(Stg::Type stage) : stage_(stage), t0_(ReadTsc()) {}
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+    ~StageTimer() {
+        const uint64_t d = ReadTsc() - t0_;
+        HotStats& st = LocalStats();
+        st.lat[stage_].Record(d);
+        Bump(st.ticks[stage_], d);
+    }
+
+private:
+    Stg::Type stage_;
+    uint64_t t0_;
+};
+
+/**
+ * @brief Instrumentation hooks: RECON_TIME(Stage) times the rest of the enclosing scope and
+ *        RECON_STAT(stmt) runs a counter update. Both compile to nothing unless RECON_STATS is defined.
+ */
+#ifdef RECON_STATS
+#define RECON_TIME(stage) StageTimer reconStageTimer(Stg::stage)
+#define RECON_STAT(stmt) do { stmt; } while (0)
+#else
+#define RECON_TIME(stage) do {} while (0)
+#define RECON_STAT(stmt) do {} while (0)
+#endif
+
+/**
+ * @brief Writes the HotStats summary at a fixed interval from a background thread, and once more when destroyed.
+ */
+class StatsReporter {
+public:
+    /**
+     * @param path Stats file, or empty for stderr; periodic summaries are appended after the first.
+     * @param everyS Seconds between summaries; 0 writes only the final one.
+     */
+    StatsReporter(std::string path, double everyS) : path_(std::move(path)) {
+        if (!path_.empty()) std::ofstream(path_, std::ios::trunc);
+        if (everyS > 0) {
+            thr_ = std::thread([this, everyS] {
+                std::unique_lock<std::mutex> lk(mtx_);
+                const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(everyS));
+                while (!cv_.wait_for(lk, period, [this] { return stop_; })) Write("periodic");
+            });
+        }
+    }
+    StatsReporter(const StatsReporter&) = delete;
+    StatsReporter& operator=(const StatsReporter&) = delete;
+    ~StatsReporter() {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (thr_.joinable()) thr_.join();
+        Write("final");
+    }
+
+private:
+    void Write(const char* title) const {
+        const HotStatsSnap snap = HotStatsRegistry::Get().Collect();
+        if (path_.empty()) {
+            snap.Print(std::cerr, title);
+            return;
+        }
+        std::ofstream os(path_, std::ios::app);
+        snap.Print(os, title);
+    }
+
+    std::string path_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_ {false};
+    std::thread thr_;
+};
+
+/**
+ * @brief Structure representing a single Market By Order (MBO) message.
+ */
+struct MboSingle {
+    /**
+     * @brief Receive and event timestamps in nanoseconds since the epoch (UNDEFINED_TS when absent).
+     */
+    int64_t tsRecv;
+    int64_t tsEvent;
+    uint8_t rtype;
+    uint16_t pubId;
+    uint32_t instrId;
+    Act::Type action;
+    Sd::Type side;
+    int64_t price;
+    uint32_t size;
+    uint8_t chanId;
+    uint64_t orderId;
+    uint8_t flags;
+    int32_t tsInDelta;
+    uint32_t sequence;
+    /**
+     * @brief View of the instrument's symbol, owned by the SymbolTable of the input being read.
+     */
+    std::string_view symbol;
+};
+static_assert(std::is_trivially_copyable<MboSingle>::value, "MboSingle is copied into pending T/F state and batches");
+
+/**
+ * @brief Scale factor for converting prices to/from nanoseconds.
+ */
+const double PRICE_SCALE = 1e9;
+
+/**
+ * @brief Default number of price levels per side published in each MBP row (MBP-10).
+ *
+ * The engine is templated on the depth; this is the default of every Depth parameter.
+ */
+constexpr size_t MBP_DEPTH = 10;
+
+
+/**
+ * @brief Converts a price in nanoseconds to a double representation.
+ */
+inline double ToDblPrice(int64_t priceNano) {
+    if (priceNano == UNDEFINED_PRICE) return NAN;
+    return static_cast<double>(priceNano) / PRICE_SCALE;
+}
+
+/**
+ * @brief Converts a double price to its nanosecond representation.
+ */
+inline int64_t ToNanoPrice(double priceDbl) {
+    if (std::isnan(priceDbl)) return UNDEFINED_PRICE;
+    return static_cast<int64_t>(std::round(priceDbl * PRICE_SCALE));
+}
+
+/**
+ * @brief A value for timestamps that are missing or could not be parsed.
+ */
+const int64_t UNDEFINED_TS = INT64_MIN;
+
+/**
+ * @brief Days since 1970-01-01 of a proleptic Gregorian date; era-based so it is exact for any year.
+ */
+inline int64_t DaysFromCivil(int y, int mo, int d) {
+    const int yy = y - (mo <= 2);
+    const int era = (yy >= 0 ? yy : yy - 399) / 400;
+    const int yoe = yy - era * 400;
+    const int doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return static_cast<int64_t>(era) * 146097 + doe - 719468;
+}
+
+/**
+ * @brief Parses an ISO-8601 UTC timestamp ("2025-07-17T08:05:03.360677248Z") into nanoseconds since the epoch.
+ *
+ * The fixed 30-character form with 9 fraction digits (Databento's) takes a branch-light path.
+ * @param s The timestamp text; the fraction may have 0 to 9 digits.
+ * @return The timestamp, or UNDEFINED_TS if `s` is not in that form.
+ */
+inline int64_t ParseIsoNanos(std::string_view s) {
+    if (s.size() == 30 && s[4] == '-' && s[7] == '-' && s[10] == 'T' && s[13] == ':' && s[16] == ':' && s[19] == '.' && s[29] == 'Z') {
+        unsigned bad = 0;
+        auto dig = [&](size_t i) { const unsigned v = static_cast<unsigned char>(s[i]) - '0'; bad |= v > 9; return static_cast<int>(v); };
+        auto d2 = [&](size_t i) { return dig(i) * 10 + dig(i + 1); };
+        const int y = d2(0) * 100 + d2(2);
+        const int mo = d2(5), d = d2(8), h = d2(11), mi = d2(14), sec = d2(17);
+        int64_t frac = 0;
+        for (size_t i = 20; i < 29; ++i) frac = frac * 10 + dig(i);
+        if (!bad) return ((DaysFromCivil(y, mo, d) * 24 + h) * 60 + mi) * 60 * 1000000000LL + sec * 1000000000LL + frac;
+    }
+    auto num = [&s](size_t pos, size_t len, int& v) {
+        if (pos + len > s.size()) return false;
+        v = 0;
+        for (size_t i = pos; i < pos + len; ++i) {
+            if (s[i] < '0' || s[i] > '9') return false;
+            v = v * 10 + (s[i] - '0');
+        }
+        return true;
+    };
+    int y, mo, d, h, mi, sec;
+    if (s.size() < 20) return UNDEFINED_TS;
+    if (!num(0, 4, y) || s[4] != '-' || !num(5, 2, mo) || s[7] != '-' || !num(8, 2, d) || s[10] != 'T'
+        || !num(11, 2, h) || s[13] != ':' || !num(14, 2, mi) || s[16] != ':' || !num(17, 2, sec)) return UNDEFINED_TS;
+    size_t pos = 19;
+    int64_t frac = 0;
+    int fracDigits = 0;
+    if (pos < s.size() && s[pos] == '.') {
+        for (++pos; pos < s.size() && s[pos] >= '0' && s[pos] <= '9' && fracDigits < 9; ++pos, ++fracDigits) frac = frac * 10 + (s[pos] - '0');
+    }
+    if (pos + 1 != s.size() || s[pos] != 'Z') return UNDEFINED_TS;
+    for (int i = fracDigits; i < 9; ++i) frac *= 10;
+    return ((DaysFromCivil(y, mo, d) * 24 + h) * 60 + mi) * 60 * 1000000000LL + sec * 1000000000LL + frac;
+}
+
+/**
+ * @brief Formats nanoseconds since the epoch as an ISO-8601 UTC timestamp with 9 fraction digits.
+ * @param p Destination with room for at least 30 bytes; nothing is written for UNDEFINED_TS.
+ * @return The position after the last character.
+ */
+inline char* FormatIsoNanos(char* p, int64_t ns) {
+    if (ns == UNDEFINED_TS) return p;
+    int64_t secs = ns / 1000000000LL;
+    int64_t frac = ns % 1000000000LL;
+    if (frac < 0) { frac += 1000000000LL; --secs; }
+    int64_t days = secs / 86400;
+    int64_t sod = secs % 86400;
+    if (sod < 0) { sod += 86400; --days; }
+    // Civil date from days, inverse of the conversion in ParseIsoNanos.
+    const int64_t z = days + 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const int64_t doe = z - era * 146097;
+    const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const int64_t mp = (5 * doy + 2) / 153;
+    const int64_t d = doy - (153 * mp + 2) / 5 + 1;
+    const int64_t mo = mp < 10 ? mp + 3 : mp - 9;
+    const int64_t y = yoe + era * 400 + (mo <= 2);
+    auto put = [&p](int64_t v, int width) {
+        for (int i = width - 1; i >= 0; --i, v /= 10) p[i] = static_cast<char>('0' + v % 10);
+        p += width;
+    };
+    put(y, 4); *p++ = '-'; put(mo, 2); *p++ = '-'; put(d, 2); *p++ = 'T';
+    put(sod / 3600, 2); *p++ = ':'; put(sod / 60 % 60, 2); *p++ = ':'; put(sod % 60, 2);
+    *p++ = '.'; put(frac, 9); *p++ = 'Z';
+    return p;
+}
+
+/**
+ * @brief FormatIsoNanos for the output hot path: the "YYYY-MM-DDT" prefix is cached per thread
+ *        and only rebuilt when the day changes, leaving the time of day to format.
+ * @param p Destination with room for at least 30 bytes; nothing is written for UNDEFINED_TS.
+ * @return The position after the last character.
+ */
+inline char* PutIsoNanos(char* p, int64_t ns) {
+    constexpr int64_t NS_PER_DAY = 86400 * 1000000000LL;
+    if (ns == UNDEFINED_TS) return p;
+    int64_t day = ns / NS_PER_DAY;
+    int64_t tod = ns % NS_PER_DAY;
+    if (tod < 0) { tod += NS_PER_DAY; --day; }
+    thread_local int64_t cachedDay = INT64_MIN;
+    thread_local char prefix[32];
+    if (day != cachedDay) {
+        FormatIsoNanos(prefix, day * NS_PER_DAY);
+        cachedDay = day;
+    }
+    p = std::copy_n(prefix, 11, p);
+    int64_t secs = tod / 1000000000LL;
+    int64_t frac = tod % 1000000000LL;
+    auto put = [&p](int64_t v, int width) {
+        for (int i = width - 1; i >= 0; --i, v /= 10) p[i] = static_cast<char>('0' + v % 10);
+        p += width;
+    };
+    put(secs / 3600, 2); *p++ = ':'; put(secs / 60 % 60, 2); *p++ = ':'; put(secs % 60, 2);
+    *p++ = '.'; put(frac, 9); *p++ = 'Z';
+    return p;
+}
+
+/**
+ * @brief Exchange-to-capture latency of a message (ts_recv - ts_event), or UNDEFINED_TS if either is missing.
+ */
+inline int64_t RecvLatencyNs(const MboSingle& m) {
+    return m.tsRecv == UNDEFINED_TS || m.tsEvent == UNDEFINED_TS ? UNDEFINED_TS : m.tsRecv - m.tsEvent;
+}
+
+/**
+ * @brief Publisher send time of a message (ts_recv - ts_in_delta), or UNDEFINED_TS if ts_recv is missing.
+ */
+inline int64_t SendTsNs(const MboSingle& m) {
+    return m.tsRecv == UNDEFINED_TS ? UNDEFINED_TS : m.tsRecv - m.tsInDelta;
+}
+
+/**
+ * @brief Bounded single-producer/single-consumer lock-free ring.
+ *
+ * Slots are filled and drained in place (PushSlot/Push, Front/Pop), so elements that own buffers
+ * keep them across laps instead of reallocating. Each side caches the other side's index and only
+ * re-reads the shared atomic when the ring looks full (producer) or empty (consumer).
+ */
+template <class T>
+class SpscRing {
+public:
+    /**
+     * @param cap Number of slots; must be a power of two.
+     */
+    explicit SpscRing(size_t cap) : slots_(cap), mask_(cap - 1) {
+        assert(cap && (cap & (cap - 1)) == 0);
+    }
+
+    /**
+     * @brief Producer: returns the next free slot, or nullptr if the ring is full.
+     */
+    T* PushSlot() {
+        const size_t t = tail_.load(std::memory_order_relaxed);
+        if (t - headCache_ > mask_) {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (t - headCache_ > mask_) return nullptr;
+        }
+        return &slots_[t & mask_];
+    }
+
+    /**
+     * @brief Producer: publishes the slot returned by PushSlot.
+     */
+    void Push() { tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    /**
+     * @brief Producer: no more elements will be pushed.
+     */
+    void Close() { closed_.store(true, std::memory_order_release); }
+
+    /**
+     * @brief Consumer: returns the oldest element, or nullptr if the ring is empty.
+     */
+    T* Front() {
+        const size_t h = head_.load(std::memory_order_relaxed);
+        if (h == tailCache_) {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (h == tailCache_) return nullptr;
+        }
+        return &slots_[h & mask_];
+    }
+
+    /**
+     * @brief Consumer: releases the element returned by Front.
+     */
+    void Pop() { head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    /**
+     * @brief Consumer: true once the producer has closed the ring and every element was popped.
+     */
+    bool Drained() { return closed_.load(std::memory_order_acquire) && !Front(); }
+
+    /**
+     * @brief Consumer: number of elements currently queued (a snapshot).
+     */
+    size_t Size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Number of slots.
+     */
+    size_t Capacity() const { return mask_ + 1; }
+
+private:
+    std::vector<T> slots_;
+    const size_t mask_;
+    alignas(64) std::atomic<size_t> head_ {0};
+    size_t tailCache_ {0};
+    alignas(64) std::atomic<size_t> tail_ {0};
+    size_t headCache_ {0};
+    alignas(64) std::atomic<bool> closed_ {false};
+};
+
+/**
+ * @brief A queued warning: its category and integer arguments, formatted by the WarnLog drain thread.
+ */
+struct LogRec {
+    Wrn::Type cat;
+    int64_t args[3];
+};
+
+/**
+ * @brief Warning log that keeps formatting and stderr writes off the hot path.
+ *
+ * Warn only copies a fixed-size LogRec into the calling thread's SpscRing; a background thread
+ * drains all rings, formats the records and writes each pass to stderr in one call. Each thread
+ * rate-limits every category to `rate` records per second, and a full ring drops the record
+ * instead of blocking; both are counted and reported by Finish. Records of one thread keep their
+ * order, records of different threads may interleave. One-off notices outside the per-message path,
+ * such as a partial record at the end of a binary file, go to std::cerr directly.
+ */
+class WarnLog {
+public:
+    static constexpr size_t RING_CAP = 8192;
+    static constexpr uint64_t DEF_RATE = 1000;
+
+    static WarnLog& Get() {
+        static WarnLog log;
+        return log;
+    }
+
+    WarnLog(const WarnLog&) = delete;
+    WarnLog& operator=(const WarnLog&) = delete;
+    ~WarnLog() { Finish(); }
+
+    /**
+     * @brief Sets the most records per category, thread and second; 0 disables the limit.
+     */
+    void SetRate(uint64_t perSec) { rate_.store(perSec, std::memory_order_relaxed); }
+
+    /**
+     * @brief Queues a warning; the meaning of the arguments depends on the category (see Format).
+     */
+    void Warn(Wrn::Type cat, int64_t a0 = 0, int64_t a1 = 0, int64_t a2 = 0) {
+        RECON_STAT(LocalStats().CountWarn(cat));
+        Producer& p = Local();
+        if (const uint64_t rate = rate_.load(std::memory_order_relaxed)) {
+            Window& w = p.win[cat];
+            const auto now = std::chrono::steady_clock::now();
+            if (now - w.start >= std::chrono::seconds(1)) w = Window{now, 0};
+            if (w.n >= rate) { Bump(p.limited[cat]); return; }
+            ++w.n;
+        }
+        LogRec* r = p.ring.PushSlot();
+        if (!r) { Bump(p.dropped[cat]); return; }
+        *r = LogRec{cat, {a0, a1, a2}};
+        p.ring.Push();
+        if (finished_.load(std::memory_order_acquire)) DrainAll();
+    }
+
+    /**
+     * @brief Writes everything queued, stops the drain thread and reports rate-limited or dropped
+     *        records; later warnings are written by the thread that raises them.
+     */
+    void Finish() {
+        if (finished_.exchange(true)) return;
+        {
+            std::lock_guard<std::mutex> lk(stopMtx_);
+            stop_ = true;
+        }
+        stopCv_.notify_all();
+        if (thr_.joinable()) thr_.join();
+        DrainAll();
+        std::string out;
+        std::lock_guard<std::mutex> lk(regMtx_);
+        for (size_t c = 0; c < Wrn::Count; ++c) {
+            uint64_t limited = 0, dropped = 0;
+            for (const Producer& p : producers_) {
+                limited += p.limited[c].load(std::memory_order_relaxed);
+                dropped += p.dropped[c].load(std::memory_order_relaxed);
+            }
+            if (limited || dropped) {
+                out += "Warn: Log category " + std::string(Wrn::Name(static_cast<Wrn::Type>(c))) + ": " + std::to_string(limited) +
+                       " rate-limited, " + std::to_string(dropped) + " dropped (ring full).\n";
+            }
+        }
+        std::cerr << out;
+    }
+
+private:
+    struct Window {
+        std::chrono::steady_clock::time_point start;
+        uint64_t n;
+    };
+
+    /**
+     * @brief Ring and counters of one logging thread; the counters are single-writer (see Bump).
+     */
+    struct Producer {
+        SpscRing<LogRec> ring {RING_CAP};
+        std::array<Window, Wrn::Count> win {};
+        std::array<std::atomic<uint64_t>, Wrn::Count> limited {};
+        std::array<std::atomic<uint64_t>, Wrn::Count> dropped {};
+    };
+
+    WarnLog() : thr_([this] {
+        std::unique_lock<std::mutex> lk(stopMtx_);
+        while (!stop_) {
+            lk.unlock();
+            const bool any = DrainAll();
+            lk.lock();
+            if (!any) stopCv_.wait_for(lk, std::chrono::milliseconds(1), [this] { return stop_; });
+        }
+    }) {}
+
+    Producer& Local() {
+        thread_local Producer& p = [this]() -> Producer& {
+            std::lock_guard<std::mutex> lk(regMtx_);
+            return producers_.emplace_back();
+        }();
+        return p;
+    }
+
+    /**
+     * @brief Formats and writes the queued records of every thread.
+     * @return false if there were none.
+     */
+    bool DrainAll() {
+        std::lock_guard<std::mutex> drainLk(drainMtx_);
+        out_.clear();
+        {
+            std::lock_guard<std::mutex> lk(regMtx_);
+            for (Producer& p : producers_) {
+                while (LogRec* r = p.ring.Front()) {
+                    Format(out_, *r);
+                    p.ring.Pop();
+                }
+            }
+        }
+        if (out_.empty()) return false;
+        std::cerr.write(out_.data(), static_cast<std::streamsize>(out_.size()));
+        return true;
+    }
+
+    static void Format(std::string& out, const LogRec& r) {
+        const int64_t* a = r.args;
+        switch (r.cat) {
+            case Wrn::CancelUnkId:
+                out += "Warn: Cancel unk ID " + std::to_string(static_cast<uint64_t>(a[0])) + ". Ign.\n"; break;
+            case Wrn::CancelOverSz:
+                out += "Warn: Partial cancel > existing sz. ID " + std::to_string(static_cast<uint64_t>(a[0])) + ". Cap to 0.\n"; break;
+            case Wrn::SynthNoLvl: {
+                char pxTxt[32];
+                std::snprintf(pxTxt, sizeof(pxTxt), "%.9f", ToDblPrice(a[1]));
+                out += "Warn: Synth trade at non-existent lvl " + Sd::ToStr(static_cast<Sd::Type>(a[0])) + " @ " + pxTxt + " sz " + std::to_string(a[2]) + ". Ign.\n";
+                break;
+            }
+            case Wrn::SynthNoInstr:
+                out += "Err: Synth trade for non-existent instr " + std::to_string(a[0]) + ". Ign.\n"; break;
+            case Wrn::SynthNoBook:
+                out += "Err: Synth trade for non-existent book (Instr: " + std::to_string(a[0]) + ", Pub: " + std::to_string(a[1]) + "). Ign.\n"; break;
+            case Wrn::SynthFailed:
+                out += "Err synth trade ID " + std::to_string(static_cast<uint64_t>(a[0])) + " (Instr: " + std::to_string(a[1]) + ", Pub: " +
+                       std::to_string(a[2]) + ") failed. Ign.\n";
+                break;
+            case Wrn::TfNoSide:
+                out += "Warn: T/F in TFC for ID " + std::to_string(static_cast<uint64_t>(a[0])) + " Side::None. Skipping synth trade.\n"; break;
+            case Wrn::UnkAction:
+                out += "Unknown action: " + Act::ToStr(static_cast<Act::Type>(a[0])) + ". Ignoring.\n"; break;
+            case Wrn::Count: break;
+        }
+    }
+
+    std::atomic<uint64_t> rate_ {DEF_RATE};
+    std::atomic<bool> finished_ {false};
+    std::mutex regMtx_;
+    std::deque<Producer> producers_;
+    std::mutex drainMtx_;
+    std::string out_;
+    std::mutex stopMtx_;
+    std::condition_variable stopCv_;
+    bool stop_ {false};
+    std::thread thr_;
+};
+
+
+/**
+ * @brief Structure representing a price level in the order book.
+ * 
+ * combined information for all orders at a specific price point,
+ * including the total quantity available and the number of individual orders.
+ */
+struct PriceLvl {
+    int64_t price {UNDEFINED_PRICE};
+    uint32_t size {0};
+    uint32_t count {0};
+    bool IsEmpty() const { return price == UNDEFINED_PRICE; }
+    operator bool() const { return !IsEmpty(); }
+    bool operator==(const PriceLvl& o) const { return price == o.price && size == o.size && count == o.count; }
+    bool operator!=(const PriceLvl& o) const { return !(*this == o); }
+};
+
+/**
+ * @brief Compact record of an order resting in a book queue.
+ *
+ * Only the fields needed once an order is resting are kept; the full MboSingle (timestamps,
+ * symbol and header fields) stays on the input side.
+ */
+struct RestingOrd {
+    uint64_t orderId;
+    uint32_t size;
+    uint8_t flags;
+};
+static_assert(std::is_trivially_copyable<RestingOrd>::value && sizeof(RestingOrd) <= 32, "RestingOrd must stay a small POD");
+
+/**
+ * @brief Fixed-size top-of-book snapshot for one side, best level first.
+ * @tparam N Number of levels.
+ */
+template <size_t N>
+using TopLvlsN = std::array<PriceLvl, N>;
+using TopLvls = TopLvlsN<MBP_DEPTH>;
+
+static_assert(sizeof(PriceLvl) == 16 && std::is_trivially_copyable<PriceLvl>::value, "the level kernels compare PriceLvl as two 64-bit lanes");
+
+/**
+ * @brief Vector instruction set of the level kernels, fixed at compile time by the target flags
+ *        (-march=native in the Makefile); -DRECON_NO_SIMD forces the scalar kernels.
+ */
+#if !defined(RECON_NO_SIMD) && defined(__AVX512F__)
+#define RECON_SIMD_AVX512 1
+constexpr const char* SIMD_ISA = "avx512";
+#elif !defined(RECON_NO_SIMD) && defined(__AVX2__)
+#define RECON_SIMD_AVX2 1
+constexpr const char* SIMD_ISA = "avx2";
+#else
+constexpr const char* SIMD_ISA = "scalar";
+#endif
+constexpr bool SIMD_ON = SIMD_ISA[0] != 's';
+
+/**
+ * @brief Bit i set for every level i where two snapshots differ in price, size or count (scalar kernel).
+ */
+template <size_t N>
+uint64_t ChangedLvlsScalar(const TopLvlsN<N>& a, const TopLvlsN<N>& b) {
+    static_assert(N <= 64, "one mask bit per level");
+    uint64_t mask = 0;
+    for (size_t i = 0; i < N; ++i) mask |= static_cast<uint64_t>(a[i] != b[i]) << i;
+    return mask;
+}
+
+/**
+ * @brief ChangedLvlsScalar with the widest compare available: four levels per AVX-512 compare, two per
+ *        AVX2 compare, the remainder scalar. Same result as the scalar kernel.
+ */
+template <size_t N>
+uint64_t ChangedLvlsSimd(const TopLvlsN<N>& a, const TopLvlsN<N>& b) {
+    static_assert(N <= 64, "one mask bit per level");
+    uint64_t mask = 0;
+    size_t i = 0;
+    const char* pa = reinterpret_cast<const char*>(a.data());
+    const char* pb = reinterpret_cast<const char*>(b.data());
+#if defined(RECON_SIMD_AVX512)
+    for (; i + 4 <= N; i += 4) {
+        const __mmask8 ne = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(pa + 16 * i), _mm512_loadu_si512(pb + 16 * i));
+        // Lanes 2j and 2j+1 hold level j: price, then size and count.
+        const unsigned c = ne | (ne >> 1);
+        mask |= static_cast<uint64_t>((c & 1) | ((c >> 1) & 2) | ((c >> 2) & 4) | ((c >> 3) & 8)) << i;
+    }
+#endif
+#if defined(RECON_SIMD_AVX512) || defined(RECON_SIMD_AVX2)
+    for (; i + 2 <= N; i += 2) {
+        const __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pa + 16 * i)),
+                                              _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pb + 16 * i)));
+        const unsigned ne = ~static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(eq))) & 0xf;
+        mask |= static_cast<uint64_t>(((ne | (ne >> 1)) & 1) | (((ne >> 2) | (ne >> 3)) & 1) << 1) << i;
+    }
+#endif
+    for (; i < N; ++i) mask |= static_cast<uint64_t>(a[i] != b[i]) << i;
+    (void)pa; (void)pb;
+    return mask;
+}
+
+/**
+ * @brief Levels that differ between two snapshots, one bit per level (bit 0: best level); drives
+ *        change-only and delta output. Uses the vector kernel when one was compiled in.
+ */
+template <size_t N>
+uint64_t ChangedLvls(const TopLvlsN<N>& a, const TopLvlsN<N>& b) {
+    if constexpr (SIMD_ON) return ChangedLvlsSimd<N>(a, b);
+    else return ChangedLvlsScalar<N>(a, b);
+}
+
+/**
+ * @brief Most ladders MergeLadders consolidates at once: one AVX-512 register (two AVX2 registers) of head keys.
+ */
+constexpr size_t MERGE_LANES = 8;
+
+/**
+ * @brief The head keys of MergeLadders, one lane per ladder, with the minimum search over them.
+ *
+ * The primary template is the scalar kernel; with a vector instruction set the `true`
+ * specialization keeps the lanes in registers and updates single lanes with masked blends, so the
+ * keys never round-trip through memory between two levels.
+ * @tparam Vec Vector kernel requested.
+ */
+template <bool Vec>
+class MergeKeys {
+public:
+    explicit MergeKeys(size_t n) : n_(n) {}
+
+    void Set(size_t h, int64_t key) { keys_[h] = key; }
+
+    /**
+     * @brief Returns the smallest key and sets the lanes holding it.
+     */
+    int64_t Min(uint32_t& lanes) const {
+        int64_t best = INT64_MAX;
+        for (size_t h = 0; h < n_; ++h) best = std::min(best, keys_[h]);
+        lanes = 0;
+        for (size_t h = 0; h < n_; ++h) lanes |= static_cast<uint32_t>(keys_[h] == best) << h;
+        return best;
+    }
+
+private:
+    size_t n_;
+    int64_t keys_[MERGE_LANES];
+};
+
+#if defined(RECON_SIMD_AVX512)
+template <>
+class MergeKeys<true> {
+public:
+    explicit MergeKeys(size_t) : keys_(_mm512_set1_epi64(INT64_MAX)) {}
+
+    void Set(size_t h, int64_t key) { keys_ = _mm512_mask_set1_epi64(keys_, static_cast<__mmask8>(1u << h), key); }
+
+    int64_t Min(uint32_t& lanes) const {
+        // Swaps 256-bit halves, then 128-bit pairs, then the lanes of each pair, leaving the minimum in every
+        // lane. The zero-masking forms with a full mask compile to the plain instructions; the unmasked ones
+        // pass an undefined vector through in some compiler headers and trip -Wmaybe-uninitialized.
+        constexpr __mmask8 ALL = 0xff;
+        __m512i m = _mm512_maskz_min_epi64(ALL, keys_, _mm512_maskz_shuffle_i64x2(ALL, keys_, keys_, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm512_maskz_min_epi64(ALL, m, _mm512_maskz_shuffle_i64x2(ALL, m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm512_maskz_min_epi64(ALL, m, _mm512_maskz_shuffle_epi32(0xffff, m, _MM_PERM_BADC));
+        lanes = _mm512_cmpeq_epi64_mask(keys_, m);
+        return _mm_cvtsi128_si64(_mm512_maskz_extracti32x4_epi32(0xf, m, 0));
+    }
+
+private:
+    __m512i keys_;
+};
+#elif defined(RECON_SIMD_AVX2)
+template <>
+class MergeKeys<true> {
+public:
+    explicit MergeKeys(size_t) : lo_(_mm256_set1_epi64x(INT64_MAX)), hi_(lo_) {}
+
+    void Set(size_t h, int64_t key) {
+        const __m256i v = _mm256_set1_epi64x(key);
+        const __m256i lane = _mm256_set1_epi64x(static_cast<int64_t>(h & 3));
+        const __m256i at = _mm256_cmpeq_epi64(_mm256_setr_epi64x(0, 1, 2, 3), lane);
+        if (h < 4) lo_ = _mm256_blendv_epi8(lo_, v, at);
+        else hi_ = _mm256_blendv_epi8(hi_, v, at);
+    }
+
+    int64_t Min(uint32_t& lanes) const {
+        __m256i m = VMin(lo_, hi_);
+        m = VMin(m, _mm256_permute4x64_epi64(m, 0x4e));
+        m = VMin(m, _mm256_permute4x64_epi64(m, 0xb1));
+        const int64_t best = _mm256_extract_epi64(m, 0);
+        const __m256i b = _mm256_set1_epi64x(best);
+        lanes = static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(lo_, b)))) |
+                static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(hi_, b)))) << 4;
+        return best;
+    }
+
+private:
+    static __m256i VMin(__m256i x, __m256i y) { return _mm256_blendv_epi8(x, y, _mm256_cmpgt_epi64(x, y)); }
+
+    __m256i lo_, hi_;
+};
+#else
+template <>
+class MergeKeys<true> : public MergeKeys<false> {
+    using MergeKeys<false>::MergeKeys;
+};
+#endif
+
+/**
+ * @brief Consolidates up to MERGE_LANES top-N ladders (sorted best first) into their aggregated top N.
+ *
+ * The current head price of each ladder is kept as a key in one lane of MergeKeys (negated for bids,
+ * so the best price is always the smallest key; spent lanes hold INT64_MAX). Each output level is
+ * then one minimum over the lanes plus one compare for the lanes at that price, whose sizes and
+ * counts are summed before those heads advance.
+ * @tparam Vec Use the vector MergeKeys kernel.
+ * @param lads The ladders; `k` must not exceed MERGE_LANES.
+ * @param bids True for bid ladders (descending prices).
+ */
+template <bool Vec, size_t N>
+void MergeLadders(const TopLvlsN<N>* const* lads, size_t k, bool bids, TopLvlsN<N>& agg) {
+    static_assert(N < 256, "head positions are 8-bit");
+    assert(k <= MERGE_LANES);
+    MergeKeys<Vec> keys(k);
+    uint8_t pos[MERGE_LANES] = {};
+    auto key = [&](size_t h) {
+        if (pos[h] == N) return INT64_MAX;
+        const PriceLvl& l = (*lads[h])[pos[h]];
+        return l.IsEmpty() ? INT64_MAX : bids ? -l.price : l.price;
+    };
+    for (size_t h = 0; h < k; ++h) keys.Set(h, key(h));
+    size_t i = 0;
+    for (; i < N; ++i) {
+        uint32_t lanes;
+        const int64_t best = keys.Min(lanes);
+        if (best == INT64_MAX) break;
+        PriceLvl lvl {bids ? -best : best, 0, 0};
+        for (; lanes; lanes &= lanes - 1) {
+            const size_t h = static_cast<size_t>(__builtin_ctz(lanes));
+            const PriceLvl& l = (*lads[h])[pos[h]];
+            lvl.size += l.size;
+            lvl.count += l.count;
+            ++pos[h];
+            keys.Set(h, key(h));
+        }
+        agg[i] = lvl;
+    }
+    for (; i < N; ++i) agg[i] = PriceLvl{};
+}
+
+/**
+ * @brief What a sink receives for every MBO message: the message, the instrument's aggregated
+ *        top-of-book after applying it, and the row's index and depth value.
+ *
+ * The references are only valid during the sink call.
+ */
+template <size_t N>
+struct MbpViewN {
+    const MboSingle& msg;
+    const TopLvlsN<N>& bids;
+    const TopLvlsN<N>& asks;
+    int rowIdx;
+    uint32_t depth;
+};
+using MbpView = MbpViewN<MBP_DEPTH>;
+
+
+/**
+ * @brief For easy printing of priceLvl object to an outputstream.
+ * @param stream The output stream (e.g., std::cout, std::ofstream).
+ * @param level The PriceLvl object to print.
+ * @return A reference to the output stream, enabling chaining of operations.
+ */
+inline std::ostream& operator<<(std::ostream& stream, const PriceLvl& level) {
+    stream << level.size << " @ " << std::fixed << std::setprecision(9) << ToDblPrice(level.price) << " | "
+           << level.count << " order(s)";
+    return stream;
+}
+
+
+/**
+ * @brief For easy printing of MboSingle object to an outputstream.
+ * @param os The output stream (e.g., std::cout, std::ofstream).
+ * @param m The MboSingle object to print.
+ * @return A reference to the output stream, enabling chaining of operations.
+ */
+inline std::ostream& operator<<(std::ostream& os, const MboSingle& m) {
+    char tsRecv[32], tsEvent[32];
+    os << "MboSingle { tsRecv: " << std::string_view(tsRecv, FormatIsoNanos(tsRecv, m.tsRecv) - tsRecv)
+       << ", tsEvent: " << std::string_view(tsEvent, FormatIsoNanos(tsEvent, m.tsEvent) - tsEvent)
+       << ", rtype: " << static_cast<int>(m.rtype)
+       << ", pubId: " << m.pubId
+       << ", instrId: " << m.instrId
+       << ", action: '" << Act::ToStr(m.action) << "'"
+       << ", side: '" << Sd::ToStr(m.side) << "'"
+       << ", price: " << std::fixed << std::setprecision(9) << ToDblPrice(m.price)
+       << ", size: " << m.size
+       << ", chanId: " << static_cast<int>(m.chanId)
+       << ", orderId: " << m.orderId
+       << ", flags: " << static_cast<int>(m.flags)
+       << ", tsInDelta: " << m.tsInDelta
+       << ", sequence: " << m.sequence
+       << ", symbol: " << m.symbol << " }";
+    return os;
+}
+
+
+/**
+ * @brief Free-list arena for the fixed-size nodes of book containers (order queues, level maps, id index).
+ *
+ * Single-object requests are rounded up to a 16-byte size class and recycled through a per-class
+ * free list; fresh blocks are carved from large slabs, so once the arena has grown to the peak
+ * working set (or was sized up front with Reserve) the book does no heap allocation at all.
+ * Array requests (hash bucket tables) and oversized nodes go to the global heap. Not thread-safe:
+ * one arena serves the books of a single thread.
+ */
+class NodeArena {
+public:
+    /**
+     * @brief Granularity and alignment of arena blocks.
+     */
+    static constexpr size_t ALIGN = 16;
+    /**
+     * @brief Largest node size served from the arena.
+     */
+    static constexpr size_t MAX_NODE = 256;
+
+    /**
+     * @brief Creates an empty arena.
+     * @param slabBytes Size of each slab carved when the free lists run dry.
+     */
+    explicit NodeArena(size_t slabBytes = 1 << 20) : slabBytes_(slabBytes) {}
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    /**
+     * @brief Returns a block of at least `bytes` bytes, aligned to ALIGN.
+     */
+    void* Alloc(size_t bytes) {
+        if (bytes > MAX_NODE) return ::operator new(bytes);
+        const size_t cls = SizeCls(bytes);
+        if (FreeNode* node = free_[cls]) { free_[cls] = node->next; return node; }
+        const size_t blkBytes = cls * ALIGN;
+        if (static_cast<size_t>(end_ - cur_) < blkBytes) NewSlab(std::max(slabBytes_, blkBytes));
+        void* p = cur_;
+        cur_ += blkBytes;
+        return p;
+    }
+
+    /**
+     * @brief Returns a block obtained from Alloc with the same `bytes` to its free list.
+     */
+    void Free(void* p, size_t bytes) {
+        if (bytes > MAX_NODE) { ::operator delete(p); return; }
+        const size_t cls = SizeCls(bytes);
+        free_[cls] = new (p) FreeNode{free_[cls]};
+    }
+
+    /**
+     * @brief Makes sure at least `bytes` bytes can be carved without touching the heap again.
+     */
+    void Reserve(size_t bytes) {
+        if (static_cast<size_t>(end_ - cur_) < bytes) NewSlab(bytes);
+    }
+
+    /**
+     * @brief Total bytes obtained from the heap for slabs.
+     */
+    size_t SlabBytes() const { return totalBytes_; }
+
+private:
+    struct FreeNode { FreeNode* next; };
+
+    static size_t SizeCls(size_t bytes) { return (std::max(bytes, sizeof(FreeNode)) + ALIGN - 1) / ALIGN; }
+
+    void NewSlab(size_t bytes) {
+        bytes = (bytes + ALIGN - 1) / ALIGN * ALIGN;
+        slabs_.emplace_back(new (std::align_val_t{ALIGN}) char[bytes]);
+        cur_ = slabs_.back().get();
+        end_ = cur_ + bytes;
+        totalBytes_ += bytes;
+    }
+
+    struct SlabDel { void operator()(char* p) const { ::operator delete[](p, std::align_val_t{ALIGN}); } };
+
+    size_t slabBytes_;
+    size_t totalBytes_ {0};
+    char* cur_ {nullptr};
+    char* end_ {nullptr};
+    std::vector<std::unique_ptr<char[], SlabDel>> slabs_;
+    std::array<FreeNode*, MAX_NODE / ALIGN + 1> free_ {};
+};
+
+/**
+ * @brief Standard allocator adaptor that routes single-node allocations to a NodeArena.
+ */
+template <class T>
+class ArenaAlloc {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit ArenaAlloc(NodeArena* arena) : arena_(arena) {}
+    template <class U> ArenaAlloc(const ArenaAlloc<U>& o) : arena_(o.arena_) {}
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= NodeArena::ALIGN, "over-aligned node type");
+        if (n == 1) return static_cast<T*>(arena_->Alloc(sizeof(T)));
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n == 1) arena_->Free(p, sizeof(T));
+        else std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U> bool operator==(const ArenaAlloc<U>& o) const { return arena_ == o.arena_; }
+    template <class U> bool operator!=(const ArenaAlloc<U>& o) const { return arena_ != o.arena_; }
+
+private:
+    template <class U> friend class ArenaAlloc;
+    NodeArena* arena_;
+};
+
+/**
+ * @brief Type for storing orders at a specific price level, in time priority.
+ */
+using LvlOrdsInQ = std::list<RestingOrd, ArenaAlloc<RestingOrd>>;
+
+/**
+ * @brief A price level: its queue of orders plus running totals kept in step with the queue.
+ */
+struct LvlQ {
+    explicit LvlQ(const LvlOrdsInQ::allocator_type& alloc) : ords(alloc) {}
+
+    /**
+     * @brief Returns the aggregated price level from the running totals.
+     * @param px The price of this level.
+     */
+    PriceLvl Agg(int64_t px) const {
+        Check();
+        return PriceLvl{px, size, count};
+    }
+
+    /**
+     * @brief Debug-build check that the running totals match a full walk of the queue.
+     */
+    void Check() const {
+#ifndef NDEBUG
+        uint32_t sz = 0, ct = 0;
+        for (const auto& ord : ords) {
+            ++ct;
+            sz += ord.size;
+        }
+        assert(sz == size && ct == count);
+#endif
+    }
+
+    LvlOrdsInQ ords;
+    uint32_t size {0};
+    uint32_t count {0};
+};
+
+/**
+ * @brief Hints the CPU to pull the cache line holding `p` into L1; a no-op where unsupported.
+ */
+inline void PrefetchLine(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p, 0, 3);
+#else
+    (void)p;
+#endif
+}
+
+/**
+ * @brief Append-only byte buffer a checkpoint is serialized into; values are stored in native byte order.
+ */
+class CkptOut {
+public:
+    template <class T>
+    void Put(const T& v) {
+        static_assert(std::is_trivially_copyable<T>::value, "checkpoint fields must be plain values");
+        const char* p = reinterpret_cast<const char*>(&v);
+        buf_.append(p, sizeof(T));
+    }
+
+    /**
+     * @brief Overwrites a value written earlier at byte offset `at` (for counts known only afterwards).
+     */
+    template <class T>
+    void PutAt(size_t at, const T& v) { std::memcpy(&buf_[at], &v, sizeof(T)); }
+
+    size_t Size() const { return buf_.size(); }
+    std::string_view View() const { return buf_; }
+
+private:
+    std::string buf_;
+};
+
+/**
+ * @brief Reader over a checkpoint written with CkptOut.
+ */
+class CkptIn {
+public:
+    explicit CkptIn(std::string_view data) : rest_(data) {}
+
+    /**
+     * @throws std::runtime_error if the checkpoint ends early.
+     */
+    template <class T>
+    T Get() {
+        static_assert(std::is_trivially_copyable<T>::value, "checkpoint fields must be plain values");
+        if (rest_.size() < sizeof(T)) throw std::runtime_error{"Checkpoint truncated"};
+        T v;
+        std::memcpy(&v, rest_.data(), sizeof(T));
+        rest_.remove_prefix(sizeof(T));
+        return v;
+    }
+
+    bool AtEnd() const { return rest_.empty(); }
+
+private:
+    std::string_view rest_;
+};
+
+/**
+ * @brief Book side stored as a node-based std::map; the original layout, kept for very deep, sparse books.
+ *
+ * Bid prices are keyed negated so both sides share one map type and begin() is always the best level.
+ * Level handles are map iterators, stable until the level is erased.
+ */
+class MapSide {
+    using Lvls = std::map<int64_t, LvlQ, std::less<int64_t>, ArenaAlloc<std::pair<const int64_t, LvlQ>>>;
+
+public:
+    /**
+     * @brief Stable reference to a level, stored in the order-id index.
+     */
+    using Handle = Lvls::iterator;
+    /**
+     * @brief Estimated arena bytes per level, used when sizing a book up front.
+     */
+    static constexpr size_t LVL_NODE_BYTES = 4 * sizeof(void*) + sizeof(Lvls::value_type);
+
+    MapSide(NodeArena* arena, Sd::Type side) : lvls_(Lvls::allocator_type{arena}), neg_(side == Sd::Bid) {}
+
+    bool Empty() const { return lvls_.empty(); }
+    size_t Size() const { return lvls_.size(); }
+    void Clear() { lvls_.clear(); }
+
+    /**
+     * @brief Looks up the level at px.
+     * @return true and its handle in h if the level exists.
+     */
+    bool Find(int64_t px, Handle& h) { h = lvls_.find(Key(px)); return h != lvls_.end(); }
+
+    /**
+     * @brief Returns the level at px, creating an empty one with the given queue allocator if needed.
+     */
+    Handle FindOrIns(int64_t px, const LvlOrdsInQ::allocator_type& alloc) { return lvls_.try_emplace(Key(px), alloc).first; }
+
+    /**
+     * @brief Starts loading what a lookup of px touches first: the root and the best level.
+     */
+    void Prefetch(int64_t) const {
+        if (lvls_.empty()) return;
+        PrefetchLine(&*lvls_.begin());
+    }
+
+    LvlQ& Lvl(Handle h) { return h->second; }
+    int64_t Px(Handle h) const { return Key(h->first); }
+    void Erase(Handle h) { lvls_.erase(h); }
+
+    /**
+     * @brief Calls f(price, level) for up to n levels, best first.
+     */
+    template <class F>
+    void ForBest(size_t n, F&& f) const {
+        auto it = lvls_.begin();
+        for (size_t i = 0; i < n && it != lvls_.end(); ++i, ++it) f(Key(it->first), it->second);
+    }
+
+    /**
+     * @brief Calls f(price, level) for every level, worst first (the checkpoint order).
+     */
+    template <class F>
+    void ForWorstFirst(F&& f) const {
+        for (auto it = lvls_.rbegin(); it != lvls_.rend(); ++it) f(Key(it->first), it->second);
+    }
+
+    /**
+     * @brief Adds a level better than every existing one, in constant time (bulk restore).
+     */
+    Handle AppendBest(int64_t px, const LvlOrdsInQ::allocator_type& alloc) {
+        assert(lvls_.empty() || Key(px) < lvls_.begin()->first);
+        return lvls_.try_emplace(lvls_.begin(), Key(px), alloc);
+    }
+
+    /**
+     * @brief Returns the 0-based rank of the level at px from the best level, or 0 if there is none.
+     */
+    uint32_t Depth(int64_t px) const {
+        auto it = lvls_.lower_bound(Key(px));
+        if (it == lvls_.end() || it->first != Key(px)) return 0;
+        return std::distance(lvls_.begin(), it);
+    }
+
+private:
+    int64_t Key(int64_t px) const { return neg_ ? -px : px; }
+
+    Lvls lvls_;
+    bool neg_;
+};
+
+/**
+ * @brief Book side stored as a flat sorted vector, best level at the back.
+ *
+ * Top-N reads and depth lookups walk contiguous memory, and since most activity happens at or near
+ * the touch, inserts and erases there shift only a few elements. Moving a level moves its queue
+ * without touching the queue nodes, so order iterators stay valid; level handles are prices and
+ * are resolved by binary search.
+ */
+class VecSide {
+    using Lvls = std::vector<std::pair<int64_t, LvlQ>>;
+    static_assert(std::is_nothrow_move_constructible<LvlQ>::value, "levels must relocate without copying their queues");
+
+public:
+    using Handle = int64_t;
+    static constexpr size_t LVL_NODE_BYTES = 0;
+
+    VecSide(NodeArena*, Sd::Type side) : neg_(side == Sd::Bid) {}
+
+    bool Empty() const { return lvls_.empty(); }
+    size_t Size() const { return lvls_.size(); }
+    void Clear() { lvls_.clear(); }
+
+    bool Find(int64_t px, Handle& h) {
+        h = px;
+        auto it = Pos(Key(px));
+        return it != lvls_.end() && it->first == Key(px);
+    }
+
+    Handle FindOrIns(int64_t px, const LvlOrdsInQ::allocator_type& alloc) {
+        auto it = Pos(Key(px));
+        if (it == lvls_.end() || it->first != Key(px)) lvls_.emplace(it, Key(px), LvlQ(alloc));
+        return px;
+    }
+
+    /**
+     * @brief Starts loading the levels a search for px probes: the best end, where most activity is,
+     *        and the midpoint the binary search starts from.
+     */
+    void Prefetch(int64_t) const {
+        if (lvls_.empty()) return;
+        PrefetchLine(&lvls_.back());
+        PrefetchLine(&lvls_[lvls_.size() / 2]);
+    }
+
+    LvlQ& Lvl(Handle h) { return Pos(Key(h))->second; }
+    int64_t Px(Handle h) const { return h; }
+    void Erase(Handle h) { lvls_.erase(Pos(Key(h))); }
+
+    template <class F>
+    void ForBest(size_t n, F&& f) const {
+        auto it = lvls_.rbegin();
+        for (size_t i = 0; i < n && it != lvls_.rend(); ++i, ++it) f(Key(it->first), it->second);
+    }
+
+    template <class F>
+    void ForWorstFirst(F&& f) const {
+        for (const auto& [key, lvl] : lvls_) f(Key(key), lvl);
+    }
+
+    Handle AppendBest(int64_t px, const LvlOrdsInQ::allocator_type& alloc) {
+        assert(lvls_.empty() || Key(px) < lvls_.back().first);
+        lvls_.emplace_back(Key(px), LvlQ(alloc));
+        return px;
+    }
+
+    uint32_t Depth(int64_t px) const {
+        auto it = Pos(Key(px));
+        if (it == lvls_.end() || it->first != Key(px)) return 0;
+        return std::distance(it, lvls_.end()) - 1;
+    }
+
+private:
+    int64_t Key(int64_t px) const { return neg_ ? -px : px; }
+
+    /**
+     * @brief Keys are kept descending (worst level first); returns the first level whose key is <= key.
+     */
+    template <class Self>
+    static auto PosIn(Self& lvls, int64_t key) {
+        return std::lower_bound(lvls.begin(), lvls.end(), key, [](const Lvls::value_type& l, int64_t k) { return l.first > k; });
+    }
+    Lvls::iterator Pos(int64_t key) { return PosIn(lvls_, key); }
+    Lvls::const_iterator Pos(int64_t key) const { return PosIn(lvls_, key); }
+
+    Lvls lvls_;
+    bool neg_;
+};
+
+/**
+ * @brief Flat open-addressing map from order id to V, the order-id index of Book.
+ *
+ * Slots live in one array probed linearly from a Fibonacci hash of the id, kept at most half full
+ * and erased by backward shift, so a lookup touches one or two adjacent cache lines and the slot of
+ * a future id can be prefetched (Prefetch) before it is looked up. Growing rehashes into an array
+ * twice the size; pointers returned by Find stay valid until the next Emplace or Erase.
+ * @tparam V Value stored per id; default-constructible and trivially movable in practice.
+ */
+template <class V>
+class FlatIdMap {
+public:
+    FlatIdMap() { Rehash(MIN_SLOTS); }
+
+    /**
+     * @brief Grows the table so `n` ids fit without rehashing.
+     */
+    void Reserve(size_t n) {
+        size_t slots = MIN_SLOTS;
+        while (slots < 2 * n) slots <<= 1;
+        if (slots > slots_.size()) Rehash(slots);
+    }
+
+    /**
+     * @brief Returns the value of an id, or nullptr if absent.
+     */
+    V* Find(uint64_t id) {
+        for (size_t i = Home(id); slots_[i].used; i = (i + 1) & mask_) {
+            if (slots_[i].id == id) return &slots_[i].v;
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Inserts `v` under `id` unless the id is present.
+     * @return The stored value and whether it was inserted.
+     */
+    std::pair<V*, bool> Emplace(uint64_t id, const V& v) {
+        if (2 * (size_ + 1) > slots_.size()) Rehash(2 * slots_.size());
+        size_t i = Home(id);
+        for (; slots_[i].used; i = (i + 1) & mask_) {
+            if (slots_[i].id == id) return {&slots_[i].v, false};
+        }
+        slots_[i] = Slot{id, v, true};
+        ++size_;
+        return {&slots_[i].v, true};
+    }
+
+    /**
+     * @brief Removes an id if present; later entries of its probe run move back, so no tombstones are left.
+     */
+    void Erase(uint64_t id) {
+        size_t i = Home(id);
+        for (; slots_[i].used; i = (i + 1) & mask_) {
+            if (slots_[i].id == id) break;
+        }
+        if (!slots_[i].used) return;
+        slots_[i].used = false;
+        --size_;
+        for (size_t j = (i + 1) & mask_; slots_[j].used; j = (j + 1) & mask_) {
+            const size_t home = Home(slots_[j].id);
+            // Move j into the hole at i unless its home lies cyclically in (i, j].
+            if (((j - home) & mask_) >= ((j - i) & mask_)) {
+                slots_[i] = slots_[j];
+                slots_[j].used = false;
+                i = j;
+            }
+        }
+    }
+
+    /**
+     * @brief Starts loading the slot an id hashes to.
+     */
+    void Prefetch(uint64_t id) const { PrefetchLine(&slots_[Home(id)]); }
+
+    size_t Size() const { return size_; }
+
+    void Clear() {
+        for (Slot& s : slots_) s.used = false;
+        size_ = 0;
+    }
+
+private:
+    static constexpr size_t MIN_SLOTS = 16;
+
+    struct Slot {
+        uint64_t id;
+        V v;
+        bool used;
+    };
+
+    size_t Home(uint64_t id) const { return static_cast<size_t>((id * 0x9E3779B97F4A7C15ULL) >> 32) & mask_; }
+
+    void Rehash(size_t nSlots) {
+        std::vector<Slot> old(nSlots);
+        old.swap(slots_);
+        mask_ = nSlots - 1;
+        for (const Slot& s : old) {
+            if (!s.used) continue;
+            size_t i = Home(s.id);
+            while (slots_[i].used) i = (i + 1) & mask_;
+            slots_[i] = s;
+        }
+    }
+
+    std::vector<Slot> slots_;
+    size_t mask_ {0};
+    size_t size_ {0};
+};
+
+/**
+ * @brief Class representing a market order book.Which is being deferentiated on instrumentId and publisherId which is managed by market class.
+ * @tparam Side Storage for the levels of one side: VecSide (flat vector, default) or MapSide (std::map).
+ * @tparam Depth Number of levels kept in the top-of-book cache.
+ *
+ * Cache-line aligned, so books stored next to each other (see Market) never share a line.
+ */
+template <class Side = VecSide, size_t Depth = MBP_DEPTH>
+class alignas(64) Book {
+public:
+    /**
+     * @brief Top-of-book snapshot of one side.
+     */
+    using Top = TopLvlsN<Depth>;
+
+    /**
+     * @brief Creates an empty book.
+     * @param arena Arena shared with other books of the same thread, or nullptr to give the book its own.
+     * @param expMaxOrds Expected peak number of live orders; the arena and the id index are sized for it
+     *                   up front so the steady state does not allocate.
+     */
+    explicit Book(NodeArena* arena = nullptr, size_t expMaxOrds = 0)
+        : ownArena_(arena ? nullptr : new NodeArena),
+          arena_(arena ? arena : ownArena_.get()),
+          offers_(arena_, Sd::Ask),
+          bids_(arena_, Sd::Bid) {
+        if (expMaxOrds) {
+            ordsById_.Reserve(expMaxOrds);
+            arena_->Reserve(expMaxOrds * (ORD_NODE_BYTES + Side::LVL_NODE_BYTES));
+        }
+    }
+
+    /**
+     * @brief Returns the best bid and ask price levels.
+     */
+    std::pair<PriceLvl, PriceLvl> Bbo() const {
+        return {GetBidLvl(0), GetAskLvl(0)};
+    }
+
+    /**
+     * @brief Returns the bid price level at a given index.
+     * @param idx The index of the bid level to retrieve.
+     */
+    PriceLvl GetBidLvl(size_t idx) const { return LvlAt(bids_, idx); }
+
+    /**
+     * @brief Returns the ask price level at a given index.
+     * @param idx The index of the ask level to retrieve.
+     */
+    PriceLvl GetAskLvl(size_t idx) const { return LvlAt(offers_, idx); }
+
+    /**
+     * @brief Returns the cached top Depth bid levels, refreshing them if a visible level changed.
+     */
+    const Top& BidTop() const {
+        if (bidDirty_) { FillTop(bids_, bidTop_); bidDirty_ = false; }
+        return bidTop_;
+    }
+
+    /**
+     * @brief Returns the cached top Depth ask levels, refreshing them if a visible level changed.
+     */
+    const Top& AskTop() const {
+        if (askDirty_) { FillTop(offers_, askTop_); askDirty_ = false; }
+        return askTop_;
+    }
+
+    /**
+     * @brief Generation counters bumped whenever a change may be visible in the bid/ask top levels.
+     */
+    uint64_t BidGen() const { return bidGen_; }
+    uint64_t AskGen() const { return askGen_; }
+
+    /**
+     * @brief Calculates the depth of a bid level at a specific price.
+     *
+     * Answered from the top-Depth cache; only a price beyond the cached levels asks the side itself.
+     * @param price The price of the bid level.
+     */
+    uint32_t GetBidLevelDepth(int64_t price) const { return TopDepth(BidTop(), bids_, price, [](int64_t a, int64_t b) { return a > b; }); }
+
+    /**
+     * @brief Calculates the depth of an ask level at a specific price (see GetBidLevelDepth).
+     * @param price The price of the ask level.
+     */
+    uint32_t GetAskLevelDepth(int64_t price) const { return TopDepth(AskTop(), offers_, price, [](int64_t a, int64_t b) { return a < b; }); }
+
+    /**
+     * @brief Applies a market by order message to the book.
+     */
+    void Apply(const MboSingle& m) {
+        switch (m.action) {
+            case Act::Clear: Clear(); break;
+            case Act::Add: Add(m); break;
+            case Act::Cancel: Cancel(m); break;
+            case Act::Modify: Modify(m); break;
+            case Act::Trade: case Act::Fill: case Act::None: break;
+            default: WarnLog::Get().Warn(Wrn::UnkAction, m.action);
+        }
+    }
+
+    /**
+     * @brief Starts loading what Apply(m) will touch first: the order's id slot for cancels and
+     *        modifies, the probed levels of the side for adds. Does not change the book.
+     */
+    void Prefetch(const MboSingle& m) const {
+        if (m.action == Act::Cancel || m.action == Act::Modify) ordsById_.Prefetch(m.orderId);
+        if (m.action == Act::Add || m.action == Act::Modify) {
+            if (m.side == Sd::Bid) bids_.Prefetch(m.price);
+            else if (m.side == Sd::Ask) offers_.Prefetch(m.price);
+        }
+    }
+
+    /**
+     * @brief Processes a synthetic trade by adjusting the book.
+     * @param px The price of the synthetic trade.
+     * @param sz The size of the synthetic trade.
+     * @param sideAff The side affected by the synthetic trade (Bid or Ask).
+     */
+    void ProcSynthTrade(int64_t px, uint32_t sz, Sd::Type sideAff) {
+        Side& affLvls = GetSdOrds(sideAff);
+        typename Side::Handle lvlH;
+        if (!affLvls.Find(px, lvlH)) {
+            WarnLog::Get().Warn(Wrn::SynthNoLvl, sideAff, px, sz);
+            return;
+        }
+        Touch(sideAff, px);
+        LvlQ& lvl = affLvls.Lvl(lvlH);
+        LvlOrdsInQ& ordsAtLvl = lvl.ords;
+        uint32_t remSz = sz;
+        auto curOrd = ordsAtLvl.begin();
+        while (curOrd != ordsAtLvl.end() && remSz > 0) {
+            if (curOrd->size <= remSz) {
+                remSz -= curOrd->size;
+                lvl.size -= curOrd->size;
+                --lvl.count;
+                ordsById_.Erase(curOrd->orderId);
+                curOrd = ordsAtLvl.erase(curOrd);
+            } else {
+                curOrd->size -= remSz;
+                lvl.size -= remSz;
+                remSz = 0;
+            }
+        }
+        lvl.Check();
+        if (ordsAtLvl.empty()) affLvls.Erase(lvlH);
+    }
+
+    /**
+     * @brief Writes the book to a checkpoint: per side the levels worst first, each with its orders in queue order.
+     */
+    void SaveState(CkptOut& out) const {
+        out.Put<uint64_t>(ordsById_.Size());
+        for (const Side* sd : {&bids_, &offers_}) {
+            out.Put<uint32_t>(static_cast<uint32_t>(sd->Size()));
+            sd->ForWorstFirst([&](int64_t px, const LvlQ& lvl) {
+                out.Put<int64_t>(px);
+                out.Put<uint32_t>(lvl.count);
+                for (const RestingOrd& o : lvl.ords) {
+                    out.Put<uint64_t>(o.orderId);
+                    out.Put<uint32_t>(o.size);
+                    out.Put<uint8_t>(o.flags);
+                }
+            });
+        }
+    }
+
+    /**
+     * @brief Replaces the book with one read by LoadState's counterpart SaveState.
+     *
+     * The sides are bulk-built: levels arrive worst first and are appended at the best end, and the
+     * id index is sized once, so restoring costs no searches or rebalancing.
+     * @throws std::runtime_error if the data is inconsistent.
+     */
+    void LoadState(CkptIn& in) {
+        Clear();
+        ordsById_.Reserve(in.Get<uint64_t>());
+        for (Sd::Type s : {Sd::Bid, Sd::Ask}) {
+            Side& sd = GetSdOrds(s);
+            const uint32_t nLvls = in.Get<uint32_t>();
+            int64_t prevPx = 0;
+            for (uint32_t l = 0; l < nLvls; ++l) {
+                const int64_t px = in.Get<int64_t>();
+                if (l && (s == Sd::Bid ? px <= prevPx : px >= prevPx)) throw std::runtime_error{"Checkpoint levels out of order"};
+                prevPx = px;
+                auto lvlH = sd.AppendBest(px, QueueAlloc());
+                LvlQ& lvl = sd.Lvl(lvlH);
+                const uint32_t nOrds = in.Get<uint32_t>();
+                if (nOrds == 0) throw std::runtime_error{"Checkpoint level without orders"};
+                for (uint32_t o = 0; o < nOrds; ++o) {
+                    RestingOrd ord;
+                    ord.orderId = in.Get<uint64_t>();
+                    ord.size = in.Get<uint32_t>();
+                    ord.flags = in.Get<uint8_t>();
+                    lvl.ords.push_back(ord);
+                    lvl.size += ord.size;
+                    ++lvl.count;
+                    if (!ordsById_.Emplace(ord.orderId, OrdHandle{lvlH, std::prev(lvl.ords.end()), s}).second) {
+                        throw std::runtime_error{"Checkpoint repeats order id " + std::to_string(ord.orderId)};
+                    }
+                }
+            }
+        }
+        bidDirty_ = askDirty_ = true;
+        ++bidGen_;
+        ++askGen_;
+    }
+
+private:
+    /**
+     * @brief Direct handle to a resting order: its level, its queue position and its side.
+     *
+     * Both stay valid until the order (or its emptied level) is erased, which makes cancel, modify
+     * and synthetic-trade removal independent of the number of orders at the level.
+     */
+    struct OrdHandle { typename Side::Handle lvl; typename LvlOrdsInQ::iterator ord; Sd::Type side; };
+    /**
+     * @brief Type for mapping order IDs to their resting order handles.
+     */
+    using OrdsById = FlatIdMap<OrdHandle>;
+
+    /**
+     * @brief Estimated node size of the order queue, used to size the arena for a live-order target.
+     */
+    static constexpr size_t ORD_NODE_BYTES = sizeof(RestingOrd) + 2 * sizeof(void*);
+
+    /**
+     * @brief Returns the level at a 0-based index from the best level of a side, or an empty level.
+     */
+    static PriceLvl LvlAt(const Side& sd, size_t idx) {
+        PriceLvl res;
+        size_t i = 0;
+        sd.ForBest(idx + 1, [&](int64_t px, const LvlQ& lvl) { if (i++ == idx) res = lvl.Agg(px); });
+        return res;
+    }
+
+    /**
+     * @brief Returns the 0-based rank of the level at px, or 0 if there is none, using a side's top levels.
+     * @param top The side's current top-Depth snapshot.
+     * @param better Strict ordering of prices, best first.
+     */
+    template <class Better>
+    static uint32_t TopDepth(const Top& top, const Side& sd, int64_t px, Better better) {
+        for (size_t i = 0; i < Depth; ++i) {
+            if (top[i].IsEmpty() || better(px, top[i].price)) return 0;
+            if (top[i].price == px) return static_cast<uint32_t>(i);
+        }
+        return sd.Depth(px);
+    }
+
+    /**
+     * @brief Rebuilds a top-levels snapshot of a side.
+     * @param sd The side to read, best level first.
+     * @param top The snapshot to fill; slots past the last level are reset to empty.
+     */
+    static void FillTop(const Side& sd, Top& top) {
+        size_t i = 0;
+        sd.ForBest(Depth, [&](int64_t px, const LvlQ& lvl) { top[i++] = lvl.Agg(px); });
+        for (; i < Depth; ++i) top[i] = PriceLvl{};
+    }
+
+    /**
+     * @brief Marks the top-levels cache of a side dirty if a change at px can be visible in it.
+     *
+     * Must be called before the change is applied: while the cache is clean it still describes the
+     * current book, so a level strictly worse than the last cached one lies beyond Depth.
+     * @param s The side being changed.
+     * @param px The price of the level being changed.
+     */
+    void Touch(Sd::Type s, int64_t px) {
+        if (s == Sd::Bid) {
+            if (bidDirty_ || !bidTop_.back() || px >= bidTop_.back().price) { bidDirty_ = true; ++bidGen_; }
+        } else if (s == Sd::Ask) {
+            if (askDirty_ || !askTop_.back() || px <= askTop_.back().price) { askDirty_ = true; ++askGen_; }
+        }
+    }
+
+    /**
+     * @brief Clears the book, removing all orders.
+     */
+    void Clear() {
+        if (!bids_.Empty()) { bidDirty_ = true; ++bidGen_; }
+        if (!offers_.Empty()) { askDirty_ = true; ++askGen_; }
+        ordsById_.Clear(); offers_.Clear(); bids_.Clear();
+    }
+
+    /**
+     * @brief Adds a new order to the book.
+     * @param m The MboSingle message containing the order details.
+     */
+    void Add(const MboSingle& m) {
+        Touch(m.side, m.price);
+        Side& sd = GetSdOrds(m.side);
+        auto lvlH = sd.FindOrIns(m.price, QueueAlloc());
+        LvlQ& lvl = sd.Lvl(lvlH);
+        lvl.size += m.size;
+        ++lvl.count;
+        lvl.ords.push_back(RestingOrd{m.orderId, m.size, m.flags});
+        auto r = ordsById_.Emplace(m.orderId, OrdHandle{lvlH, std::prev(lvl.ords.end()), m.side});
+        if (!r.second) throw std::invalid_argument{"Dupe ID " + std::to_string(m.orderId) + " for Add"};
+        RECON_STAT(BumpMax(LocalStats().maxBookOrds, ordsById_.Size()));
+    }
+
+    /**
+     * @brief Cancels an order in the book.
+     * @param m The MboSingle message containing the order ID and details.
+     */
+    void Cancel(const MboSingle& m) {
+        const OrdHandle* ph = ordsById_.Find(m.orderId);
+        if (!ph) { WarnLog::Get().Warn(Wrn::CancelUnkId, static_cast<int64_t>(m.orderId)); return; }
+        const OrdHandle h = *ph;
+        Side& sd = GetSdOrds(h.side);
+        LvlQ& lvl = sd.Lvl(h.lvl);
+        auto ordIt = h.ord;
+        Touch(h.side, sd.Px(h.lvl));
+        if (ordIt->size < m.size) { WarnLog::Get().Warn(Wrn::CancelOverSz, static_cast<int64_t>(m.orderId)); lvl.size -= ordIt->size; ordIt->size = 0; }
+        else { lvl.size -= m.size; ordIt->size -= m.size; }
+        if (ordIt->size == 0) {
+            --lvl.count;
+            ordsById_.Erase(m.orderId);
+            lvl.ords.erase(ordIt);
+            if (lvl.ords.empty()) sd.Erase(h.lvl);
+        }
+    }
+
+    /**
+     * @brief Modifies an existing order in the book.
+     *
+     * The resting order is spliced between or within queues, so its handle in ordsById_ stays valid.
+     * @param m The MboSingle message containing the updated order details.
+     */
+    void Modify(const MboSingle& m) {
+        OrdHandle* ph = ordsById_.Find(m.orderId);
+        if (!ph) { Add(m); return; }
+        OrdHandle& h = *ph;
+        if (h.side != m.side) throw std::logic_error{"ID " + std::to_string(m.orderId) + " changed side."};
+        Side& sd = GetSdOrds(m.side);
+        const int64_t prevPx = sd.Px(h.lvl);
+        auto ordIt = h.ord;
+        Touch(m.side, prevPx);
+        if (prevPx != m.price) {
+            Touch(m.side, m.price);
+            // Inserting the new level may relocate levels of a flat side, so look both up afterwards.
+            auto newLvlH = sd.FindOrIns(m.price, QueueAlloc());
+            LvlQ& prevLvl = sd.Lvl(h.lvl);
+            LvlQ& newLvl = sd.Lvl(newLvlH);
+            prevLvl.size -= ordIt->size;
+            --prevLvl.count;
+            newLvl.ords.splice(newLvl.ords.end(), prevLvl.ords, ordIt);
+            newLvl.size += m.size;
+            ++newLvl.count;
+            *ordIt = RestingOrd{m.orderId, m.size, m.flags};
+            if (prevLvl.ords.empty()) sd.Erase(h.lvl);
+            h.lvl = newLvlH;
+        } else {
+            LvlQ& prevLvl = sd.Lvl(h.lvl);
+            prevLvl.size += m.size - ordIt->size;
+            if (ordIt->size < m.size) {
+                prevLvl.ords.splice(prevLvl.ords.end(), prevLvl.ords, ordIt);
+                *ordIt = RestingOrd{m.orderId, m.size, m.flags};
+            } else {
+                ordIt->size = m.size;
+            }
+            prevLvl.Check();
+        }
+    }
+    /**
+     * @brief Gets the orders for a specific side (Bid or Ask).
+     * @param s The side type (Bid or Ask).
+     * @return A reference to the levels of that side.
+     */
+    Side& GetSdOrds(Sd::Type s) {
+        switch (s) { case Sd::Ask: return offers_; case Sd::Bid: return bids_; default: throw std::invalid_argument{"Invalid side."}; }
+    }
+
+    /**
+     * @brief Allocator for the order queue of a newly created level.
+     */
+    typename LvlOrdsInQ::allocator_type QueueAlloc() const { return typename LvlOrdsInQ::allocator_type{arena_}; }
+
+    /**
+     * @brief Arena owned by this book when none was supplied; declared first so it outlives the containers.
+     */
+    std::unique_ptr<NodeArena> ownArena_;
+    /**
+     * @brief Arena backing every node of this book.
+     */
+    NodeArena* arena_;
+    /**
+     * @brief Maps order IDs to their resting order handles.
+     */
+    OrdsById ordsById_;
+    /**
+     * @brief Ask price levels with their orders.
+     */
+    Side offers_;
+    /**
+     * @brief Bid price levels with their orders.
+     */
+    Side bids_;
+    /**
+     * @brief Cached top bid/ask levels, valid while the matching dirty flag is clear.
+     */
+    mutable Top bidTop_;
+    mutable Top askTop_;
+    mutable bool bidDirty_ {false};
+    mutable bool askDirty_ {false};
+    /**
+     * @brief Bumped on every change that may alter the cached top levels, so Market knows when to re-aggregate.
+     */
+    uint64_t bidGen_ {0};
+    uint64_t askGen_ {0};
+};
+
+
+/**
+ * @brief Class representing a market, which contains multiple books differentiated by instrument ID and publisher ID.
+ * @tparam Side Level storage used by the books of this market (see Book).
+ * @tparam Depth Number of aggregated levels kept per instrument side.
+ */
+template <class Side = VecSide, size_t Depth = MBP_DEPTH>
+class Market {
+public:
+
+    /**
+     * @brief Creates an empty market whose books share one node arena.
+     * @param expMaxOrds Expected peak number of live orders per book, forwarded to each new Book.
+     */
+    explicit Market(size_t expMaxOrds = 0) : arena_(new NodeArena), expMaxOrds_(expMaxOrds) {}
+
+    /**
+    * @brief Retrieves aggregated bid price levels for a specific instrument across all publishers.
+    *
+    * The snapshot is cached per instrument and only re-aggregated after a publisher book reported
+    * a change to its visible bid levels, by merging the publishers' cached top levels (MergeTops).
+    * @param instrId The unique identifier of the financial instrument.
+    * @return The top Depth aggregated levels, sorted from the highest (best) bid price downwards.
+    */
+    const TopLvlsN<Depth>& GetAggBidLvls(uint32_t instrId) const {
+        RECON_TIME(Agg);
+        const InstrBooks* pIb = FindInstr(instrId);
+        if (!pIb) return EmptyLvls();
+        const InstrBooks& ib = *pIb;
+        if (ib.bidsDirty) {
+            MergeTops(ib, &Book<Side, Depth>::BidTop, [](int64_t a, int64_t b) { return a > b; }, ib.aggBids);
+            ib.bidsDirty = false;
+        }
+        return ib.aggBids;
+    }
+
+    /**
+     * @brief Retrieves aggregated ask price levels for a specific instrument across all publishers.
+     *
+     * Cached per instrument in the same way as GetAggBidLvls.
+     * @param instrId The unique identifier of the financial instrument.
+     * @return The top Depth aggregated levels, sorted from the lowest (best) ask price upwards.
+     */
+    const TopLvlsN<Depth>& GetAggAskLvls(uint32_t instrId) const {
+        RECON_TIME(Agg);
+        const InstrBooks* pIb = FindInstr(instrId);
+        if (!pIb) return EmptyLvls();
+        const InstrBooks& ib = *pIb;
+        if (ib.asksDirty) {
+            MergeTops(ib, &Book<Side, Depth>::AskTop, [](int64_t a, int64_t b) { return a < b; }, ib.aggAsks);
+            ib.asksDirty = false;
+        }
+        return ib.aggAsks;
+    }
+
+    /**
+     * @brief Gets the depth of a specific level in the book for a given instrument and publisher.
+     * @param instrId The unique identifier of the financial instrument.
+     * @param pubId The unique identifier of the publisher.
+     * @param price The price level to check.
+     * @param side The side of the book (Bid or Ask).
+     * @return The depth of the level at the specified price, or 0 if the level does not exist.
+     */
+    uint32_t GetLevelDepth(uint32_t instrId, uint16_t pubId, int64_t price, Sd::Type side) const {
+        if (const Cell* c = FindCell(instrId, pubId)) {
+            if (side == Sd::Bid) return c->book->GetBidLevelDepth(price);
+            else if (side == Sd::Ask) return c->book->GetAskLevelDepth(price);
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Applies a market by order message to the appropriate book.
+     * @param m The MboSingle message containing the order details.
+     */
+    void Apply(const MboSingle& m) {
+        RECON_TIME(Apply);
+        const Cell* c = FindCell(m.instrId, m.pubId);
+        if (!c) c = &AddBook(m.instrId, m.pubId);
+        Book<Side, Depth>& book = *c->book;
+        const uint64_t bidGen = book.BidGen(), askGen = book.AskGen();
+        book.Apply(m);
+        c->instr->MarkChanged(book, bidGen, askGen);
+    }
+
+    /**
+     * @brief First prefetch stage of a message applied a few messages from now: its directory cell.
+     */
+    void PrefetchCell(uint32_t instrId, uint16_t pubId) const {
+        const uint32_t col = pubId < pubCols_.size() ? pubCols_[pubId] : 0;
+        const uint32_t row = col ? FindRow(instrId) : 0;
+        if (row) PrefetchLine(&cells_[(static_cast<size_t>(row - 1) << strideLog_) + col - 1]);
+    }
+
+    /**
+     * @brief Second prefetch stage, once the cell is loaded: the book's id slot or levels
+     *        (Book::Prefetch). Messages for books that do not exist yet are skipped.
+     */
+    void Prefetch(const MboSingle& m) const {
+        if (const Cell* c = FindCell(m.instrId, m.pubId)) c->book->Prefetch(m);
+    }
+
+    /**
+     * @brief Processes a synthetic trade for a specific instrument and publisher.
+     * @param instrId The unique identifier of the financial instrument.
+     * @param pubId The unique identifier of the publisher.
+     * @param px The price of the synthetic trade.
+     * @param sz The size of the synthetic trade.
+     * @param sideAff The side affected by the synthetic trade (Bid or Ask).
+     */
+    void ProcSynthTrade(uint32_t instrId, uint16_t pubId, int64_t px, uint32_t sz, Sd::Type sideAff) {
+        RECON_TIME(Synth);
+        const Cell* c = FindCell(instrId, pubId);
+        if (!c) {
+            if (!FindInstr(instrId)) WarnLog::Get().Warn(Wrn::SynthNoInstr, instrId);
+            else WarnLog::Get().Warn(Wrn::SynthNoBook, instrId, pubId);
+            return;
+        }
+        Book<Side, Depth>& book = *c->book;
+        const uint64_t bidGen = book.BidGen(), askGen = book.AskGen();
+        book.ProcSynthTrade(px, sz, sideAff);
+        c->instr->MarkChanged(book, bidGen, askGen);
+    }
+
+    /**
+     * @brief Writes every book to a checkpoint, instruments and publishers in order of first sight.
+     */
+    void SaveState(CkptOut& out) const {
+        out.Put<uint32_t>(static_cast<uint32_t>(instrs_.size()));
+        for (const InstrBooks& ib : instrs_) {
+            out.Put<uint32_t>(ib.instrId);
+            out.Put<uint16_t>(static_cast<uint16_t>(ib.pubBooks.size()));
+            for (const PubBook& pb : ib.pubBooks) {
+                out.Put<uint16_t>(pb.pubId);
+                pb.book->SaveState(out);
+            }
+        }
+    }
+
+    /**
+     * @brief Loads the books written by SaveState into this (empty) market.
+     * @throws std::runtime_error if the market already has books or the data is inconsistent.
+     */
+    void LoadState(CkptIn& in) {
+        if (!instrs_.empty()) throw std::runtime_error{"Checkpoint restored into a market in use"};
+        const uint32_t nInstrs = in.Get<uint32_t>();
+        for (uint32_t i = 0; i < nInstrs; ++i) {
+            const uint32_t instrId = in.Get<uint32_t>();
+            if (FindInstr(instrId)) throw std::runtime_error{"Checkpoint repeats instrument " + std::to_string(instrId)};
+            const uint16_t nPubs = in.Get<uint16_t>();
+            for (uint16_t p = 0; p < nPubs; ++p) {
+                const uint16_t pubId = in.Get<uint16_t>();
+                if (FindCell(instrId, pubId)) throw std::runtime_error{"Checkpoint repeats publisher " + std::to_string(pubId)};
+                AddBook(instrId, pubId).book->LoadState(in);
+            }
+            InstrBooks& ib = GetOrAddInstr(instrId);
+            ib.bidsDirty = ib.asksDirty = true;
+        }
+    }
+
+private:
+    /**
+     * @brief A publisher's book within an instrument's directory entry.
+     */
+    struct PubBook {
+        uint16_t pubId;
+        Book<Side, Depth>* book;
+    };
+
+    /**
+     * @brief Publisher books of one instrument together with their cached aggregated top levels.
+     */
+    struct InstrBooks {
+        uint32_t instrId {0};
+        /**
+         * @brief The instrument's books in order of first sight, for aggregation and checkpoints;
+         *        lookups go through the cells instead.
+         */
+        std::vector<PubBook> pubBooks;
+        mutable TopLvlsN<Depth> aggBids;
+        mutable TopLvlsN<Depth> aggAsks;
+        mutable bool bidsDirty {false};
+        mutable bool asksDirty {false};
+
+        /**
+         * @brief Flags the aggregated sides whose publisher book reported a visible change.
+         */
+        void MarkChanged(const Book<Side, Depth>& book, uint64_t bidGen, uint64_t askGen) {
+            bidsDirty |= book.BidGen() != bidGen;
+            asksDirty |= book.AskGen() != askGen;
+        }
+    };
+
+    /**
+     * @brief Directory cell of one (instrument, publisher) pair: the book and the instrument's entry, so
+     *        dispatching a message is a single load. Cells of a publisher without a book yet still point
+     *        to the instrument's entry.
+     */
+    struct Cell {
+        Book<Side, Depth>* book {nullptr};
+        InstrBooks* instr {nullptr};
+    };
+
+    /**
+     * @brief Instrument ids below this find their row through the direct table instrRows_; larger ones
+     *        through the hash map wideInstrRows_. Bounds the direct table to 256 KiB.
+     */
+    static constexpr uint32_t DIRECT_INSTR_MAX = 1 << 16;
+
+    /**
+     * @brief Returns the 1-based cell row of an instrument, or 0 if no message for it was applied yet.
+     */
+    uint32_t FindRow(uint32_t instrId) const {
+        if (instrId < DIRECT_INSTR_MAX) return instrId < instrRows_.size() ? instrRows_[instrId] : 0;
+        auto it = wideInstrRows_.find(instrId);
+        return it != wideInstrRows_.end() ? it->second : 0;
+    }
+
+    /**
+     * @brief Returns the cell of an (instrument, publisher) pair, or nullptr if the pair has no book yet.
+     *
+     * Publisher ids are remapped to dense columns and instrument ids to dense rows on first sight. Each
+     * row has 2^strideLog_ columns, so the cell sits at (row << strideLog_) + column.
+     */
+    const Cell* FindCell(uint32_t instrId, uint16_t pubId) const {
+        const uint32_t col = pubId < pubCols_.size() ? pubCols_[pubId] : 0;
+        const uint32_t row = col ? FindRow(instrId) : 0;
+        if (!row) return nullptr;
+        const Cell& c = cells_[(static_cast<size_t>(row - 1) << strideLog_) + col - 1];
+        return c.book ? &c : nullptr;
+    }
+
+    /**
+     * @brief Returns the directory entry of an instrument, or nullptr if no message for it was applied yet.
+     */
+    InstrBooks* FindInstr(uint32_t instrId) const {
+        const uint32_t row = FindRow(instrId);
+        return row ? cells_[static_cast<size_t>(row - 1) << strideLog_].instr : nullptr;
+    }
+
+    /**
+     * @brief Returns the directory entry of an instrument, creating it and appending its row of cells on
+     *        first sight.
+     */
+    InstrBooks& GetOrAddInstr(uint32_t instrId) {
+        if (InstrBooks* ib = FindInstr(instrId)) return *ib;
+        InstrBooks& ib = instrs_.emplace_back();
+        ib.instrId = instrId;
+        const uint32_t row = static_cast<uint32_t>(instrs_.size());
+        if (instrId < DIRECT_INSTR_MAX) {
+            if (instrId >= instrRows_.size()) {
+                instrRows_.resize(std::min<size_t>(std::max<size_t>(instrId + 1, instrRows_.size() * 2), DIRECT_INSTR_MAX), 0);
+            }
+            instrRows_[instrId] = row;
+        } else {
+            wideInstrRows_.emplace(instrId, row);
+        }
+        cells_.resize(static_cast<size_t>(row) << strideLog_, Cell{nullptr, &ib});
+        return ib;
+    }
+
+    /**
+     * @brief Returns the 1-based column of a publisher, assigning the next one on first sight; when the
+     *        columns outgrow the rows, every row is widened to twice the stride.
+     */
+    uint32_t GetOrAddPubCol(uint16_t pubId) {
+        if (pubId >= pubCols_.size()) pubCols_.resize(static_cast<size_t>(pubId) + 1, 0);
+        if (!pubCols_[pubId]) {
+            pubCols_[pubId] = ++nPubCols_;
+            if (nPubCols_ > (1u << strideLog_)) Restride(strideLog_ + 1);
+        }
+        return pubCols_[pubId];
+    }
+
+    /**
+     * @brief Copies the cell rows into rows of 2^log columns.
+     */
+    void Restride(uint32_t log) {
+        const size_t rows = cells_.size() >> strideLog_;
+        const size_t oldW = size_t{1} << strideLog_, newW = size_t{1} << log;
+        std::vector<Cell> cells(rows << log);
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t c = 0; c < newW; ++c) {
+                cells[r * newW + c] = Cell{c < oldW ? cells_[r * oldW + c].book : nullptr, cells_[r * oldW].instr};
+            }
+        }
+        cells_.swap(cells);
+        strideLog_ = log;
+    }
+
+    /**
+     * @brief Creates the book of an (instrument, publisher) pair that has none yet.
+     */
+    const Cell& AddBook(uint32_t instrId, uint16_t pubId) {
+        InstrBooks& ib = GetOrAddInstr(instrId);
+        const uint32_t col = GetOrAddPubCol(pubId);
+        Book<Side, Depth>* book = &books_.emplace_back(arena_.get(), expMaxOrds_);
+        ib.pubBooks.push_back(PubBook{pubId, book});
+        Cell& c = cells_[(static_cast<size_t>(FindRow(instrId) - 1) << strideLog_) + col - 1];
+        c.book = book;
+        return c;
+    }
+
+    /**
+     * @brief Consolidates one side of an instrument's publisher books into `agg`.
+     *
+     * A k-way merge over the publishers' cached top-Depth arrays, which are sorted best first: each
+     * step takes the best head price and sums the heads at that price. The consolidated top Depth
+     * levels are always within the publishers' top Depth, so no book walk is needed. A single
+     * publisher's snapshot is copied as is; up to MERGE_LANES publishers are merged by MergeLadders
+     * with one vector minimum per level, more by the head list below.
+     * @param top Book::BidTop or Book::AskTop.
+     * @param better Strict ordering of prices, best first.
+     */
+    template <class Better>
+    void MergeTops(const InstrBooks& ib, const TopLvlsN<Depth>& (Book<Side, Depth>::*top)() const, Better better,
+                   TopLvlsN<Depth>& agg) const {
+        if (ib.pubBooks.size() == 1) {
+            agg = (ib.pubBooks[0].book->*top)();
+            return;
+        }
+        if (ib.pubBooks.size() <= MERGE_LANES) {
+            const TopLvlsN<Depth>* lads[MERGE_LANES];
+            for (size_t h = 0; h < ib.pubBooks.size(); ++h) lads[h] = &(ib.pubBooks[h].book->*top)();
+            // Bids are the side where the higher price is better.
+            MergeLadders<SIMD_ON>(lads, ib.pubBooks.size(), better(1, 0), agg);
+            return;
+        }
+        heads_.clear();
+        for (const PubBook& pb : ib.pubBooks) {
+            const TopLvlsN<Depth>& t = (pb.book->*top)();
+            if (!t[0].IsEmpty()) heads_.push_back(Head{t.data(), t.data() + Depth});
+        }
+        size_t i = 0;
+        for (; i < Depth && !heads_.empty(); ++i) {
+            int64_t px = heads_[0].cur->price;
+            for (size_t h = 1; h < heads_.size(); ++h) {
+                if (better(heads_[h].cur->price, px)) px = heads_[h].cur->price;
+            }
+            PriceLvl lvl {px, 0, 0};
+            for (size_t h = 0; h < heads_.size();) {
+                Head& hd = heads_[h];
+                if (hd.cur->price == px) {
+                    lvl.size += hd.cur->size;
+                    lvl.count += hd.cur->count;
+                    if (++hd.cur == hd.end || hd.cur->IsEmpty()) { hd = heads_.back(); heads_.pop_back(); continue; }
+                }
+                ++h;
+            }
+            agg[i] = lvl;
+        }
+        for (; i < Depth; ++i) agg[i] = PriceLvl{};
+    }
+
+    /**
+     * @brief Read position in one publisher's top levels during MergeTops.
+     */
+    struct Head {
+        const PriceLvl* cur;
+        const PriceLvl* end;
+    };
+
+    /**
+     * @brief Scratch heads of MergeTops, kept to avoid reallocating them per merge.
+     */
+    mutable std::vector<Head> heads_;
+
+    /**
+     * @brief Snapshot returned for instruments that have no books yet.
+     */
+    static const TopLvlsN<Depth>& EmptyLvls() {
+        static const TopLvlsN<Depth> empty {};
+        return empty;
+    }
+
+    /**
+     * @brief Node arena shared by all books of this market; heap-held so its address survives a move.
+     */
+    std::unique_ptr<NodeArena> arena_;
+    /**
+     * @brief Expected peak number of live orders per book.
+     */
+    size_t expMaxOrds_;
+    /**
+     * @brief Every book of the market, in order of first sight; a deque so books never move.
+     */
+    std::deque<Book<Side, Depth>> books_;
+    /**
+     * @brief Directory entries of the instruments, in order of first sight (stable like books_).
+     */
+    mutable std::deque<InstrBooks> instrs_;
+    /**
+     * @brief 1-based column of each publisher id seen so far; 0 when unseen.
+     */
+    std::vector<uint32_t> pubCols_;
+    uint32_t nPubCols_ {0};
+    /**
+     * @brief log2 of the columns per row of cells_; starts at four publishers.
+     */
+    uint32_t strideLog_ {2};
+    /**
+     * @brief Row-major cells, one row per instrument in order of first sight, so their size follows the
+     *        number of instruments rather than the largest id.
+     */
+    std::vector<Cell> cells_;
+    /**
+     * @brief 1-based cell row of each instrument id below DIRECT_INSTR_MAX (0 when unseen), grown on
+     *        demand to the largest such id seen.
+     */
+    std::vector<uint32_t> instrRows_;
+    /**
+     * @brief 1-based cell row of each instrument id at or above DIRECT_INSTR_MAX.
+     */
+    std::unordered_map<uint32_t, uint32_t> wideInstrRows_;
+};
+
+/**
+ * @brief Cursor over the comma-separated fields of one input line.
+ */
+class CsvFields {
+public:
+    explicit CsvFields(std::string_view line) : rest_(line) {}
+
+    /**
+     * @brief Returns the next field and advances past its delimiter.
+     */
+    std::string_view Next() {
+        const size_t pos = rest_.find(',');
+        std::string_view f = rest_.substr(0, pos);
+        rest_ = pos == std::string_view::npos ? std::string_view{} : rest_.substr(pos + 1);
+        return f;
+    }
+
+    /**
+     * @brief Returns everything that has not been consumed yet (the last field).
+     */
+    std::string_view Rest() const { return rest_; }
+
+private:
+    std::string_view rest_;
+};
+
+/**
+ * @brief Parses a decimal integer field with std::from_chars.
+ * @tparam T The integer type to parse into; callers narrow the result like the former stoul/stol chain did.
+ * @throws std::invalid_argument if the field is not a number.
+ */
+template <class T>
+T ParseInt(std::string_view f) {
+    T v {};
+    auto r = std::from_chars(f.data(), f.data() + f.size(), v);
+    if (r.ec != std::errc()) throw std::invalid_argument{"Bad numeric field '" + std::string(f) + "'"};
+    return v;
+}
+
+/**
+ * @brief Parses the value of a numeric command-line flag with std::from_chars; the whole value must be
+ *        a number of type T (so a negative count, a trailing unit or the next flag are rejected).
+ * @throws std::invalid_argument naming the flag otherwise.
+ */
+template <class T>
+T FlagNum(std::string_view flag, std::string_view val) {
+    T v {};
+    auto r = std::from_chars(val.data(), val.data() + val.size(), v);
+    if (r.ec != std::errc() || r.ptr != val.data() + val.size()) {
+        throw std::invalid_argument{std::string(flag) + " expects a number, got '" + std::string(val) + "'"};
+    }
+    return v;
+}
+
+/**
+ * @brief Parses a fixed-point decimal price (e.g. "5.510000000") straight into nanos, without a double.
+ *
+ * Digits beyond the ninth decimal are rounded half away from zero. Anything that is not plain
+ * fixed-point notation (exponents, etc.) or does not fit int64 nanos falls back to the double conversion.
+ * @param f The price field; an empty field is UNDEFINED_PRICE.
+ */
+inline int64_t ParseNanoPrice(std::string_view f) {
+    if (f.empty()) return UNDEFINED_PRICE;
+    const char* p = f.data();
+    const char* end = p + f.size();
+    const bool neg = *p == '-';
+    if (neg) ++p;
+    int64_t whole = 0;
+    const char* digits = p;
+    while (p != end && *p >= '0' && *p <= '9' && whole <= INT64_MAX / 10 / static_cast<int64_t>(PRICE_SCALE)) whole = whole * 10 + (*p++ - '0');
+    const bool hasWhole = p != digits;
+    int64_t frac = 0;
+    int fracDigits = 0;
+    bool roundUp = false;
+    if (p != end && *p == '.') {
+        for (++p; p != end && *p >= '0' && *p <= '9'; ++p, ++fracDigits) {
+            if (fracDigits < 9) frac = frac * 10 + (*p - '0');
+            else if (fracDigits == 9) roundUp = *p >= '5';
+        }
+    }
+    if (p != end || (!hasWhole && fracDigits == 0) || whole >= INT64_MAX / static_cast<int64_t>(PRICE_SCALE)) return ToNanoPrice(std::stod(std::string(f)));
+    for (int i = fracDigits; i < 9; ++i) frac *= 10;
+    const int64_t nanos = whole * static_cast<int64_t>(PRICE_SCALE) + frac + (roundUp ? 1 : 0);
+    return neg ? -nanos : nanos;
+}
+
+/**
+ * @brief Instrument-id to symbol mapping that messages refer into instead of carrying their own string.
+ *
+ * Symbols are stored once and never move or change, so the views handed out stay valid for the
+ * table's lifetime, also in copies of a message (e.g. pending T/F messages).
+ */
+class SymbolTable {
+public:
+    /**
+     * @brief Returns the stored symbol of `instrId`, recording `sym` first if it is new or differs.
+     */
+    std::string_view Intern(uint32_t instrId, std::string_view sym) {
+        auto it = byInstr_.find(instrId);
+        if (it != byInstr_.end() && it->second == sym) return it->second;
+        store_.emplace_back(sym);
+        return byInstr_[instrId] = store_.back();
+    }
+
+    /**
+     * @brief Returns the symbol of `instrId`, or an empty view if the instrument is not mapped.
+     */
+    std::string_view Get(uint32_t instrId) const {
+        auto it = byInstr_.find(instrId);
+        return it != byInstr_.end() ? it->second : std::string_view{};
+    }
+
+    /**
+     * @brief Loads an "instrument_id,symbol" file; lines whose first field is not a number (headers) are skipped.
+     * @return false if the file cannot be opened.
+     */
+    bool Load(const std::string& path) {
+        std::ifstream is(path);
+        if (!is.is_open()) return false;
+        std::string line;
+        while (std::getline(is, line)) {
+            const size_t pos = line.find(',');
+            if (pos == std::string::npos) continue;
+            uint32_t instrId = 0;
+            auto r = std::from_chars(line.data(), line.data() + pos, instrId);
+            if (r.ec != std::errc() || r.ptr != line.data() + pos) continue;
+            std::string_view sym(line);
+            sym.remove_prefix(pos + 1);
+            if (!sym.empty() && sym.back() == '\r') sym.remove_suffix(1);
+            Intern(instrId, sym);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Writes the current mapping as an "instrument_id,symbol" file, ordered by instrument id.
+     * @return false if the file cannot be written.
+     */
+    bool Save(const std::string& path) const {
+        std::map<uint32_t, std::string_view> sorted(byInstr_.begin(), byInstr_.end());
+        std::ofstream os(path);
+        if (!os.is_open()) return false;
+        os << "instrument_id,symbol\n";
+        for (const auto& [instrId, sym] : sorted) os << instrId << "," << sym << "\n";
+        return static_cast<bool>(os);
+    }
+
+private:
+    std::deque<std::string> store_;
+    std::unordered_map<uint32_t, std::string_view> byInstr_;
+};
+
+/**
+ * @brief An MBO line parsed in place: numeric fields converted, the symbol left as a view into the line.
+ *
+ * Used where lines are parsed ahead of the book logic and must not allocate (see PreparsedCsvSource).
+ */
+struct MboLineView {
+    int64_t tsRecv;
+    int64_t tsEvent;
+    uint8_t rtype;
+    uint16_t pubId;
+    uint32_t instrId;
+    Act::Type action;
+    Sd::Type side;
+    int64_t price;
+    uint32_t size;
+    uint8_t chanId;
+    uint64_t orderId;
+    uint8_t flags;
+    int32_t tsInDelta;
+    uint32_t sequence;
+    std::string_view symbol;
+};
+
+/**
+ * @brief Parses the fields of an MBO line with std::from_chars (timestamps with ParseIsoNanos).
+ * @tparam M MboSingle or MboLineView. The symbol is left as a view into the line either way.
+ */
+template <class M>
+void ParseMboFields(std::string_view line, M& m) {
+    RECON_TIME(Parse);
+    CsvFields fs(line);
+    std::string_view f;
+
+    m.tsRecv = ParseIsoNanos(fs.Next());
+    m.tsEvent = ParseIsoNanos(fs.Next());
+    m.rtype = static_cast<uint8_t>(ParseInt<unsigned long>(fs.Next()));
+    m.pubId = static_cast<uint16_t>(ParseInt<unsigned long>(fs.Next()));
+    m.instrId = static_cast<uint32_t>(ParseInt<unsigned long>(fs.Next()));
+    f = fs.Next(); m.action = static_cast<Act::Type>(f.empty() ? '\0' : f[0]);
+    f = fs.Next(); m.side = static_cast<Sd::Type>(f.empty() ? '\0' : f[0]);
+    m.price = ParseNanoPrice(fs.Next());
+    m.size = static_cast<uint32_t>(ParseInt<unsigned long>(fs.Next()));
+    m.chanId = static_cast<uint8_t>(ParseInt<unsigned long>(fs.Next()));
+    m.orderId = ParseInt<uint64_t>(fs.Next());
+    m.flags = static_cast<uint8_t>(ParseInt<unsigned long>(fs.Next()));
+    m.tsInDelta = static_cast<int32_t>(ParseInt<long>(fs.Next()));
+    m.sequence = static_cast<uint32_t>(ParseInt<unsigned long>(fs.Next()));
+    m.symbol = fs.Rest();
+}
+
+/**
+ * @brief Parses a line from the MBO input file into a MboSingle object.
+ *
+ * Works on a view of the line and converts numbers with std::from_chars and timestamps with
+ * ParseIsoNanos; the symbol is interned, so parsing does not allocate.
+ * @param line The line to parse.
+ * @param m The message to fill.
+ * @param symbols Table the symbol field is interned into.
+ */
+inline void ParseMboLine(std::string_view line, MboSingle& m, SymbolTable& symbols) {
+    ParseMboFields(line, m);
+    m.symbol = symbols.Intern(m.instrId, m.symbol);
+}
+
+/**
+ * @brief Read-only memory mapping of a whole regular file.
+ *
+ * The mapping is hinted for a single sequential pass (and transparent huge pages where the kernel
+ * supports them for file mappings), so the parser can walk the file in place. Opening fails, and
+ * the caller should fall back to a stream, for pipes, character devices, or platforms without mmap.
+ */
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    /**
+     * @brief Maps `path` if it is a regular file.
+     * @return true on success; false if the file cannot be opened or is not mappable.
+     */
+    bool Open(const std::string& path) {
+        Close();
+#ifdef RECON_HAVE_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { ::close(fd); return false; }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ == 0) { ::close(fd); data_ = ""; return true; }
+        void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) { size_ = 0; return false; }
+        ::madvise(p, size_, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        ::madvise(p, size_, MADV_HUGEPAGE);
+#endif
+        data_ = static_cast<const char*>(p);
+        mapped_ = true;
+        return true;
+#else
+        (void)path;
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Unmaps the file, if mapped.
+     */
+    void Close() {
+#ifdef RECON_HAVE_MMAP
+        if (mapped_) ::munmap(const_cast<char*>(data_), size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+        mapped_ = false;
+    }
+
+    /**
+     * @brief The mapped bytes.
+     */
+    std::string_view View() const { return {data_, size_}; }
+
+private:
+    const char* data_ {nullptr};
+    size_t size_ {0};
+    bool mapped_ {false};
+};
+
+/**
+ * @brief True for sources whose Next never waits for a producer (in-memory and mapped input), which
+ *        Reconstruct reads ahead of to prefetch; they declare `static constexpr bool NEVER_BLOCKS = true`.
+ *
+ * Any other source (a stream, pipe, socket or ring) may wait for its next message, so its messages are
+ * applied one at a time and each row goes out as soon as its message has arrived.
+ */
+template <class Source, class = void>
+struct NeverBlocks : std::false_type {};
+template <class Source>
+struct NeverBlocks<Source, std::enable_if_t<Source::NEVER_BLOCKS>> : std::true_type {};
+
+/**
+ * @brief Zero-copy line source over an in-memory buffer (typically a MappedFile).
+ *
+ * Yields the same lines std::getline would: split on '\n', no empty line after a final newline.
+ */
+class SpanLines {
+public:
+    static constexpr bool NEVER_BLOCKS = true;
+
+    explicit SpanLines(std::string_view buf) : buf_(buf), rest_(buf) {}
+
+    /**
+     * @brief Points `line` at the next line of the buffer.
+     * @return false once the buffer is exhausted.
+     */
+    bool Next(std::string_view& line) {
+        if (rest_.empty()) return false;
+        const size_t pos = rest_.find('\n');
+        line = rest_.substr(0, pos);
+        rest_ = pos == std::string_view::npos ? std::string_view{} : rest_.substr(pos + 1);
+        return true;
+    }
+
+    /**
+     * @brief Byte offset of the next line from the start of the buffer.
+     */
+    uint64_t Offset() const { return buf_.size() - rest_.size(); }
+
+    /**
+     * @brief Continues at byte offset `off` (a value returned by Offset).
+     * @throws std::runtime_error if `off` lies past the end of the buffer.
+     */
+    void Seek(uint64_t off) {
+        if (off > buf_.size()) throw std::runtime_error{"Resume offset past the end of the MBO input"};
+        rest_ = buf_.substr(off);
+    }
+
+private:
+    std::string_view buf_;
+    std::string_view rest_;
+};
+
+/**
+ * @brief Line source over an std::istream, for pipes and stdin; each line is copied into a reused buffer.
+ */
+class StreamLines {
+public:
+    explicit StreamLines(std::istream& is) : is_(is) {}
+
+    /**
+     * @brief Reads the next line; `line` stays valid until the following call.
+     * @return false at end of stream.
+     */
+    bool Next(std::string_view& line) {
+        if (!std::getline(is_, buf_)) return false;
+        line = buf_;
+        off_ += buf_.size() + (is_.eof() ? 0 : 1);
+        return true;
+    }
+
+    /**
+     * @brief Bytes consumed from the stream so far.
+     */
+    uint64_t Offset() const { return off_; }
+
+    /**
+     * @brief Skips ahead to byte offset `off`; streams cannot go back.
+     * @throws std::runtime_error if `off` was already passed or the stream ends first.
+     */
+    void Seek(uint64_t off) {
+        if (off < off_) throw std::runtime_error{"Resume offset lies before the stream position"};
+        is_.ignore(static_cast<std::streamsize>(off - off_));
+        if (static_cast<uint64_t>(is_.gcount()) != off - off_) throw std::runtime_error{"Resume offset past the end of the MBO input"};
+        off_ = off;
+    }
+
+private:
+    std::istream& is_;
+    std::string buf_;
+    uint64_t off_ {0};
+};
+
+/**
+ * @brief Loads a whole input into memory: mapped when it is a regular file, otherwise read into `buf`.
+ * @param path The input path, or "-" for stdin.
+ * @param map Mapping to use for regular files.
+ * @param buf Fallback storage for pipes, stdin and platforms without mmap.
+ * @param data Set to the input bytes.
+ * @return false if the input cannot be opened.
+ */
+inline bool LoadInput(const std::string& path, MappedFile& map, std::string& buf, std::string_view& data) {
+    if (path != "-" && map.Open(path)) {
+        data = map.View();
+        return true;
+    }
+    std::ifstream fs;
+    if (path != "-") {
+        fs.open(path, std::ios::binary);
+        if (!fs.is_open()) return false;
+    }
+    std::istream& is = path == "-" ? std::cin : fs;
+    buf.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    data = buf;
+    return true;
+}
+
+/**
+ * @brief MBO message source over CSV lines; skips the header line.
+ * @tparam Lines Line source (SpanLines, StreamLines or ChunkLines).
+ */
+template <class Lines>
+class CsvMboSource {
+public:
+    static constexpr bool NEVER_BLOCKS = NeverBlocks<Lines>::value;
+
+    CsvMboSource(Lines& lines, SymbolTable& symbols) : lines_(lines), symbols_(symbols) {
+        std::string_view hdr;
+        lines_.Next(hdr);
+    }
+
+    /**
+     * @brief Parses the next line into `m`.
+     * @return false at end of input.
+     */
+    bool Next(MboSingle& m) {
+        std::string_view line;
+        if (!lines_.Next(line)) return false;
+        ParseMboLine(line, m, symbols_);
+        return true;
+    }
+
+    /**
+     * @brief Input byte offset of the next message, for checkpoints.
+     */
+    uint64_t Offset() const { return lines_.Offset(); }
+
+    /**
+     * @brief Continues with the message at byte offset `off`.
+     */
+    void Seek(uint64_t off) { lines_.Seek(off); }
+
+private:
+    Lines& lines_;
+    SymbolTable& symbols_;
+};
+
+/**
+ * @brief Backs off while waiting on another thread (a ring slot, a parsed chunk).
+ */
+inline void WaitSpin() { std::this_thread::yield(); }
+
+
+/**
+ * @brief MBO message source that parses an in-memory CSV file on several threads ahead of the book logic.
+ *
+ * The data lines are split into chunks of about CHUNK_BYTES on newline boundaries, which the threads
+ * take in turn (thread i parses chunks i, i + n, ...). A chunk is parsed into one of WINDOW_PER_THREAD
+ * slots per thread, a reused vector of MboLineView, and a slot is only refilled once Next has handed
+ * out the chunk before; parsing thus runs at most a bounded window ahead, the memory held does not
+ * grow with the file, and once the slots have grown parsing does not allocate. Next hands the messages
+ * out strictly in file order, waiting only if the chunk it reaches is still being parsed, so the book
+ * logic (T/F/C pairing included) is unchanged and runs concurrently with the parsing of later chunks.
+ * The buffer must outlive the source.
+ */
+class PreparsedCsvSource {
+public:
+    static constexpr bool NEVER_BLOCKS = true;
+    /**
+     * @brief Target text bytes per chunk (about 10k lines of MBO CSV).
+     */
+    static constexpr size_t CHUNK_BYTES = 1 << 20;
+    /**
+     * @brief Parsed chunks each thread may hold at a time.
+     */
+    static constexpr size_t WINDOW_PER_THREAD = 2;
+
+    /**
+     * @param csv The whole CSV input; its first line (the header) is skipped.
+     * @param symbols Table the symbols are interned into, in file order.
+     * @param nThreads Number of parser threads.
+     */
+    PreparsedCsvSource(std::string_view csv, SymbolTable& symbols, unsigned nThreads) : symbols_(symbols) {
+        const size_t hdrEnd = csv.find('\n');
+        csv.remove_prefix(hdrEnd == std::string_view::npos ? csv.size() : hdrEnd + 1);
+        for (size_t begin = 0; begin < csv.size();) {
+            size_t end = std::min(begin + CHUNK_BYTES, csv.size());
+            if (end < csv.size()) {
+                end = csv.find('\n', end);
+                end = end == std::string_view::npos ? csv.size() : end + 1;
+            }
+            texts_.push_back(csv.substr(begin, end - begin));
+            begin = end;
+        }
+        nThreads = std::max(nThreads, 1u);
+        slots_ = std::vector<Slot>(nThreads * WINDOW_PER_THREAD);
+        for (size_t s = 0; s < slots_.size(); ++s) slots_[s].next.store(s, std::memory_order_relaxed);
+        for (unsigned t = 0; t < nThreads; ++t) threads_.emplace_back([this, t, nThreads] { ParseChunks(t, nThreads); });
+    }
+
+    PreparsedCsvSource(const PreparsedCsvSource&) = delete;
+    PreparsedCsvSource& operator=(const PreparsedCsvSource&) = delete;
+
+    ~PreparsedCsvSource() {
+        // Parsers waiting for a slot that will not be handed back (error or early stop) give up.
+        stop_.store(true, std::memory_order_release);
+        for (auto& t : threads_) t.join();
+    }
+
+    /**
+     * @brief Fills `m` with the next message in file order.
+     * @return false at end of input.
+     * @throws The parse error of a chunk when its first bad line is reached.
+     */
+    bool Next(MboSingle& m) {
+        while (cur_ < texts_.size()) {
+            Slot& s = slots_[cur_ % slots_.size()];
+            while (s.ready.load(std::memory_order_acquire) != cur_ + 1) WaitSpin();
+            if (pos_ < s.msgs.size()) {
+                const MboLineView& v = s.msgs[pos_++];
+                m.tsRecv = v.tsRecv;
+                m.tsEvent = v.tsEvent;
+                m.rtype = v.rtype;
+                m.pubId = v.pubId;
+                m.instrId = v.instrId;
+                m.action = v.action;
+                m.side = v.side;
+                m.price = v.price;
+                m.size = v.size;
+                m.chanId = v.chanId;
+                m.orderId = v.orderId;
+                m.flags = v.flags;
+                m.tsInDelta = v.tsInDelta;
+                m.sequence = v.sequence;
+                m.symbol = symbols_.Intern(v.instrId, v.symbol);
+                return true;
+            }
+            if (s.err) std::rethrow_exception(s.err);
+            pos_ = 0;
+            // The chunk is consumed; its slot takes the chunk one window further on.
+            s.next.store(cur_ + slots_.size(), std::memory_order_release);
+            ++cur_;
+        }
+        return false;
+    }
+
+private:
+    /**
+     * @brief Buffer of one parsed chunk, recycled across the window.
+     */
+    struct Slot {
+        std::vector<MboLineView> msgs;
+        /**
+         * @brief Error that stopped parsing; msgs holds the lines before it.
+         */
+        std::exception_ptr err;
+        /**
+         * @brief Index of the chunk the slot may be filled with next.
+         */
+        std::atomic<size_t> next {0};
+        /**
+         * @brief Index + 1 of the chunk the slot holds once parsed.
+         */
+        std::atomic<size_t> ready {0};
+    };
+
+    /**
+     * @brief Parser thread `t` of `n`: parses chunks t, t + n, ... into their slots as these come free.
+     */
+    void ParseChunks(unsigned t, unsigned n) {
+        for (size_t k = t; k < texts_.size(); k += n) {
+            Slot& s = slots_[k % slots_.size()];
+            while (s.next.load(std::memory_order_acquire) != k) {
+                if (stop_.load(std::memory_order_acquire)) return;
+                WaitSpin();
+            }
+            s.msgs.clear();
+            s.err = nullptr;
+            try {
+                SpanLines lines(texts_[k]);
+                std::string_view line;
+                while (lines.Next(line)) {
+                    s.msgs.emplace_back();
+                    ParseMboFields(line, s.msgs.back());
+                }
+            } catch (...) {
+                if (!s.msgs.empty()) s.msgs.pop_back();
+                s.err = std::current_exception();
+            }
+            s.ready.store(k + 1, std::memory_order_release);
+        }
+    }
+
+    SymbolTable& symbols_;
+    std::vector<std::string_view> texts_;
+    std::vector<Slot> slots_;
+    std::atomic<bool> stop_ {false};
+    std::vector<std::thread> threads_;
+    size_t cur_ {0};
+    size_t pos_ {0};
+};
+
+/**
+ * @brief Packed binary MBO record, field for field the 56-byte DBN MboMsg (record header first).
+ *
+ * Timestamps are ns since the epoch with UINT64_MAX for undefined, prices int64 nanos, native byte order.
+ */
+struct MboBinRec {
+    uint8_t length;
+    uint8_t rtype;
+    uint16_t pubId;
+    uint32_t instrId;
+    uint64_t tsEvent;
+    uint64_t orderId;
+    int64_t price;
+    uint32_t size;
+    uint8_t flags;
+    uint8_t chanId;
+    char action;
+    char side;
+    uint64_t tsRecv;
+    int32_t tsInDelta;
+    uint32_t sequence;
+};
+static_assert(sizeof(MboBinRec) == 56 && std::is_trivially_copyable<MboBinRec>::value, "binary MBO layout must match DBN MboMsg");
+
+/**
+ * @brief Header at the start of a binary MBO file.
+ */
+struct MboBinHdr {
+    char magic[8];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t recBytes;
+};
+
+/**
+ * @brief Identifies binary MBO files and the record layout they use.
+ */
+constexpr char MBO_BIN_MAGIC[8] = {'M', 'B', 'O', 'B', 'I', 'N', '\0', '\0'};
+constexpr uint16_t MBO_BIN_VERSION = 1;
+
+/**
+ * @brief Converts between the int64 timestamps used here and DBN's uint64 with UINT64_MAX for undefined.
+ */
+inline uint64_t ToDbnTs(int64_t ns) { return ns == UNDEFINED_TS ? UINT64_MAX : static_cast<uint64_t>(ns); }
+inline int64_t FromDbnTs(uint64_t ts) { return ts == UINT64_MAX ? UNDEFINED_TS : static_cast<int64_t>(ts); }
+
+/**
+ * @brief MBO message source over a buffer of MboBinRec records (typically a MappedFile).
+ *
+ * Records are copied straight into the message fields; the symbol comes from the separately loaded
+ * SymbolTable.
+ */
+class BinMboSource {
+public:
+    static constexpr bool NEVER_BLOCKS = true;
+
+    /**
+     * @brief Checks the file header and positions the source at the first record.
+     * @throws std::runtime_error if the header is missing or does not match this build's layout.
+     */
+    BinMboSource(std::string_view bin, const SymbolTable& symbols) : symbols_(symbols) {
+        MboBinHdr hdr;
+        if (bin.size() < sizeof(hdr)) throw std::runtime_error{"Binary MBO file too short"};
+        std::memcpy(&hdr, bin.data(), sizeof(hdr));
+        if (!std::equal(std::begin(MBO_BIN_MAGIC), std::end(MBO_BIN_MAGIC), hdr.magic)) throw std::runtime_error{"Not a binary MBO file"};
+        if (hdr.version != MBO_BIN_VERSION || hdr.recBytes != sizeof(MboBinRec)) {
+            throw std::runtime_error{"Unsupported binary MBO layout (version " + std::to_string(hdr.version) + ")"};
+        }
+        begin_ = bin.data();
+        bin.remove_prefix(sizeof(hdr));
+        if (bin.size() % sizeof(MboBinRec) != 0) std::cerr << "Warn: Binary MBO file ends with a partial record. Ign.\n";
+        cur_ = bin.data();
+        end_ = cur_ + bin.size() / sizeof(MboBinRec) * sizeof(MboBinRec);
+    }
+
+    /**
+     * @brief Decodes the next record into `m`.
+     * @return false at end of input.
+     */
+    bool Next(MboSingle& m) {
+        if (cur_ == end_) return false;
+        MboBinRec r;
+        std::memcpy(&r, cur_, sizeof(r));
+        cur_ += sizeof(r);
+        m.tsRecv = FromDbnTs(r.tsRecv);
+        m.tsEvent = FromDbnTs(r.tsEvent);
+        m.rtype = r.rtype;
+        m.pubId = r.pubId;
+        m.instrId = r.instrId;
+        m.action = static_cast<Act::Type>(r.action);
+        m.side = static_cast<Sd::Type>(r.side);
+        m.price = r.price;
+        m.size = r.size;
+        m.chanId = r.chanId;
+        m.orderId = r.orderId;
+        m.flags = r.flags;
+        m.tsInDelta = r.tsInDelta;
+        m.sequence = r.sequence;
+        m.symbol = symbols_.Get(r.instrId);
+        return true;
+    }
+
+    /**
+     * @brief File offset of the next record, for checkpoints.
+     */
+    uint64_t Offset() const { return static_cast<uint64_t>(cur_ - begin_); }
+
+    /**
+     * @brief Continues with the record at file offset `off`.
+     * @throws std::runtime_error if `off` is not a record boundary of this file.
+     */
+    void Seek(uint64_t off) {
+        if (off < sizeof(MboBinHdr) || off > static_cast<uint64_t>(end_ - begin_) || (off - sizeof(MboBinHdr)) % sizeof(MboBinRec)) {
+            throw std::runtime_error{"Resume offset is not a record of the binary MBO input"};
+        }
+        cur_ = begin_ + off;
+    }
+
+private:
+    const SymbolTable& symbols_;
+    const char* begin_;
+    const char* cur_;
+    const char* end_;
+};
+
+/**
+ * @brief Large reusable output buffer that is handed to the C stream in big unbuffered writes.
+ *
+ * Rows are formatted straight into the buffer (Reserve / Commit); the buffer is written out with a
+ * single fwrite whenever it cannot hold the next row, and on Flush or destruction. Without a stream
+ * it is a growable memory buffer (used for rows formatted off the output thread).
+ */
+class OutBuf {
+public:
+    /**
+     * @brief Creates a buffer draining into `f`.
+     * @param f Open output stream; its own stdio buffering is disabled, since this buffer replaces it.
+     *          nullptr keeps everything in memory.
+     * @param cap Buffer capacity in bytes (initial capacity without a stream).
+     */
+    explicit OutBuf(std::FILE* f, size_t cap = 1 << 20) : f_(f), buf_(cap) {
+        if (f_) std::setvbuf(f_, nullptr, _IONBF, 0);
+    }
+    OutBuf(const OutBuf&) = delete;
+    OutBuf& operator=(const OutBuf&) = delete;
+    ~OutBuf() {
+        try { Flush(); } catch (const std::exception&) {}
+    }
+
+    /**
+     * @brief Returns a write position with room for at least `n` bytes, flushing first if needed.
+     */
+    char* Reserve(size_t n) {
+        if (buf_.size() - len_ < n) {
+            Flush();
+            if (buf_.size() - len_ < n) buf_.resize(std::max(buf_.size() * 2, len_ + n));
+        }
+        return buf_.data() + len_;
+    }
+
+    /**
+     * @brief Marks the bytes up to `end` (obtained from the last Reserve) as written.
+     */
+    void Commit(const char* end) {
+        len_ = static_cast<size_t>(end - buf_.data());
+        if (len_ >= flushAt_) Flush();
+    }
+
+    /**
+     * @brief Appends raw bytes.
+     */
+    void Append(std::string_view sv) {
+        char* p = Reserve(sv.size());
+        Commit(std::copy(sv.begin(), sv.end(), p));
+    }
+
+    /**
+     * @brief Writes the buffered bytes to the stream.
+     * @throws std::runtime_error if the write fails.
+     */
+    void Flush() {
+        if (!f_) return;
+        RECON_TIME(Flush);
+        if (len_ && std::fwrite(buf_.data(), 1, len_, f_) != len_) {
+            len_ = 0;
+            throw std::runtime_error{"Write to MBP output failed"};
+        }
+        flushed_ += len_;
+        len_ = 0;
+    }
+
+    /**
+     * @brief Output position: bytes flushed (counting those of a resumed run) plus bytes buffered.
+     */
+    uint64_t Pos() const { return flushed_ + len_; }
+
+    /**
+     * @brief Counts `n` bytes as already written, for output appended to a file restored from a checkpoint.
+     */
+    void Resume(uint64_t n) { flushed_ = n; }
+
+    /**
+     * @brief The buffered bytes not yet flushed.
+     */
+    std::string_view View() const { return {buf_.data(), len_}; }
+
+    /**
+     * @brief Discards the buffered bytes.
+     */
+    void Clear() { len_ = 0; }
+
+    /**
+     * @brief Flushes as soon as `n` bytes are buffered instead of when the buffer is full;
+     *        1 writes every row out as it is committed, for latency-sensitive live output.
+     */
+    void FlushAt(size_t n) { flushAt_ = n; }
+
+private:
+    std::FILE* f_;
+    std::vector<char> buf_;
+    size_t len_ {0};
+    size_t flushAt_ {SIZE_MAX};
+    uint64_t flushed_ {0};
+};
+
+/**
+ * @brief Backs off one step of a busy-poll loop without giving up the CPU.
+ */
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+/**
+ * @brief How a live reader waits for data: in the kernel / with short sleeps, or spinning on the CPU.
+ */
+struct PollOpts {
+    /**
+     * @brief Spin instead of blocking; lowest latency, at the cost of one busy core.
+     */
+    bool busyPoll {false};
+    /**
+     * @brief Output flushed whenever the input runs dry, so batched rows never wait for the next message.
+     */
+    OutBuf* flushWhenIdle {nullptr};
+};
+
+#ifdef RECON_HAVE_POSIX_IO
+/**
+ * @brief Byte reader over a file descriptor: stdin, a pipe, a TCP stream or a UDP socket.
+ *
+ * Datagrams are taken to carry whole CSV lines; a newline is added after one that lacks it, and an
+ * empty datagram ends the input. Before waiting for more data the idle output is flushed.
+ */
+class FdReader {
+public:
+    /**
+     * @param fd Descriptor to read; closed by the reader if `owned`.
+     * @param datagram The descriptor is a datagram socket.
+     */
+    FdReader(int fd, bool owned, bool datagram, const PollOpts& poll) : fd_(fd), owned_(owned), datagram_(datagram), poll_(poll) {}
+    FdReader(const FdReader&) = delete;
+    FdReader& operator=(const FdReader&) = delete;
+    ~FdReader() { if (owned_) ::close(fd_); }
+
+    /**
+     * @brief Reads up to `cap` bytes, waiting until some are available.
+     * @return The bytes read; 0 at end of input.
+     * @throws std::runtime_error if the read fails.
+     */
+    size_t Read(char* buf, size_t cap) {
+        for (bool idle = false;;) {
+            pollfd p {fd_, POLLIN, 0};
+            const int ready = ::poll(&p, 1, idle && !poll_.busyPoll ? -1 : 0);
+            if (ready < 0 && errno != EINTR) throw std::runtime_error{"Poll on MBO input failed"};
+            if (ready <= 0) {
+                if (!idle && poll_.flushWhenIdle) poll_.flushWhenIdle->Flush();
+                idle = true;
+                if (poll_.busyPoll) CpuRelax();
+                continue;
+            }
+            const ssize_t n = datagram_ ? ::recv(fd_, buf, cap - 1, 0) : ::read(fd_, buf, cap);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+                throw std::runtime_error{"Read from MBO input failed"};
+            }
+            if (datagram_ && n > 0 && buf[n - 1] != '\n') { buf[n] = '\n'; return static_cast<size_t>(n) + 1; }
+            return static_cast<size_t>(n);
+        }
+    }
+
+private:
+    const int fd_;
+    const bool owned_;
+    const bool datagram_;
+    const PollOpts poll_;
+};
+
+/**
+ * @brief Single-producer single-consumer byte ring in POSIX shared memory, for a feed handler in another
+ *        process to hand over MBO CSV (or for this process to hand its rows to a consumer).
+ *
+ * Layout: a ShmRing::Hdr (magic "MBPRING", capacity, then producer position, consumer position and a
+ * closed flag, each on its own cache line) followed by the data bytes. Positions count bytes since
+ * the start and only grow; the producer writes at head % cap and publishes with a release store of
+ * head, the consumer reads below head and releases space by advancing tail. The producer sets
+ * `closed` after its last write.
+ */
+class ShmRing {
+public:
+    struct Hdr {
+        char magic[8];
+        uint64_t cap;
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<uint32_t> closed;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring positions are shared across processes");
+
+    static constexpr char MAGIC[8] = {'M', 'B', 'P', 'R', 'I', 'N', 'G', '\0'};
+
+    /**
+     * @brief Creates (or replaces) the ring `name` as its producer.
+     * @param cap Data bytes, rounded up to a power of two.
+     * @throws std::runtime_error if the shared memory cannot be created.
+     */
+    static std::unique_ptr<ShmRing> Create(const std::string& name, size_t cap, const PollOpts& poll) {
+        size_t c = 4096;
+        while (c < cap) c <<= 1;
+        const int fd = ::shm_open(ShmName(name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(sizeof(Hdr) + c)) != 0) {
+            if (fd >= 0) ::close(fd);
+            throw std::runtime_error{"Create shared memory ring " + name};
+        }
+        std::unique_ptr<ShmRing> r(new ShmRing(fd, sizeof(Hdr) + c, poll));
+        Hdr* h = new (r->hdr_) Hdr{};
+        std::copy(std::begin(MAGIC), std::end(MAGIC), h->magic);
+        h->cap = c;
+        return r;
+    }
+
+    /**
+     * @brief Attaches to the existing ring `name` as its consumer.
+     * @throws std::runtime_error if there is no such ring.
+     */
+    static std::unique_ptr<ShmRing> Open(const std::string& name, const PollOpts& poll) {
+        const int fd = ::shm_open(ShmName(name).c_str(), O_RDWR, 0);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Hdr)) {
+            if (fd >= 0) ::close(fd);
+            throw std::runtime_error{"Open shared memory ring " + name};
+        }
+        std::unique_ptr<ShmRing> r(new ShmRing(fd, static_cast<size_t>(st.st_size), poll));
+        if (!std::equal(std::begin(MAGIC), std::end(MAGIC), r->hdr_->magic) || sizeof(Hdr) + r->hdr_->cap > r->bytes_) {
+            throw std::runtime_error{"Not a shared memory ring: " + name};
+        }
+        return r;
+    }
+
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+    ~ShmRing() { ::munmap(hdr_, bytes_); }
+
+    /**
+     * @brief Consumer side: copies up to `cap` bytes out, waiting until some are available.
+     * @return The bytes read; 0 once the producer closed the ring and everything was read.
+     */
+    size_t Read(char* buf, size_t cap) {
+        const uint64_t tail = hdr_->tail.load(std::memory_order_relaxed);
+        uint64_t head;
+        for (bool idle = false; (head = hdr_->head.load(std::memory_order_acquire)) == tail;) {
+            if (hdr_->closed.load(std::memory_order_acquire) && hdr_->head.load(std::memory_order_acquire) == tail) return 0;
+            if (!idle && poll_.flushWhenIdle) poll_.flushWhenIdle->Flush();
+            idle = true;
+            Wait();
+        }
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(head - tail, cap));
+        CopyOut(tail, buf, n);
+        hdr_->tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * @brief Producer side: copies all `n` bytes in, waiting for the consumer to free space.
+     */
+    void Write(const char* data, size_t n) {
+        const uint64_t cap = hdr_->cap;
+        uint64_t head = hdr_->head.load(std::memory_order_relaxed);
+        while (n) {
+            uint64_t room;
+            while ((room = cap - (head - hdr_->tail.load(std::memory_order_acquire))) == 0) Wait();
+            const size_t k = static_cast<size_t>(std::min<uint64_t>(room, n));
+            CopyIn(head, data, k);
+            head += k;
+            data += k;
+            n -= k;
+            hdr_->head.store(head, std::memory_order_release);
+        }
+    }
+
+    /**
+     * @brief Producer side: marks the end of the stream.
+     */
+    void Close() { hdr_->closed.store(1, std::memory_order_release); }
+
+private:
+    ShmRing(int fd, size_t bytes, const PollOpts& poll) : bytes_(bytes), poll_(poll) {
+        void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error{"Map shared memory ring"};
+        hdr_ = static_cast<Hdr*>(p);
+        data_ = static_cast<char*>(p) + sizeof(Hdr);
+    }
+
+    static std::string ShmName(const std::string& name) { return name.empty() || name[0] != '/' ? "/" + name : name; }
+
+    void Wait() const {
+        if (poll_.busyPoll) CpuRelax();
+        else std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+
+    void CopyOut(uint64_t pos, char* buf, size_t n) const {
+        const size_t at = static_cast<size_t>(pos & (hdr_->cap - 1));
+        const size_t first = std::min<size_t>(n, hdr_->cap - at);
+        std::memcpy(buf, data_ + at, first);
+        std::memcpy(buf + first, data_, n - first);
+    }
+
+    void CopyIn(uint64_t pos, const char* src, size_t n) {
+        const size_t at = static_cast<size_t>(pos & (hdr_->cap - 1));
+        const size_t first = std::min<size_t>(n, hdr_->cap - at);
+        std::memcpy(data_ + at, src, first);
+        std::memcpy(data_, src + first, n - first);
+    }
+
+    Hdr* hdr_;
+    char* data_;
+    size_t bytes_;
+    const PollOpts poll_;
+};
+
+#ifdef __GLIBC__
+/**
+ * @brief Wraps the producer side of a ring in a C stream so an OutBuf can drain into it; closing the
+ *        stream closes the ring and unmaps it.
+ * @return The stream, or nullptr if it could not be created.
+ */
+inline std::FILE* OpenRingStream(std::unique_ptr<ShmRing> ring) {
+    cookie_io_functions_t io {};
+    io.write = [](void* c, const char* buf, size_t n) -> ssize_t {
+        static_cast<ShmRing*>(c)->Write(buf, n);
+        return static_cast<ssize_t>(n);
+    };
+    io.close = [](void* c) -> int {
+        ShmRing* r = static_cast<ShmRing*>(c);
+        r->Close();
+        delete r;
+        return 0;
+    };
+    std::FILE* f = ::fopencookie(ring.get(), "w", io);
+    if (f) ring.release();
+    return f;
+}
+#endif
+
+/**
+ * @brief Splits a "host:port" endpoint; an empty host means "listen" (TCP) or "any address" (UDP).
+ * @throws std::runtime_error if there is no port.
+ */
+inline std::pair<std::string, std::string> SplitHostPort(const std::string& ep) {
+    const size_t pos = ep.rfind(':');
+    if (pos == std::string::npos || pos + 1 == ep.size()) throw std::runtime_error{"Endpoint '" + ep + "' needs HOST:PORT or :PORT"};
+    return {ep.substr(0, pos), ep.substr(pos + 1)};
+}
+
+/**
+ * @brief Opens a TCP stream: connects to "host:port", or with ":port" listens and accepts one peer.
+ * @return The connected socket, with Nagle's algorithm disabled.
+ * @throws std::runtime_error if no connection could be made.
+ */
+inline int OpenTcp(const std::string& ep) {
+    const auto [host, port] = SplitHostPort(ep);
+    addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = host.empty() ? AI_PASSIVE : 0;
+    addrinfo* res = nullptr;
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) throw std::runtime_error{"Resolve " + ep};
+    int fd = -1;
+    for (addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (host.empty()) {
+            const int one = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            const int lfd = fd;
+            fd = ::bind(lfd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(lfd, 1) == 0 ? ::accept(lfd, nullptr, nullptr) : -1;
+            ::close(lfd);
+        } else if (::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(res);
+    if (fd < 0) throw std::runtime_error{"Connect " + ep};
+    const int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * @brief Binds a UDP socket to "host:port" (":port" for any address) to receive datagrams on.
+ * @throws std::runtime_error if the socket cannot be bound.
+ */
+inline int OpenUdp(const std::string& ep) {
+    const auto [host, port] = SplitHostPort(ep);
+    addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* res = nullptr;
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) throw std::runtime_error{"Resolve " + ep};
+    int fd = -1;
+    for (addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && ::bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) { ::close(fd); fd = -1; }
+    }
+    ::freeaddrinfo(res);
+    if (fd < 0) throw std::runtime_error{"Bind " + ep};
+    // Room for bursts while a book update is being applied.
+    const int rcvBuf = 8 << 20;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+    return fd;
+}
+#endif
+
+/**
+ * @brief Line source over a byte reader (FdReader, ShmRing), for live input that cannot be mapped.
+ *
+ * Bytes are read in large chunks into a reused buffer and split on '\n' in place; a line that
+ * crosses a chunk boundary is moved to the front before the next read. Yields the same lines
+ * std::getline would, and `line` stays valid until the following call.
+ * @tparam Reader Type with `size_t Read(char* buf, size_t cap)` returning 0 at end of input.
+ */
+template <class Reader>
+class ChunkLines {
+public:
+    explicit ChunkLines(Reader& rd, size_t chunk = 1 << 16) : rd_(rd), buf_(chunk) {}
+
+    bool Next(std::string_view& line) {
+        for (;;) {
+            const char* nl = static_cast<const char*>(std::memchr(buf_.data() + pos_, '\n', end_ - pos_));
+            if (nl) {
+                line = std::string_view(buf_.data() + pos_, static_cast<size_t>(nl - buf_.data()) - pos_);
+                off_ += line.size() + 1;
+                pos_ += line.size() + 1;
+                return true;
+            }
+            if (!Fill()) {
+                if (pos_ == end_) return false;
+                line = std::string_view(buf_.data() + pos_, end_ - pos_);
+                off_ += line.size();
+                pos_ = end_;
+                return true;
+            }
+        }
+    }
+
+    /**
+     * @brief Bytes consumed from the input so far.
+     */
+    uint64_t Offset() const { return off_; }
+
+    /**
+     * @brief Skips ahead to byte offset `off`, reading and discarding what lies before it.
+     * @throws std::runtime_error if `off` was already passed or the input ends first.
+     */
+    void Seek(uint64_t off) {
+        if (off < off_) throw std::runtime_error{"Resume offset lies before the stream position"};
+        while (off_ < off) {
+            if (pos_ == end_ && !Fill()) throw std::runtime_error{"Resume offset past the end of the MBO input"};
+            const size_t k = static_cast<size_t>(std::min<uint64_t>(end_ - pos_, off - off_));
+            pos_ += k;
+            off_ += k;
+        }
+    }
+
+private:
+    /**
+     * @brief Moves the unconsumed tail to the front (growing the buffer if it is full) and reads more.
+     * @return false at end of input.
+     */
+    bool Fill() {
+        if (pos_) {
+            std::memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+            end_ -= pos_;
+            pos_ = 0;
+        }
+        if (end_ == buf_.size()) buf_.resize(buf_.size() * 2);
+        const size_t n = rd_.Read(buf_.data() + end_, buf_.size() - end_);
+        end_ += n;
+        return n > 0;
+    }
+
+    Reader& rd_;
+    std::vector<char> buf_;
+    size_t pos_ {0};
+    size_t end_ {0};
+    uint64_t off_ {0};
+};
+
+/**
+ * @brief Formats an unsigned integer with std::to_chars.
+ * @return The position after the last digit.
+ */
+inline char* PutUInt(char* p, uint64_t v) { return std::to_chars(p, p + 20, v).ptr; }
+
+/**
+ * @brief Formats a signed integer with std::to_chars.
+ * @return The position after the last digit.
+ */
+inline char* PutInt(char* p, int64_t v) { return std::to_chars(p, p + 20, v).ptr; }
+
+/**
+ * @brief Formats a nano price as a fixed-point decimal with 9 decimals, using integer math only.
+ *
+ * Produces the same text as `std::fixed << std::setprecision(9) << ToDblPrice(px)` for every price
+ * a double represents to the nano, and the exact value beyond that.
+ * @return The position after the last digit.
+ */
+inline char* PutNanoPrice(char* p, int64_t px) {
+    uint64_t mag = static_cast<uint64_t>(px);
+    if (px < 0) {
+        *p++ = '-';
+        mag = 0 - mag;
+    }
+    p = PutUInt(p, mag / static_cast<uint64_t>(PRICE_SCALE));
+    *p++ = '.';
+    uint64_t frac = mag % static_cast<uint64_t>(PRICE_SCALE);
+    for (int d = 8; d >= 0; --d) {
+        p[d] = static_cast<char>('0' + frac % 10);
+        frac /= 10;
+    }
+    return p + 9;
+}
+
+/**
+ * @brief Leading header columns of MBP rows, describing the message that produced the row.
+ */
+constexpr const char* MBP_MSG_COLS = ",ts_recv,ts_event,rtype,publisher_id,instrument_id,action,side,depth,price,size,flags,ts_in_delta,sequence,";
+
+/**
+ * @brief Writes the header for the Market By Price (MBP) output file.
+ * @tparam Depth Number of level columns per side.
+ * @param ob The output buffer to write the header to.
+ */
+template <size_t Depth = MBP_DEPTH>
+void WriteMbpHdr(OutBuf& ob) {
+    static_assert(Depth >= 1 && Depth <= 100, "level columns are numbered with two digits");
+    std::string hdr = MBP_MSG_COLS;
+    for (size_t i = 0; i < Depth; ++i) {
+        const char idx[] = {static_cast<char>('0' + i / 10), static_cast<char>('0' + i % 10), '\0'};
+        for (const char* col : {"bid_px_", "bid_sz_", "bid_ct_", "ask_px_", "ask_sz_", "ask_ct_"}) {
+            hdr += col;
+            hdr += idx;
+            hdr += ',';
+        }
+        if (i == Depth - 1) hdr.pop_back();
+    }
+    hdr += ",symbol,order_id\n";
+    ob.Append(hdr);
+}
+
+/**
+ * @brief Upper bound on the bytes of an MBP-Depth row besides its symbol.
+ */
+template <size_t Depth>
+constexpr size_t MBP_ROW_FIXED_MAX = 256 + Depth * 2 * (21 + 11 + 11 + 3);
+
+/**
+ * @brief Formats the message columns of an MBP row (MBP_MSG_COLS), each followed by a comma.
+ * @return The end of the written text.
+ */
+inline char* PutMbpMsgCols(char* p, const MboSingle& mi, int rIdx, size_t rtype, uint32_t depth_val) {
+    p = PutInt(p, rIdx); *p++ = ',';
+    p = PutIsoNanos(p, mi.tsRecv); *p++ = ',';
+    p = PutIsoNanos(p, mi.tsEvent); *p++ = ',';
+    p = PutUInt(p, rtype); *p++ = ',';
+    p = PutUInt(p, mi.pubId); *p++ = ',';
+    p = PutUInt(p, mi.instrId); *p++ = ',';
+    *p++ = mi.action; *p++ = ',';
+    *p++ = mi.side; *p++ = ',';
+    p = PutUInt(p, depth_val); *p++ = ',';
+
+    if (mi.price != UNDEFINED_PRICE) p = PutNanoPrice(p, mi.price);
+    *p++ = ',';
+
+    p = PutUInt(p, mi.size); *p++ = ',';
+    p = PutUInt(p, mi.flags); *p++ = ',';
+    p = PutInt(p, mi.tsInDelta); *p++ = ',';
+    p = PutUInt(p, mi.sequence); *p++ = ',';
+    return p;
+}
+
+/**
+ * @brief Formats the px,sz,ct columns of one level, each followed by a comma; an empty level is ",0,0,".
+ * @return The end of the written text.
+ */
+inline char* PutLvlCols(char* p, const PriceLvl& lvl) {
+    if (!lvl) return std::copy_n(",0,0,", 5, p);
+    p = PutNanoPrice(p, lvl.price); *p++ = ',';
+    p = PutUInt(p, lvl.size); *p++ = ',';
+    p = PutUInt(p, lvl.count); *p++ = ',';
+    return p;
+}
+
+/**
+ * @brief Writes a row to the Market By Price (MBP) output file.
+ * @tparam Depth Number of levels per side; also written as the row's rtype.
+ * @param ob The output buffer to write the row to.
+ * @param mi The MboSingle object containing the data for the row.
+ * @param bl The aggregated bid price levels.
+ * @param al The aggregated ask price levels.
+ * @param rIdx The index of the row being written.
+ * @param depth_val The depth value for the row.
+ */
+template <size_t Depth>
+void WriteMbpRow(OutBuf& ob, const MboSingle& mi, const TopLvlsN<Depth>& bl, const TopLvlsN<Depth>& al, int rIdx, uint32_t depth_val) {
+    RECON_TIME(Write);
+    char* p = ob.Reserve(MBP_ROW_FIXED_MAX<Depth> + mi.symbol.size());
+    p = PutMbpMsgCols(p, mi, rIdx, Depth, depth_val);
+    for (size_t i = 0; i < Depth; ++i) {
+        p = PutLvlCols(p, bl[i]);
+        p = PutLvlCols(p, al[i]);
+    }
+    p = std::copy(mi.symbol.begin(), mi.symbol.end(), p); *p++ = ',';
+    p = PutUInt(p, mi.orderId); *p++ = '\n';
+    ob.Commit(p);
+}
+
+/**
+ * @brief Reconstructor sink writing MBP-Depth rows as CSV (the `output.csv` format).
+ */
+template <size_t Depth>
+class CsvMbpWriterN {
+public:
+    static constexpr size_t DEPTH = Depth;
+    explicit CsvMbpWriterN(OutBuf& ob) : ob_(ob) {}
+    void Hdr() { WriteMbpHdr<Depth>(ob_); }
+    void OnMbp(const MbpViewN<Depth>& v) { WriteMbpRow<Depth>(ob_, v.msg, v.bids, v.asks, v.rowIdx, v.depth); }
+
+private:
+    OutBuf& ob_;
+};
+using CsvMbpWriter = CsvMbpWriterN<MBP_DEPTH>;
+
+/**
+ * @brief Reconstructor sink writing MBP-Depth rows as CSV deltas: only the levels that changed since the
+ *        instrument's previous row, with a full snapshot on the instrument's first row and every
+ *        `snapEvery` messages of the instrument after it.
+ *
+ * A message that changes none of the instrument's levels writes no row (unless a snapshot is due).
+ * A row holds the message columns, symbol and order id, the kind (S for a snapshot, D for a delta), the
+ * number of level entries and then one `side,level,px,sz,ct` group per entry, side being B or A and
+ * level the 0-based index. A delta entry with an empty px means the level is now empty. A snapshot lists
+ * the non-empty levels only; the receiver clears the instrument's book before applying it.
+ */
+template <size_t Depth>
+class DeltaMbpWriterN {
+public:
+    static constexpr size_t DEPTH = Depth;
+    /**
+     * @brief Rows between two snapshots of an instrument when none is given.
+     */
+    static constexpr uint32_t SNAP_EVERY = 1000;
+
+    /**
+     * @param snapEvery Messages of an instrument between its snapshots; 0 sends only the first one.
+     */
+    explicit DeltaMbpWriterN(OutBuf& ob, uint32_t snapEvery = SNAP_EVERY) : ob_(ob), snapEvery_(snapEvery) {}
+
+    void Hdr() {
+        ob_.Append(MBP_MSG_COLS);
+        ob_.Append("symbol,order_id,kind,n_lvls,lvls\n");
+    }
+
+    void OnMbp(const MbpViewN<Depth>& v) {
+        const MboSingle& mi = v.msg;
+        Instr& st = instrs_[mi.instrId];
+        const bool snap = !st.seen || (snapEvery_ && st.sinceSnap >= snapEvery_);
+        // A snapshot sends the non-empty levels, i.e. those that differ from an empty ladder.
+        static const TopLvlsN<Depth> empty {};
+        const uint64_t bidMask = ChangedLvls<Depth>(v.bids, snap ? empty : st.bids);
+        const uint64_t askMask = ChangedLvls<Depth>(v.asks, snap ? empty : st.asks);
+        if (!snap && (bidMask | askMask) == 0) {
+            // Nothing to send; the message still counts towards the next snapshot.
+            ++st.sinceSnap;
+            ++skipped_;
+            return;
+        }
+        char* p = ob_.Reserve(ROW_FIXED_MAX + mi.symbol.size());
+        p = PutMbpMsgCols(p, mi, v.rowIdx, Depth, v.depth);
+        p = std::copy(mi.symbol.begin(), mi.symbol.end(), p); *p++ = ',';
+        p = PutUInt(p, mi.orderId); *p++ = ',';
+        *p++ = snap ? 'S' : 'D'; *p++ = ',';
+        p = PutUInt(p, static_cast<uint64_t>(__builtin_popcountll(bidMask) + __builtin_popcountll(askMask)));
+        auto put = [&](char side, const TopLvlsN<Depth>& cur, uint64_t mask) {
+            for (; mask; mask &= mask - 1) {
+                const size_t i = static_cast<size_t>(__builtin_ctzll(mask));
+                *p++ = ','; *p++ = side; *p++ = ',';
+                p = PutUInt(p, i); *p++ = ',';
+                p = PutLvlCols(p, cur[i]) - 1;
+            }
+        };
+        put('B', v.bids, bidMask);
+        put('A', v.asks, askMask);
+        *p++ = '\n';
+        ob_.Commit(p);
+        st.bids = v.bids;
+        st.asks = v.asks;
+        st.seen = true;
+        st.sinceSnap = snap ? 1 : st.sinceSnap + 1;
+    }
+
+    /**
+     * @brief Messages that changed none of the instrument's levels and so wrote no row.
+     */
+    uint64_t Skipped() const { return skipped_; }
+
+private:
+    /**
+     * @brief Upper bound on the bytes of a delta row besides its symbol.
+     */
+    static constexpr size_t ROW_FIXED_MAX = 256 + Depth * 2 * (1 + 3 + 21 + 11 + 11 + 5);
+
+    /**
+     * @brief The levels last sent for an instrument.
+     */
+    struct Instr {
+        TopLvlsN<Depth> bids, asks;
+        uint32_t sinceSnap {0};
+        bool seen {false};
+    };
+
+    OutBuf& ob_;
+    const uint32_t snapEvery_;
+    std::unordered_map<uint32_t, Instr> instrs_;
+    uint64_t skipped_ {0};
+};
+
+/**
+ * @brief One side-by-side bid/ask level of a binary MBP record (same field order as Databento's BidAskPair).
+ */
+struct MbpBinLvl {
+    int64_t bidPx;
+    int64_t askPx;
+    uint32_t bidSz;
+    uint32_t askSz;
+    uint32_t bidCt;
+    uint32_t askCt;
+};
+
+/**
+ * @brief Fixed-width binary MBP row, holding the same columns as a CSV row.
+ *
+ * Prices are int64 nanos (UNDEFINED_PRICE when absent), timestamps int64 ns since the epoch
+ * (UNDEFINED_TS when the input text was not an ISO-8601 UTC timestamp), native byte order.
+ * Symbols longer than the field are truncated.
+ * @tparam Depth Number of levels per side.
+ */
+template <size_t Depth>
+struct MbpBinRecN {
+    int64_t tsRecv;
+    int64_t tsEvent;
+    int64_t price;
+    uint64_t orderId;
+    uint32_t rowIdx;
+    uint32_t instrId;
+    uint32_t size;
+    uint32_t depth;
+    int32_t tsInDelta;
+    uint32_t sequence;
+    uint16_t pubId;
+    uint8_t rtype;
+    char action;
+    char side;
+    uint8_t flags;
+    char symbol[26];
+    MbpBinLvl lvls[Depth];
+};
+using MbpBinRec = MbpBinRecN<MBP_DEPTH>;
+static_assert(sizeof(MbpBinLvl) == 32 && sizeof(MbpBinRecN<1>) == 88 + sizeof(MbpBinLvl) &&
+              sizeof(MbpBinRec) == 88 + MBP_DEPTH * sizeof(MbpBinLvl), "binary MBP layout must not contain padding");
+
+/**
+ * @brief Header at the start of a binary MBP file.
+ */
+struct MbpBinHdr {
+    char magic[8];
+    uint16_t version;
+    uint16_t depth;
+    uint32_t recBytes;
+};
+
+/**
+ * @brief Identifies binary MBP files and the record layout they use.
+ */
+constexpr char MBP_BIN_MAGIC[8] = {'M', 'B', 'P', 'B', 'I', 'N', '\0', '\0'};
+constexpr uint16_t MBP_BIN_VERSION = 1;
+
+/**
+ * @brief Reconstructor sink writing MBP-Depth rows as MbpBinRecN records after an MbpBinHdr.
+ */
+template <size_t Depth>
+class BinMbpWriterN {
+public:
+    static constexpr size_t DEPTH = Depth;
+    explicit BinMbpWriterN(OutBuf& ob) : ob_(ob) {}
+
+    void Hdr() {
+        MbpBinHdr hdr {};
+        std::copy(std::begin(MBP_BIN_MAGIC), std::end(MBP_BIN_MAGIC), hdr.magic);
+        hdr.version = MBP_BIN_VERSION;
+        hdr.depth = static_cast<uint16_t>(Depth);
+        hdr.recBytes = sizeof(MbpBinRecN<Depth>);
+        Put(hdr);
+    }
+
+    void OnMbp(const MbpViewN<Depth>& v) {
+        const MboSingle& mi = v.msg;
+        const TopLvlsN<Depth>& bl = v.bids;
+        const TopLvlsN<Depth>& al = v.asks;
+        MbpBinRecN<Depth> r;
+        r.tsRecv = mi.tsRecv;
+        r.tsEvent = mi.tsEvent;
+        r.price = mi.price;
+        r.orderId = mi.orderId;
+        r.rowIdx = static_cast<uint32_t>(v.rowIdx);
+        r.instrId = mi.instrId;
+        r.size = mi.size;
+        r.depth = v.depth;
+        r.tsInDelta = mi.tsInDelta;
+        r.sequence = mi.sequence;
+        r.pubId = mi.pubId;
+        r.rtype = static_cast<uint8_t>(Depth);
+        r.action = mi.action;
+        r.side = mi.side;
+        r.flags = mi.flags;
+        std::fill(std::begin(r.symbol), std::end(r.symbol), '\0');
+        std::copy_n(mi.symbol.data(), std::min(mi.symbol.size(), sizeof(r.symbol)), r.symbol);
+        for (size_t i = 0; i < Depth; ++i) {
+            r.lvls[i] = MbpBinLvl{bl[i].price, al[i].price, bl[i].size, al[i].size, bl[i].count, al[i].count};
+        }
+        Put(r);
+    }
+
+private:
+    template <class T>
+    void Put(const T& v) {
+        char* p = ob_.Reserve(sizeof(T));
+        std::memcpy(p, &v, sizeof(T));
+        ob_.Commit(p + sizeof(T));
+    }
+
+    OutBuf& ob_;
+};
+using BinMbpWriter = BinMbpWriterN<MBP_DEPTH>;
+
+/**
+ * @brief Converts the MbpBinRecN records following an MbpBinHdr into CSV, header included.
+ * @param bin The records.
+ * @param ob The CSV output.
+ */
+template <size_t Depth>
+void BinRecsToCsv(std::string_view bin, OutBuf& ob) {
+    using Rec = MbpBinRecN<Depth>;
+    if (bin.size() % sizeof(Rec) != 0) std::cerr << "Warn: Binary MBP file ends with a partial record. Ign.\n";
+
+    WriteMbpHdr<Depth>(ob);
+    MboSingle mi;
+    TopLvlsN<Depth> bl, al;
+    for (; bin.size() >= sizeof(Rec); bin.remove_prefix(sizeof(Rec))) {
+        Rec r;
+        std::memcpy(&r, bin.data(), sizeof(r));
+        mi.tsRecv = r.tsRecv;
+        mi.tsEvent = r.tsEvent;
+        mi.price = r.price;
+        mi.orderId = r.orderId;
+        mi.instrId = r.instrId;
+        mi.size = r.size;
+        mi.tsInDelta = r.tsInDelta;
+        mi.sequence = r.sequence;
+        mi.pubId = r.pubId;
+        mi.rtype = r.rtype;
+        mi.action = static_cast<Act::Type>(r.action);
+        mi.side = static_cast<Sd::Type>(r.side);
+        mi.flags = r.flags;
+        mi.symbol = std::string_view(r.symbol, std::find(std::begin(r.symbol), std::end(r.symbol), '\0') - r.symbol);
+        for (size_t i = 0; i < Depth; ++i) {
+            bl[i] = PriceLvl{r.lvls[i].bidPx, r.lvls[i].bidSz, r.lvls[i].bidCt};
+            al[i] = PriceLvl{r.lvls[i].askPx, r.lvls[i].askSz, r.lvls[i].askCt};
+        }
+        WriteMbpRow<Depth>(ob, mi, bl, al, static_cast<int>(r.rowIdx), r.depth);
+    }
+}
+
+/**
+ * @brief Converts a binary MBP file back into the CSV format.
+ * @param bin The whole binary file.
+ * @param ob The CSV output.
+ * @throws std::runtime_error if the file header is missing or describes a layout this build cannot read.
+ */
+inline void BinToCsv(std::string_view bin, OutBuf& ob) {
+    MbpBinHdr hdr;
+    if (bin.size() < sizeof(hdr)) throw std::runtime_error{"Binary MBP file too short"};
+    std::memcpy(&hdr, bin.data(), sizeof(hdr));
+    if (!std::equal(std::begin(MBP_BIN_MAGIC), std::end(MBP_BIN_MAGIC), hdr.magic)) throw std::runtime_error{"Not a binary MBP file"};
+    bin.remove_prefix(sizeof(hdr));
+    if (hdr.version == MBP_BIN_VERSION) {
+        if (hdr.depth == 1 && hdr.recBytes == sizeof(MbpBinRecN<1>)) return BinRecsToCsv<1>(bin, ob);
+        if (hdr.depth == 10 && hdr.recBytes == sizeof(MbpBinRecN<10>)) return BinRecsToCsv<10>(bin, ob);
+        if (hdr.depth == 50 && hdr.recBytes == sizeof(MbpBinRecN<50>)) return BinRecsToCsv<50>(bin, ob);
+    }
+    throw std::runtime_error{"Unsupported binary MBP layout (version " + std::to_string(hdr.version) + ", depth " + std::to_string(hdr.depth) + ")"};
+}
+
+/**
+ * @brief Row filter in front of a writer: drops rows that leave an instrument's top levels unchanged
+ *        and/or conflates each instrument's rows to at most one per time window.
+ *
+ * Change-only rows are compared against the last row written for the same instrument. With a
+ * window of W ns (keyed on ts_recv), the first change after a quiet period is written at once;
+ * later changes inside the window only replace the instrument's pending row, which is written when
+ * a message at or past the window's end arrives (for any instrument) or at Finish. Written rows keep
+ * the row index of the message that produced them. Messages without a parsable ts_recv are not
+ * conflated.
+ * @tparam Writer Row format (CsvMbpWriterN, BinMbpWriterN or DeltaMbpWriterN).
+ */
+template <class Writer>
+class ConflatedWriter {
+public:
+    static constexpr size_t DEPTH = Writer::DEPTH;
+    using View = MbpViewN<DEPTH>;
+
+    /**
+     * @param ob The output.
+     * @param changesOnly Drop rows whose top levels equal the instrument's last written row.
+     * @param windowNs Conflation window in nanoseconds; 0 writes every (changed) row immediately.
+     * @param writerArgs Further arguments of the Writer constructor.
+     */
+    template <class... WriterArgs>
+    ConflatedWriter(OutBuf& ob, bool changesOnly, int64_t windowNs, const WriterArgs&... writerArgs)
+        : w_(ob, writerArgs...), changesOnly_(changesOnly), windowNs_(windowNs) {}
+
+    void Hdr() { w_.Hdr(); }
+
+    void OnMbp(const View& v) {
+        const int64_t t = windowNs_ ? v.msg.tsRecv : UNDEFINED_TS;
+        if (t != UNDEFINED_TS) FlushDue(t);
+        Instr& st = instrs_[v.msg.instrId];
+        if (changesOnly_ && st.written && (ChangedLvls<DEPTH>(v.bids, st.bids) | ChangedLvls<DEPTH>(v.asks, st.asks)) == 0) {
+            st.pending = false;  // Back to what was last written: nothing left to report.
+            ++dropped_;
+            return;
+        }
+        if (t == UNDEFINED_TS || t >= st.windowEnd) {
+            if (st.pending) ++dropped_;
+            Write(st, v);
+            if (t != UNDEFINED_TS) st.windowEnd = t + windowNs_;
+            return;
+        }
+        if (st.pending) ++dropped_;
+        st.msg = v.msg;
+        st.pendBids = v.bids;
+        st.pendAsks = v.asks;
+        st.pendRow = v.rowIdx;
+        st.pendDepth = v.depth;
+        st.pending = true;
+        if (!st.queued) { due_.emplace(st.windowEnd, v.msg.instrId); st.queued = true; }
+    }
+
+    /**
+     * @brief Writes the rows still pending at the end of the input.
+     */
+    void Finish() { FlushDue(INT64_MAX); }
+
+    /**
+     * @brief Rows dropped as unchanged or superseded within a window.
+     */
+    uint64_t Dropped() const { return dropped_; }
+
+private:
+    /**
+     * @brief Last written and pending top levels of one instrument.
+     */
+    struct Instr {
+        TopLvlsN<DEPTH> bids, asks;
+        TopLvlsN<DEPTH> pendBids, pendAsks;
+        MboSingle msg;
+        int pendRow {0};
+        uint32_t pendDepth {0};
+        int64_t windowEnd {INT64_MIN};
+        bool written {false};
+        bool pending {false};
+        /**
+         * @brief due_ holds an entry for the current windowEnd; entries for earlier window ends are stale.
+         */
+        bool queued {false};
+    };
+
+    void Write(Instr& st, const View& v) {
+        w_.OnMbp(v);
+        st.bids = v.bids;
+        st.asks = v.asks;
+        st.written = true;
+        st.pending = false;
+        st.queued = false;  // A new window opens; any entry still in due_ is for the old one.
+    }
+
+    /**
+     * @brief Writes the pending rows of the windows that end at or before t, earliest window end first.
+     */
+    void FlushDue(int64_t t) {
+        while (!due_.empty() && due_.top().first <= t) {
+            const auto [end, instrId] = due_.top();
+            due_.pop();
+            Instr& st = instrs_[instrId];
+            // Window ends of an instrument only grow, so an entry for an earlier one is stale.
+            if (!st.queued || st.windowEnd != end) continue;
+            st.queued = false;
+            if (st.pending) {
+                Write(st, View{st.msg, st.pendBids, st.pendAsks, st.pendRow, st.pendDepth});
+                st.windowEnd = end + windowNs_;
+            }
+        }
+    }
+
+    Writer w_;
+    const bool changesOnly_;
+    const int64_t windowNs_;
+    std::unordered_map<uint32_t, Instr> instrs_;
+    /**
+     * @brief Min-heap of (window end, instrument) for instruments with a pending row.
+     */
+    using Due = std::pair<int64_t, uint32_t>;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due_;
+    uint64_t dropped_ {0};
+};
+
+/**
+ * @brief Counters of a PendingTfTable.
+ */
+struct PendingTfStats {
+    uint64_t added {0};
+    uint64_t matched {0};
+    /**
+     * @brief T/F messages that replaced a still pending one with the same order id.
+     */
+    uint64_t replaced {0};
+    /**
+     * @brief Orphans: entries dropped unmatched because they got too old or the table was full.
+     */
+    uint64_t evictedAge {0};
+    uint64_t evictedFull {0};
+    /**
+     * @brief Entries still waiting for their cancel.
+     */
+    uint64_t live {0};
+
+    PendingTfStats& operator+=(const PendingTfStats& o) {
+        added += o.added; matched += o.matched; replaced += o.replaced;
+        evictedAge += o.evictedAge; evictedFull += o.evictedFull; live += o.live;
+        return *this;
+    }
+};
+
+/**
+ * @brief Bounds of a PendingTfTable.
+ */
+struct PendingTfLimits {
+    /**
+     * @brief Most entries held at once; when full, the oldest entry is evicted. Rounded up to a power of two.
+     */
+    size_t cap {4096};
+    /**
+     * @brief An entry is evicted once this many newer T/F messages arrived without its cancel; 0 (and any
+     *        value above twice `cap`) leaves the implicit limit of twice `cap`.
+     */
+    uint64_t maxAge {0};
+};
+
+/**
+ * @brief Fixed-capacity table of T/F messages waiting for the cancel that completes their T/F/C
+ *        sequence, by order id.
+ *
+ * Only the price, size and side needed for the synthetic trade are kept. Lookups use open addressing
+ * with linear probing over twice `cap` slots and backward-shift deletion. A FIFO of insertions (also
+ * twice `cap` long) drives eviction: the oldest entry goes when the table is full or, with `maxAge`,
+ * when it fell too far behind. Entries matched in the meantime are skipped when they reach the
+ * FIFO's front; a full FIFO also ages out its front entry. Nothing is allocated after construction.
+ */
+class PendingTfTable {
+public:
+    /**
+     * @brief What a pending T/F contributes to its synthetic trade.
+     */
+    struct Entry {
+        int64_t price;
+        uint32_t size;
+        Sd::Type side;
+    };
+
+    explicit PendingTfTable(const PendingTfLimits& lim = {})
+        : cap_(RoundPow2(std::max<size_t>(lim.cap, 1))), maxAge_(lim.maxAge),
+          slots_(2 * cap_), fifo_(2 * cap_), mask_(2 * cap_ - 1) {}
+
+    /**
+     * @brief Records a T/F message, replacing a pending entry with the same order id.
+     */
+    void Add(uint64_t orderId, const Entry& e) {
+        ++stats_.added;
+        ++serial_;
+        if (maxAge_) {
+            while (fifoLen_ && serial_ - fifo_[fifoHead_].serial > maxAge_) PopFifo(stats_.evictedAge);
+        }
+        size_t i = Home(orderId);
+        for (; slots_[i].used; i = (i + 1) & mask_) {
+            if (slots_[i].orderId == orderId) {
+                ++stats_.replaced;
+                slots_[i].e = e;
+                slots_[i].serial = serial_;
+                PushFifo(orderId);
+                return;
+            }
+        }
+        if (stats_.live == cap_) {
+            while (stats_.live == cap_) PopFifo(stats_.evictedFull);
+            // Eviction may have shifted entries into the free slot found above.
+            for (i = Home(orderId); slots_[i].used; i = (i + 1) & mask_) {}
+        }
+        slots_[i] = Slot{orderId, serial_, e, true};
+        ++stats_.live;
+        PushFifo(orderId);
+    }
+
+    /**
+     * @brief Removes the pending entry of an order id into `e`.
+     * @return false if none is pending.
+     */
+    bool Take(uint64_t orderId, Entry& e) {
+        for (size_t i = Home(orderId); slots_[i].used; i = (i + 1) & mask_) {
+            if (slots_[i].orderId == orderId) {
+                e = slots_[i].e;
+                Erase(i);
+                ++stats_.matched;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const PendingTfStats& Stats() const { return stats_; }
+
+    /**
+     * @brief Writes the pending entries and the eviction FIFO (stale records included) to a checkpoint.
+     */
+    void SaveState(CkptOut& out) const {
+        out.Put<uint64_t>(cap_);
+        out.Put<uint64_t>(serial_);
+        out.Put(stats_);
+        for (const Slot& s : slots_) {
+            if (s.used) out.Put(s);
+        }
+        out.Put<uint64_t>(fifoLen_);
+        for (size_t k = 0; k < fifoLen_; ++k) out.Put(fifo_[(fifoHead_ + k) & mask_]);
+    }
+
+    /**
+     * @brief Replaces the table's contents with those written by SaveState.
+     * @throws std::runtime_error if the checkpoint was taken with a different capacity.
+     */
+    void LoadState(CkptIn& in) {
+        if (in.Get<uint64_t>() != cap_) throw std::runtime_error{"Checkpoint pending T/F capacity differs from --pending-cap"};
+        serial_ = in.Get<uint64_t>();
+        stats_ = in.Get<PendingTfStats>();
+        std::fill(slots_.begin(), slots_.end(), Slot{});
+        for (uint64_t n = 0; n < stats_.live; ++n) {
+            const Slot s = in.Get<Slot>();
+            size_t i = Home(s.orderId);
+            while (slots_[i].used) i = (i + 1) & mask_;
+            slots_[i] = s;
+        }
+        fifoHead_ = 0;
+        fifoLen_ = in.Get<uint64_t>();
+        if (fifoLen_ > fifo_.size()) throw std::runtime_error{"Checkpoint pending T/F FIFO too long"};
+        for (size_t k = 0; k < fifoLen_; ++k) fifo_[k] = in.Get<FifoEnt>();
+    }
+
+private:
+    struct Slot {
+        uint64_t orderId;
+        uint64_t serial;
+        Entry e;
+        bool used;
+    };
+    struct FifoEnt {
+        uint64_t orderId;
+        uint64_t serial;
+    };
+
+    static size_t RoundPow2(size_t n) {
+        size_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    size_t Home(uint64_t orderId) const { return static_cast<size_t>((orderId * 0x9E3779B97F4A7C15ULL) >> 32) & mask_; }
+
+    /**
+     * @brief Empties slot i and moves later entries of its probe run back, so lookups need no tombstones.
+     */
+    void Erase(size_t i) {
+        slots_[i].used = false;
+        --stats_.live;
+        for (size_t j = (i + 1) & mask_; slots_[j].used; j = (j + 1) & mask_) {
+            const size_t home = Home(slots_[j].orderId);
+            // Move j into the hole at i unless its home lies cyclically in (i, j].
+            if (((j - home) & mask_) >= ((j - i) & mask_)) {
+                slots_[i] = slots_[j];
+                slots_[j].used = false;
+                i = j;
+            }
+        }
+    }
+
+    void PushFifo(uint64_t orderId) {
+        if (fifoLen_ == fifo_.size()) PopFifo(stats_.evictedAge);
+        fifo_[(fifoHead_ + fifoLen_++) & mask_] = FifoEnt{orderId, serial_};
+    }
+
+    /**
+     * @brief Drops the oldest FIFO record, evicting its entry (counted in `counter`) if still pending.
+     */
+    void PopFifo(uint64_t& counter) {
+        const FifoEnt f = fifo_[fifoHead_];
+        fifoHead_ = (fifoHead_ + 1) & mask_;
+        --fifoLen_;
+        for (size_t i = Home(f.orderId); slots_[i].used; i = (i + 1) & mask_) {
+            if (slots_[i].orderId == f.orderId) {
+                if (slots_[i].serial == f.serial) { Erase(i); ++counter; }
+                return;
+            }
+        }
+    }
+
+    const size_t cap_;
+    const uint64_t maxAge_;
+    std::vector<Slot> slots_;
+    std::vector<FifoEnt> fifo_;
+    const size_t mask_;
+    size_t fifoHead_ {0};
+    size_t fifoLen_ {0};
+    uint64_t serial_ {0};
+    PendingTfStats stats_;
+};
+
+/**
+ * @brief Applies MBO messages to a Market, turning T/F messages and the cancel that follows them
+ *        into one synthetic trade on the opposite side.
+ * @tparam Side Level storage used by the order books.
+ * @tparam Depth Number of aggregated levels per side.
+ */
+template <class Side, size_t Depth = MBP_DEPTH>
+class MboApplier {
+public:
+    /**
+     * @param expMaxOrds Expected peak number of live orders per book.
+     * @param pendLim Bounds of the pending T/F table.
+     */
+    explicit MboApplier(size_t expMaxOrds, const PendingTfLimits& pendLim = {}) : market_(expMaxOrds), pendingTFs_(pendLim) {}
+
+    /**
+     * @brief Applies one message.
+     * @return The depth value of the message's MBP row.
+     */
+    uint32_t Apply(const MboSingle& m) {
+        RECON_STAT(LocalStats().CountAct(m.action));
+        if (m.action == Act::Trade && m.side == Sd::None) {
+            return 0;
+        } else if (m.action == Act::Trade || m.action == Act::Fill) {
+            pendingTFs_.Add(m.orderId, PendingTfTable::Entry{m.price, m.size, m.side});
+            return 0;
+        } else if (m.action == Act::Cancel) {
+            PendingTfTable::Entry origTFM;
+            if (pendingTFs_.Take(m.orderId, origTFM)) {
+                Sd::Type sideAff;
+                if (origTFM.side == Sd::Ask) sideAff = Sd::Bid;
+                else if (origTFM.side == Sd::Bid) sideAff = Sd::Ask;
+                else {
+                    WarnLog::Get().Warn(Wrn::TfNoSide, static_cast<int64_t>(m.orderId));
+                    return 0;
+                }
+
+                try {
+                    market_.ProcSynthTrade(m.instrId, m.pubId, origTFM.price, origTFM.size, sideAff);
+                } catch (const std::exception&) {
+                    WarnLog::Get().Warn(Wrn::SynthFailed, static_cast<int64_t>(m.orderId), m.instrId, m.pubId);
+                }
+                return market_.GetLevelDepth(m.instrId, m.pubId, origTFM.price, sideAff);
+            }
+            market_.Apply(m);
+            return market_.GetLevelDepth(m.instrId, m.pubId, m.price, m.side);
+        }
+        market_.Apply(m);
+        if (m.action == Act::Add || m.action == Act::Modify) return market_.GetLevelDepth(m.instrId, m.pubId, m.price, m.side);
+        return 0;
+    }
+
+    /**
+     * @brief How many messages ahead ApplyBatch prefetches: the directory cell is requested
+     *        2 * PREFETCH_DIST messages ahead, the book's id slot or levels PREFETCH_DIST ahead.
+     */
+    static constexpr size_t PREFETCH_DIST = 4;
+
+    /**
+     * @brief Applies `n` messages in order, calling onApplied(i, depth) right after message i, while
+     *        the memory the following messages need is prefetched.
+     *
+     * Produces the same book states and depths as calling Apply on each message; the callback sees
+     * the state after its message, so snapshots are still taken per message.
+     */
+    template <class F>
+    void ApplyBatch(const MboSingle* msgs, size_t n, F&& onApplied) {
+        for (size_t i = 0; i < n && i < 2 * PREFETCH_DIST; ++i) market_.PrefetchCell(msgs[i].instrId, msgs[i].pubId);
+        for (size_t i = 0; i < n && i < PREFETCH_DIST; ++i) market_.Prefetch(msgs[i]);
+        for (size_t i = 0; i < n; ++i) {
+            if (i + 2 * PREFETCH_DIST < n) market_.PrefetchCell(msgs[i + 2 * PREFETCH_DIST].instrId, msgs[i + 2 * PREFETCH_DIST].pubId);
+            if (i + PREFETCH_DIST < n) market_.Prefetch(msgs[i + PREFETCH_DIST]);
+            onApplied(i, Apply(msgs[i]));
+        }
+    }
+
+    /**
+     * @brief The aggregated top bid levels of an instrument after the last Apply.
+     */
+    const TopLvlsN<Depth>& BidLvls(uint32_t instrId) const { return market_.GetAggBidLvls(instrId); }
+
+    /**
+     * @brief The aggregated top ask levels of an instrument after the last Apply.
+     */
+    const TopLvlsN<Depth>& AskLvls(uint32_t instrId) const { return market_.GetAggAskLvls(instrId); }
+
+    /**
+     * @brief Counters of the pending T/F table.
+     */
+    const PendingTfStats& PendingStats() const { return pendingTFs_.Stats(); }
+
+    /**
+     * @brief Writes the books and the pending T/F messages to a checkpoint.
+     */
+    void SaveState(CkptOut& out) const {
+        market_.SaveState(out);
+        pendingTFs_.SaveState(out);
+    }
+
+    /**
+     * @brief Restores the state written by SaveState into this fresh applier.
+     */
+    void LoadState(CkptIn& in) {
+        market_.LoadState(in);
+        pendingTFs_.LoadState(in);
+    }
+
+private:
+    Market<Side, Depth> market_;
+    /**
+     * @brief T/F messages waiting for their cancel.
+     */
+    PendingTfTable pendingTFs_;
+};
+
+/**
+ * @brief Streaming MBO -> MBP-N engine: feed it messages with OnMbo and it calls the sink with the
+ *        resulting top-of-book of the message's instrument.
+ *
+ * The sink is any type with `void OnMbp(const MbpViewN<Depth>&)`; it is called synchronously, once per
+ * message, without virtual dispatch. CsvMbpWriter and BinMbpWriter are sinks; an in-process consumer
+ * can be one as well. Not thread-safe: feed one Reconstructor from one thread.
+ * @tparam Sink Receiver of the MBP updates.
+ * @tparam Side Level storage used by the order books.
+ * @tparam Depth Number of levels per side reported to the sink (1 for MBP-1, 10 for MBP-10, ...).
+ */
+template <class Sink, class Side = VecSide, size_t Depth = MBP_DEPTH>
+class Reconstructor {
+public:
+    /**
+     * @param sink Receiver of the updates; must outlive the Reconstructor.
+     * @param expMaxOrds Expected peak number of live orders per book.
+     * @param pendLim Bounds of the pending T/F table.
+     */
+    explicit Reconstructor(Sink& sink, size_t expMaxOrds = 0, const PendingTfLimits& pendLim = {})
+        : sink_(sink), applier_(expMaxOrds, pendLim) {}
+
+    /**
+     * @brief Applies one MBO message and reports the updated book to the sink.
+     */
+    void OnMbo(const MboSingle& m) {
+        const uint32_t depth = applier_.Apply(m);
+        sink_.OnMbp(MbpViewN<Depth>{m, applier_.BidLvls(m.instrId), applier_.AskLvls(m.instrId), rowIdx_++, depth});
+    }
+
+    /**
+     * @brief Applies `n` messages with MboApplier::ApplyBatch, reporting each one to the sink right after it.
+     */
+    void OnMboBatch(const MboSingle* msgs, size_t n) {
+        applier_.ApplyBatch(msgs, n, [&](size_t i, uint32_t depth) {
+            const MboSingle& m = msgs[i];
+            sink_.OnMbp(MbpViewN<Depth>{m, applier_.BidLvls(m.instrId), applier_.AskLvls(m.instrId), rowIdx_++, depth});
+        });
+    }
+
+    /**
+     * @brief The aggregated top bid levels of an instrument (empty levels if unknown).
+     */
+    const TopLvlsN<Depth>& BidLvls(uint32_t instrId) const { return applier_.BidLvls(instrId); }
+
+    /**
+     * @brief The aggregated top ask levels of an instrument (empty levels if unknown).
+     */
+    const TopLvlsN<Depth>& AskLvls(uint32_t instrId) const { return applier_.AskLvls(instrId); }
+
+    /**
+     * @brief Number of messages processed so far.
+     */
+    int Rows() const { return rowIdx_; }
+
+    /**
+     * @brief Counters of the pending T/F table, including orphaned (evicted) entries.
+     */
+    const PendingTfStats& PendingStats() const { return applier_.PendingStats(); }
+
+    /**
+     * @brief Writes the engine state (row counter, books, pending T/F messages) to a checkpoint.
+     */
+    void SaveState(CkptOut& out) const {
+        out.Put<int32_t>(rowIdx_);
+        applier_.SaveState(out);
+    }
+
+    /**
+     * @brief Restores the state written by SaveState into this fresh Reconstructor; rows continue
+     *        numbering where the checkpoint left off.
+     */
+    void LoadState(CkptIn& in) {
+        rowIdx_ = in.Get<int32_t>();
+        applier_.LoadState(in);
+    }
+
+private:
+    Sink& sink_;
+    MboApplier<Side, Depth> applier_;
+    int rowIdx_ {0};
+};
+
+/**
+ * @brief Header of a checkpoint file; the serialized engine state (Reconstructor::SaveState) follows.
+ */
+struct CkptHdr {
+    char magic[8];
+    uint32_t version;
+    /**
+     * @brief Levels per side of the rows written; a run resumes only at the same depth.
+     */
+    uint32_t depth;
+    /**
+     * @brief Input offset of the first message not covered by the checkpoint.
+     */
+    uint64_t inputOff;
+    /**
+     * @brief Output bytes written up to the checkpoint, header included.
+     */
+    uint64_t outputOff;
+    /**
+     * @brief Messages applied, and the sequence number of the last one.
+     */
+    uint64_t msgs;
+    uint64_t lastSeq;
+    uint64_t bodyBytes;
+};
+
+constexpr char CKPT_MAGIC[8] = {'M', 'B', 'P', 'C', 'K', 'P', 'T', '\0'};
+constexpr uint32_t CKPT_VERSION = 1;
+
+/**
+ * @brief Writes a checkpoint atomically: to `path`.tmp first, then renamed over `path`.
+ * @throws std::runtime_error if the file cannot be written.
+ */
+inline void WriteCheckpoint(const std::string& path, CkptHdr hdr, const CkptOut& body) {
+    std::copy(std::begin(CKPT_MAGIC), std::end(CKPT_MAGIC), hdr.magic);
+    hdr.version = CKPT_VERSION;
+    hdr.bodyBytes = body.Size();
+    const std::string tmpPath = path + ".tmp";
+    std::FILE* f = std::fopen(tmpPath.c_str(), "wb");
+    if (!f) throw std::runtime_error{"Open checkpoint file: " + tmpPath};
+    const bool ok = std::fwrite(&hdr, sizeof(hdr), 1, f) == 1 && std::fwrite(body.View().data(), 1, body.Size(), f) == body.Size();
+    if (std::fclose(f) != 0 || !ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error{"Write checkpoint file: " + path};
+    }
+}
+
+/**
+ * @brief Reads a checkpoint written by WriteCheckpoint.
+ * @param body Set to the serialized engine state.
+ * @throws std::runtime_error if the file is missing, truncated or of another version.
+ */
+inline CkptHdr ReadCheckpoint(const std::string& path, std::string& body) {
+    std::ifstream fs(path, std::ios::binary);
+    if (!fs.is_open()) throw std::runtime_error{"Open checkpoint file: " + path};
+    CkptHdr hdr;
+    if (!fs.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) || !std::equal(std::begin(CKPT_MAGIC), std::end(CKPT_MAGIC), hdr.magic)) {
+        throw std::runtime_error{"Not a checkpoint file: " + path};
+    }
+    if (hdr.version != CKPT_VERSION) throw std::runtime_error{"Unsupported checkpoint version " + std::to_string(hdr.version)};
+    body.resize(hdr.bodyBytes);
+    if (!fs.read(body.data(), static_cast<std::streamsize>(body.size()))) throw std::runtime_error{"Checkpoint truncated"};
+    return hdr;
+}
+
+/**
+ * @brief Checkpointing of a Reconstruct run.
+ */
+struct CkptPlan {
+    /**
+     * @brief File the checkpoints are written to; empty writes none.
+     */
+    std::string path;
+    /**
+     * @brief Messages between two checkpoints.
+     */
+    uint64_t every {0};
+    /**
+     * @brief The output's buffer, flushed before each checkpoint so the file holds every row it covers.
+     */
+    OutBuf* out {nullptr};
+    /**
+     * @brief State to resume from (the body of a checkpoint read with ReadCheckpoint); the output
+     *        header is not written again. The source must already be positioned at hdr.inputOff.
+     */
+    const std::string* restore {nullptr};
+    CkptHdr hdr {};
+};
+
+/**
+ * @brief Reconstructs MBP rows from MBO input, writing the header and one row per input message.
+ *
+ * Sources that never block are read a batch ahead to prefetch books; streaming sources skip the batch
+ * path so each row is written as soon as its message arrives.
+ * @tparam Side Level storage used by the order books.
+ * @tparam Source Message source (CsvMboSource or BinMboSource).
+ * @tparam Writer Row format (CsvMbpWriterN or BinMbpWriterN); its DEPTH sets the depth of the rows.
+ * @param mboSrc The MBO input.
+ * @param mbpOut The MBP output.
+ * @param expMaxOrds Expected peak number of live orders per book.
+ * @param pendLim Bounds of the pending T/F table.
+ * @return The pending T/F counters at the end of the input.
+ */
+template <class Side, class Source, class Writer>
+PendingTfStats Reconstruct(Source& mboSrc, Writer& mbpOut, size_t expMaxOrds, const PendingTfLimits& pendLim = {}) {
+    mbpOut.Hdr();
+    Reconstructor<Writer, Side, Writer::DEPTH> recon(mbpOut, expMaxOrds, pendLim);
+    if constexpr (!NeverBlocks<Source>::value) {
+        // A source that may wait must not hold back messages that already arrived.
+        MboSingle m;
+        while (mboSrc.Next(m)) recon.OnMbo(m);
+    } else {
+        // Read a few messages ahead so OnMboBatch can prefetch their books; message views stay valid
+        // across reads since symbols are interned.
+        constexpr size_t BATCH = 32;
+        std::array<MboSingle, BATCH> msgs;
+
+        for (;;) {
+            size_t n = 0;
+            try {
+                while (n < BATCH && mboSrc.Next(msgs[n])) ++n;
+            } catch (...) {
+                // Rows before a bad message are still written, as without read-ahead.
+                recon.OnMboBatch(msgs.data(), n);
+                throw;
+            }
+            recon.OnMboBatch(msgs.data(), n);
+            if (n < BATCH) break;
+        }
+    }
+    return recon.PendingStats();
+}
+
+/**
+ * @brief Reconstruct with checkpoints: resumes from `plan.restore` if set and writes the engine state,
+ *        input offset and output position to `plan.path` every `plan.every` messages.
+ *
+ * Source must provide Offset() (CsvMboSource or BinMboSource). A checkpoint is written between two
+ * messages, after flushing the output, so resuming from it reproduces the uninterrupted output.
+ */
+template <class Side, class Source, class Writer>
+PendingTfStats Reconstruct(Source& mboSrc, Writer& mbpOut, size_t expMaxOrds, const PendingTfLimits& pendLim, const CkptPlan& plan) {
+    Reconstructor<Writer, Side, Writer::DEPTH> recon(mbpOut, expMaxOrds, pendLim);
+    uint64_t msgs = 0, lastSeq = 0;
+    if (plan.restore) {
+        if (plan.hdr.depth != Writer::DEPTH) throw std::runtime_error{"Checkpoint was taken at depth " + std::to_string(plan.hdr.depth)};
+        CkptIn in(*plan.restore);
+        recon.LoadState(in);
+        if (!in.AtEnd()) throw std::runtime_error{"Checkpoint has trailing data"};
+        msgs = plan.hdr.msgs;
+        lastSeq = plan.hdr.lastSeq;
+    } else {
+        mbpOut.Hdr();
+    }
+    MboSingle m;
+    uint64_t untilCkpt = plan.path.empty() ? 0 : plan.every;
+
+    while (mboSrc.Next(m)) {
+        recon.OnMbo(m);
+        ++msgs;
+        lastSeq = m.sequence;
+        if (untilCkpt && --untilCkpt == 0) {
+            CkptOut body;
+            recon.SaveState(body);
+            plan.out->Flush();
+            CkptHdr hdr {};
+            hdr.depth = Writer::DEPTH;
+            hdr.inputOff = mboSrc.Offset();
+            hdr.outputOff = plan.out->Pos();
+            hdr.msgs = msgs;
+            hdr.lastSeq = lastSeq;
+            WriteCheckpoint(plan.path, hdr, body);
+            untilCkpt = plan.every;
+        }
+    }
+    return recon.PendingStats();
+}
+
+/**
+ * @brief A run of consecutive rows of one shard, formatted by its worker and written out by the merger.
+ */
+struct RowChunk {
+    static constexpr size_t MAX_ROWS = 256;
+    RowChunk() : buf(nullptr, 128 << 10) { ends.reserve(MAX_ROWS); }
+    OutBuf buf;
+    /**
+     * @brief End offset of each row in buf.
+     */
+    std::vector<uint32_t> ends;
+};
+
+/**
+ * @brief A message routed to a shard, with the index of its row in the output.
+ */
+struct ShardMsg {
+    int rowIdx;
+    MboSingle m;
+};
+
+/**
+ * @brief Per-worker state of ReconstructSharded: input ring, chunk pool and the rings that cycle chunks
+ *        between worker and merger.
+ */
+struct Shard {
+    static constexpr size_t IN_CAP = 1 << 12;
+    static constexpr size_t CHUNKS = 8;
+    Shard() : in(IN_CAP), full(CHUNKS), free(CHUNKS) {
+        for (size_t i = 0; i < CHUNKS; ++i) {
+            pool.emplace_back(new RowChunk);
+            *free.PushSlot() = pool.back().get();
+            free.Push();
+        }
+    }
+    SpscRing<ShardMsg> in;
+    SpscRing<RowChunk*> full;
+    SpscRing<RowChunk*> free;
+    std::vector<std::unique_ptr<RowChunk>> pool;
+};
+
+/**
+ * @brief Parallel Reconstruct: instruments are sharded over worker threads, each with its own Market.
+ *
+ * A reader thread pulls messages from `mboSrc` and routes each one by instrument id to a worker's
+ * SPSC ring, recording the shard of every row in a route ring. Workers apply their messages and
+ * format the rows into chunks; the calling thread merges the chunks back into input order by
+ * following the route ring. The output is identical to Reconstruct's, given that a T/F message and
+ * the cancel completing it share an instrument: pending T/F messages are tracked per shard.
+ * @tparam Side Level storage used by the order books.
+ * @tparam Writer Row format (CsvMbpWriterN or BinMbpWriterN); one is created per chunk buffer.
+ * @tparam Source Message source (CsvMboSource or BinMboSource).
+ * @param nWorkers Number of worker threads.
+ * @return The pending T/F counters, summed over the shards.
+ */
+template <class Side, class Writer, class Source>
+PendingTfStats ReconstructSharded(Source& mboSrc, OutBuf& ob, size_t expMaxOrds, unsigned nWorkers, const PendingTfLimits& pendLim = {}) {
+    std::vector<std::unique_ptr<Shard>> shards;
+    for (unsigned i = 0; i < nWorkers; ++i) shards.emplace_back(new Shard);
+    SpscRing<uint16_t> route(1 << 16);
+
+    std::thread reader([&] {
+        MboSingle m;
+        for (int rowIdx = 0; mboSrc.Next(m); ++rowIdx) {
+            const uint16_t shardIdx = static_cast<uint16_t>(m.instrId % nWorkers);
+            SpscRing<ShardMsg>& in = shards[shardIdx]->in;
+            ShardMsg* slot;
+            while (!(slot = in.PushSlot())) WaitSpin();
+            slot->rowIdx = rowIdx;
+            slot->m = m;
+            in.Push();
+            uint16_t* r;
+            while (!(r = route.PushSlot())) WaitSpin();
+            *r = shardIdx;
+            route.Push();
+        }
+        for (auto& sh : shards) sh->in.Close();
+        route.Close();
+    });
+
+    std::vector<std::thread> workers;
+    std::vector<PendingTfStats> pendStats(nWorkers);
+    for (unsigned w = 0; w < nWorkers; ++w) {
+        workers.emplace_back([&, w] {
+            Shard& sh = *shards[w];
+            MboApplier<Side, Writer::DEPTH> applier(expMaxOrds, pendLim);
+            RowChunk* chunk = nullptr;
+            auto publish = [&] {
+                *sh.full.PushSlot() = chunk;
+                sh.full.Push();
+                chunk = nullptr;
+            };
+            for (;;) {
+                ShardMsg* msg = sh.in.Front();
+                if (!msg) {
+                    // Hand over partial chunks when idle, so the merger never waits on rows already applied.
+                    if (chunk) publish();
+                    if (sh.in.Drained()) break;
+                    WaitSpin();
+                    continue;
+                }
+                if (!chunk) {
+                    RowChunk** c;
+                    while (!(c = sh.free.Front())) WaitSpin();
+                    chunk = *c;
+                    sh.free.Pop();
+                }
+                const uint32_t depth = applier.Apply(msg->m);
+                Writer(chunk->buf).OnMbp(MbpViewN<Writer::DEPTH>{msg->m, applier.BidLvls(msg->m.instrId), applier.AskLvls(msg->m.instrId), msg->rowIdx, depth});
+                sh.in.Pop();
+                chunk->ends.push_back(static_cast<uint32_t>(chunk->buf.View().size()));
+                if (chunk->ends.size() == RowChunk::MAX_ROWS) publish();
+            }
+            sh.full.Close();
+            pendStats[w] = applier.PendingStats();
+        });
+    }
+
+    Writer(ob).Hdr();
+    struct Cursor { RowChunk* chunk = nullptr; size_t row = 0; uint32_t off = 0; };
+    std::vector<Cursor> cursors(nWorkers);
+    for (;;) {
+        uint16_t* r = route.Front();
+        if (!r) {
+            if (route.Drained()) break;
+            WaitSpin();
+            continue;
+        }
+        Shard& sh = *shards[*r];
+        Cursor& cur = cursors[*r];
+        route.Pop();
+        if (!cur.chunk) {
+            RowChunk** c;
+            while (!(c = sh.full.Front())) WaitSpin();
+            cur = Cursor{*c, 0, 0};
+            sh.full.Pop();
+        }
+        const uint32_t end = cur.chunk->ends[cur.row];
+        ob.Append(cur.chunk->buf.View().substr(cur.off, end - cur.off));
+        cur.off = end;
+        if (++cur.row == cur.chunk->ends.size()) {
+            cur.chunk->buf.Clear();
+            cur.chunk->ends.clear();
+            *sh.free.PushSlot() = cur.chunk;
+            sh.free.Push();
+            cur.chunk = nullptr;
+        }
+    }
+
+    reader.join();
+    for (auto& t : workers) t.join();
+    PendingTfStats total;
+    for (const PendingTfStats& st : pendStats) total += st;
+    return total;
+}
+
+/**
+ * @brief Pins the calling thread to one CPU.
+ * @return false if pinning failed or is not supported on this platform.
+ */
+inline bool PinThisThread(int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+/**
+ * @brief Throughput and input-queue occupancy of one pipeline stage.
+ */
+struct StageStats {
+    const char* name;
+    uint64_t msgs {0};
+    uint64_t batches {0};
+    std::chrono::nanoseconds total {0};
+    std::chrono::nanoseconds waited {0};
+    uint64_t occSum {0};
+    size_t occMax {0};
+    size_t occCap {0};
+
+    /**
+     * @brief Records the occupancy of the stage's input queue when a batch is taken from it.
+     */
+    void SampleQueue(size_t occ) {
+        occSum += occ;
+        occMax = std::max(occMax, occ);
+    }
+
+    /**
+     * @brief Writes a one-line summary.
+     */
+    void Print(std::ostream& os) const {
+        const double busyS = std::chrono::duration<double>(total - waited).count();
+        char line[256];
+        std::snprintf(line, sizeof(line), "  %-9s %10llu msgs  busy %9.3f ms (%5.1f%%)  %8.2f M msg/s busy",
+                      name, static_cast<unsigned long long>(msgs), busyS * 1e3,
+                      total.count() ? 100.0 * (total - waited).count() / total.count() : 0.0,
+                      busyS > 0 ? msgs / busyS / 1e6 : 0.0);
+        os << line;
+        if (occCap) {
+            std::snprintf(line, sizeof(line), "  in-queue avg %.2f max %zu of %zu batches",
+                          batches ? static_cast<double>(occSum) / batches : 0.0, occMax, occCap);
+            os << line;
+        }
+        os << "\n";
+    }
+};
+
+/**
+ * @brief A batch of messages travelling parse -> apply -> serialize, with the book snapshot of each row.
+ * @tparam Depth Number of levels per side in a snapshot.
+ */
+template <size_t Depth>
+struct MsgBatch {
+    explicit MsgBatch(size_t cap) : msgs(cap), snaps(cap) {}
+
+    /**
+     * @brief What the serialize stage needs from the apply stage for one row.
+     */
+    struct RowSnap {
+        TopLvlsN<Depth> bids;
+        TopLvlsN<Depth> asks;
+        uint32_t depth;
+    };
+
+    std::vector<MboSingle> msgs;
+    std::vector<RowSnap> snaps;
+    size_t n {0};
+};
+
+/**
+ * @brief Pipelined Reconstruct: parsing, book updates and row formatting each run on their own thread.
+ *
+ * Messages are handed over in batches through SPSC rings (parse -> apply -> serialize) and the
+ * batches are recycled back to the parser, so the steady state allocates nothing. Book logic stays
+ * strictly sequential in the apply stage and the output is identical to Reconstruct's. The calling
+ * thread is the serialize stage. Per-stage statistics are written to stderr at the end.
+ * @param batchSz Messages per batch.
+ * @param pinCpus CPUs for the parse, apply and serialize stages; missing entries leave a stage unpinned.
+ * @return The pending T/F counters at the end of the input.
+ */
+template <class Side, class Writer, class Source>
+PendingTfStats ReconstructPipelined(Source& mboSrc, OutBuf& ob, size_t expMaxOrds, size_t batchSz, const std::vector<int>& pinCpus,
+                                    const PendingTfLimits& pendLim = {}) {
+    using Clock = std::chrono::steady_clock;
+    using Batch = MsgBatch<Writer::DEPTH>;
+    constexpr size_t BATCHES = 8;
+    std::vector<std::unique_ptr<Batch>> pool;
+    SpscRing<Batch*> freeQ(BATCHES), parsedQ(BATCHES), appliedQ(BATCHES);
+    for (size_t i = 0; i < BATCHES; ++i) {
+        pool.emplace_back(new Batch(batchSz));
+        *freeQ.PushSlot() = pool.back().get();
+        freeQ.Push();
+    }
+    StageStats parseSt {"parse"}, applySt {"apply"}, serSt {"serialize"};
+    applySt.occCap = parsedQ.Capacity();
+    serSt.occCap = appliedQ.Capacity();
+
+    auto pin = [&pinCpus](size_t stage, const char* name) {
+        if (stage < pinCpus.size() && !PinThisThread(pinCpus[stage])) {
+            std::cerr << "Warn: Could not pin " + std::string(name) + " stage to CPU " + std::to_string(pinCpus[stage]) + ".\n";
+        }
+    };
+    // Takes the next batch from `q`, counting the time spent waiting; nullptr once `q` is drained.
+    auto take = [](SpscRing<Batch*>& q, StageStats& st) -> Batch* {
+        Batch** b = q.Front();
+        if (!b) {
+            const auto t0 = Clock::now();
+            while (!(b = q.Front()) && !q.Drained()) WaitSpin();
+            st.waited += Clock::now() - t0;
+            if (!b) return nullptr;
+        }
+        if (st.occCap) st.SampleQueue(q.Size());
+        Batch* batch = *b;
+        q.Pop();
+        return batch;
+    };
+    auto give = [](SpscRing<Batch*>& q, Batch* batch) {
+        *q.PushSlot() = batch;  // Rings hold the whole pool, so they are never full.
+        q.Push();
+    };
+
+    std::thread parser([&] {
+        pin(0, parseSt.name);
+        const auto t0 = Clock::now();
+        for (bool more = true; more;) {
+            Batch* batch = take(freeQ, parseSt);
+            batch->n = 0;
+            while (batch->n < batchSz && (more = mboSrc.Next(batch->msgs[batch->n]))) ++batch->n;
+            parseSt.msgs += batch->n;
+            ++parseSt.batches;
+            give(parsedQ, batch);
+        }
+        parsedQ.Close();
+        parseSt.total = Clock::now() - t0;
+    });
+
+    PendingTfStats pendStats;
+    std::thread applier([&] {
+        pin(1, applySt.name);
+        const auto t0 = Clock::now();
+        MboApplier<Side, Writer::DEPTH> ap(expMaxOrds, pendLim);
+        while (Batch* batch = take(parsedQ, applySt)) {
+            ap.ApplyBatch(batch->msgs.data(), batch->n, [&](size_t i, uint32_t depth) {
+                const MboSingle& m = batch->msgs[i];
+                typename Batch::RowSnap& snap = batch->snaps[i];
+                snap.depth = depth;
+                snap.bids = ap.BidLvls(m.instrId);
+                snap.asks = ap.AskLvls(m.instrId);
+            });
+            applySt.msgs += batch->n;
+            ++applySt.batches;
+            give(appliedQ, batch);
+        }
+        pendStats = ap.PendingStats();
+        appliedQ.Close();
+        applySt.total = Clock::now() - t0;
+    });
+
+    pin(2, serSt.name);
+    const auto t0 = Clock::now();
+    Writer w(ob);
+    w.Hdr();
+    int rowIdx = 0;
+    while (Batch* batch = take(appliedQ, serSt)) {
+        for (size_t i = 0; i < batch->n; ++i) {
+            const typename Batch::RowSnap& snap = batch->snaps[i];
+            w.OnMbp(MbpViewN<Writer::DEPTH>{batch->msgs[i], snap.bids, snap.asks, rowIdx++, snap.depth});
+        }
+        serSt.msgs += batch->n;
+        ++serSt.batches;
+        give(freeQ, batch);
+    }
+    ob.Flush();
+    serSt.total = Clock::now() - t0;
+
+    parser.join();
+    applier.join();
+    std::cerr << "Pipeline stats (batch " + std::to_string(batchSz) + "):\n";
+    parseSt.Print(std::cerr);
+    applySt.Print(std::cerr);
+    serSt.Print(std::cerr);
+    return pendStats;
+}
+
+/**
+ * @brief Converts MBO CSV into a binary MBO file plus its instrument-id to symbol file.
+ * @param lines The CSV input; its first line (the header) is skipped.
+ * @param ob The binary output.
+ * @param symbols Filled with the symbols seen in the input.
+ */
+template <class Lines>
+void CsvToBinMbo(Lines& lines, OutBuf& ob, SymbolTable& symbols) {
+    auto put = [&ob](const void* v, size_t n) {
+        char* p = ob.Reserve(n);
+        std::memcpy(p, v, n);
+        ob.Commit(p + n);
+    };
+    MboBinHdr hdr {};
+    std::copy(std::begin(MBO_BIN_MAGIC), std::end(MBO_BIN_MAGIC), hdr.magic);
+    hdr.version = MBO_BIN_VERSION;
+    hdr.recBytes = sizeof(MboBinRec);
+    put(&hdr, sizeof(hdr));
+
+    CsvMboSource<Lines> src(lines, symbols);
+    MboSingle m;
+    while (src.Next(m)) {
+        MboBinRec r {};
+        r.length = sizeof(MboBinRec) / 4;
+        r.rtype = m.rtype;
+        r.pubId = m.pubId;
+        r.instrId = m.instrId;
+        r.tsEvent = ToDbnTs(m.tsEvent);
+        r.orderId = m.orderId;
+        r.price = m.price;
+        r.size = m.size;
+        r.flags = m.flags;
+        r.chanId = m.chanId;
+        r.action = m.action;
+        r.side = m.side;
+        r.tsRecv = ToDbnTs(m.tsRecv);
+        r.tsInDelta = m.tsInDelta;
+        r.sequence = m.sequence;
+        put(&r, sizeof(r));
+    }
+}
+
+#endif // RECONSTRUCTION_HPP
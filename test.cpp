@@ -0,0 +1,207 @@
+/**
+ * @file test.cpp
+ * @brief Regression checks of the reconstruction engine: row filters, the delta writer and the market
+ *        directory in process, and golden runs of the driver whose alternative modes must reproduce
+ *        the default output byte for byte. Exits non-zero if any check fails.
+ */
+#include "reconstruction.hpp"
+
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Writes the outcome of one check.
+ */
+bool Report(const std::string& name, bool ok) {
+    std::cout << name + (ok ? ": ok\n" : ": MISMATCH\n");
+    return ok;
+}
+
+/**
+ * @brief Row sink for CheckConflation: records (instrument, ts_recv) of each row it is handed.
+ */
+struct RowLog {
+    static constexpr size_t DEPTH = 1;
+
+    RowLog(OutBuf&, std::vector<std::pair<uint32_t, int64_t>>* rows) : rows_(rows) {}
+    void Hdr() {}
+    void OnMbp(const MbpViewN<DEPTH>& v) { rows_->emplace_back(v.msg.instrId, v.msg.tsRecv); }
+
+    std::vector<std::pair<uint32_t, int64_t>>* rows_;
+};
+
+/**
+ * @brief Runs two interleaved instruments through ConflatedWriter with a 100 us window and compares the
+ *        rows written against the expected ones. Instrument 1's pending row stays due after instrument 2's,
+ *        which must still be written at its own window end, before either instrument's next row.
+ */
+bool CheckConflation() {
+    constexpr int64_t US = 1000;
+    const std::pair<uint32_t, int64_t> msgs[] = {{2, 0}, {1, 10}, {1, 20}, {2, 30}, {2, 105}, {1, 112}, {2, 120}, {2, 130}, {1, 250}};
+    const std::pair<uint32_t, int64_t> expect[] = {{2, 0}, {1, 10}, {2, 30}, {1, 20}, {2, 130}, {1, 112}, {1, 250}};
+    std::vector<std::pair<uint32_t, int64_t>> rows;
+    OutBuf ob(nullptr);
+    ConflatedWriter<RowLog> w(ob, false, 100 * US, &rows);
+    TopLvlsN<1> bids {}, asks {};
+    MboSingle m {};
+    for (const auto& [instr, us] : msgs) {
+        m.instrId = instr;
+        m.tsRecv = us * US;
+        w.OnMbp(MbpViewN<1>{m, bids, asks, 0, 0});
+    }
+    w.Finish();
+    bool same = rows.size() == std::size(expect);
+    for (size_t i = 0; same && i < rows.size(); ++i) same = rows[i] == std::make_pair(expect[i].first, expect[i].second * US);
+    return Report("Conflation", same);
+}
+
+/**
+ * @brief Feeds DeltaMbpWriterN rows that leave the levels unchanged and checks that they write nothing
+ *        and are counted as skipped, while first rows, changes and due snapshots are still written.
+ */
+bool CheckDeltaSkips() {
+    OutBuf ob(nullptr);
+    DeltaMbpWriterN<1> w(ob, 3);
+    MboSingle m {};
+    m.symbol = "Q";
+    const TopLvlsN<1> none {}, a {PriceLvl{100, 10, 1}}, b {PriceLvl{100, 20, 2}};
+    // Instrument 7: snapshot, unchanged, delta, snapshot due after 3 messages though unchanged, unchanged.
+    // Instrument 8 sends its own first snapshot in the middle.
+    const std::pair<uint32_t, const TopLvlsN<1>*> rows[] = {{7, &a}, {7, &a}, {8, &a}, {7, &b}, {7, &b}, {7, &b}};
+    int rowIdx = 0;
+    for (const auto& [instr, bids] : rows) {
+        m.instrId = instr;
+        w.OnMbp(MbpViewN<1>{m, *bids, none, rowIdx++, 0});
+    }
+    std::string kinds;
+    const std::string_view out = ob.View();
+    for (size_t at = 0; (at = out.find(",Q,0,", at)) != std::string_view::npos; at += 5) kinds += out[at + 5];
+    return Report("Delta rows without level changes", kinds == "SSDS" && w.Skipped() == 2);
+}
+
+/**
+ * @brief Spreads books over instrument ids on both sides of the direct row table (up to 4e9) and nine
+ *        publishers with sparse ids, so the cell rows are widened twice while already filled, and checks
+ *        that every book is found and aggregated and that unseen pairs stay empty. Each book gets a top
+ *        level shared by the instrument's publishers and a second level of its own one tick below.
+ */
+bool CheckCellIndexing() {
+    const uint32_t instrs[] = {0, 3, 65535, 65536, 1048575, 4000000000u};
+    const uint16_t pubs[] = {1, 2, 3, 4, 5, 300, 9, 65535, 7};
+    Market<VecSide, 1> mk;
+    MboSingle m {};
+    m.action = Act::Add;
+    m.side = Sd::Bid;
+    for (size_t p = 0; p < std::size(pubs); ++p) {
+        for (size_t i = 0; i < std::size(instrs); ++i) {
+            m.instrId = instrs[i];
+            m.pubId = pubs[p];
+            m.price = static_cast<int64_t>(1000 + i) * 1000000000LL;
+            m.size = static_cast<uint32_t>(p + 1);
+            ++m.orderId;
+            mk.Apply(m);
+            m.price -= 10000000;
+            ++m.orderId;
+            mk.Apply(m);
+        }
+    }
+    bool ok = true;
+    for (size_t i = 0; i < std::size(instrs); ++i) {
+        const TopLvlsN<1>& top = mk.GetAggBidLvls(instrs[i]);
+        ok &= top[0].price == static_cast<int64_t>(1000 + i) * 1000000000LL && top[0].size == 45 && top[0].count == 9;
+        const int64_t second = top[0].price - 10000000;
+        for (const uint16_t pub : pubs) ok &= mk.GetLevelDepth(instrs[i], pub, second, Sd::Bid) == 1;
+        ok &= mk.GetLevelDepth(instrs[i], 8, second, Sd::Bid) == 0;
+    }
+    ok &= mk.GetAggBidLvls(1)[0].IsEmpty() && mk.GetAggBidLvls(70000)[0].IsEmpty();
+    return Report("Market cell indexing", ok);
+}
+
+/**
+ * @brief Runs the reconstruction driver in its alternative modes and compares each output with the default run.
+ */
+class GoldenRuns {
+public:
+    GoldenRuns(std::string driver, std::string input)
+        : driver_(std::move(driver)),
+          input_(std::move(input)),
+          dir_(fs::temp_directory_path() / ("recon_test_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()))) {
+        fs::create_directories(dir_);
+    }
+    ~GoldenRuns() {
+        std::error_code ec;
+        fs::remove_all(dir_, ec);
+    }
+
+    bool Run() {
+        if (!Exec(Quote(driver_) + " " + Quote(input_) + " --log-rate 0 --output " + Path("ref.csv")) || (ref_ = Read("ref.csv")).empty()) {
+            return Report("Golden reference run", false);
+        }
+        bool ok = true;
+        for (const char* args : {"--threads 3", "--pipeline --batch 64", "--preparse 3", "--book-layout map", "--no-mmap"}) {
+            ok &= Compare(std::string("Golden ") + args, Reconstruct(Quote(input_), std::string(args) + " --output " + Path("run.csv")), "run.csv");
+        }
+        ok &= Compare("Golden stdin", Reconstruct("- < " + Quote(input_), "--output " + Path("stdin.csv")), "stdin.csv");
+        ok &= Compare("Golden --format bin + --bin2csv",
+                      Reconstruct(Quote(input_), "--format bin --output " + Path("mbp.bin")) &&
+                          Exec(Quote(driver_) + " --bin2csv " + Path("mbp.bin") + " " + Path("bin.csv")),
+                      "bin.csv");
+        ok &= Compare("Golden --csv2mbo + --mbo-format bin",
+                      Exec(Quote(driver_) + " --csv2mbo " + Quote(input_) + " " + Path("mbo.bin") + " " + Path("syms.csv")) &&
+                          Reconstruct(Path("mbo.bin"), "--mbo-format bin --symbols " + Path("syms.csv") + " --output " + Path("mbo.csv")),
+                      "mbo.csv");
+        ok &= Compare("Golden --checkpoint",
+                      Reconstruct(Quote(input_), "--checkpoint " + Path("ckpt") + " --checkpoint-every 1000 --output " + Path("ckpt.csv")),
+                      "ckpt.csv");
+        // Resumes at the last checkpoint: the output is cut back to it and the rest written again.
+        ok &= Compare("Golden --restore", Reconstruct(Quote(input_), "--restore " + Path("ckpt") + " --output " + Path("ckpt.csv")), "ckpt.csv");
+        return ok;
+    }
+
+private:
+    static std::string Quote(const std::string& s) { return "'" + s + "'"; }
+    std::string Path(const char* name) const { return Quote((dir_ / name).string()); }
+
+    std::string Read(const char* name) const {
+        std::ifstream is(dir_ / name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(is), {});
+    }
+
+    bool Exec(const std::string& cmd) const {
+        // The driver's notes and warnings go to a log, so only the check results are printed.
+        if (std::system((cmd + " >> " + Path("log") + " 2>&1").c_str()) == 0) return true;
+        std::cout << "  failed: " + cmd + "\n";
+        return false;
+    }
+
+    bool Reconstruct(const std::string& input, const std::string& args) const {
+        return Exec(Quote(driver_) + " " + input + " --log-rate 0 " + args);
+    }
+
+    bool Compare(const std::string& name, bool ran, const char* out) const { return Report(name, ran && Read(out) == ref_); }
+
+    std::string driver_;
+    std::string input_;
+    fs::path dir_;
+    std::string ref_;
+};
+
+/**
+ * @brief Test driver: runs the in-process checks, then the golden runs of the driver given on the command line.
+ */
+int main(int argc, char* argv[]) {
+    if (argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " [reconstruction_driver [mbo_input_file.csv]]\n"
+                  << "  Defaults: ./reconstruction_aman.exe and mbo.csv.\n";
+        return 1;
+    }
+    const std::string driver = argc > 1 ? argv[1] : "./reconstruction_aman.exe";
+    const std::string input = argc > 2 ? argv[2] : "mbo.csv";
+    bool ok = CheckConflation();
+    ok &= CheckDeltaSkips();
+    ok &= CheckCellIndexing();
+    ok &= GoldenRuns(driver, input).Run();
+    std::cout << (ok ? "All checks passed\n" : "Some checks FAILED\n");
+    return ok ? 0 : 1;
+}